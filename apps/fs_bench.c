@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define fs_bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+#define USAGE "Usage: <workload> <diskname> [<file size>]\n" \
+	"Workloads are:\n" \
+	"\tcompress\n" \
+	"\tblocks"
+
+/* Size written to a file through each fs_write() and read by each fs_read() */
+#define CHUNK_SIZE (64 * 1024)
+
+/* Number and largest size of the files written by the small file workload */
+#define SMALL_FILES 100
+#define SMALL_FILE_MAX 3000
+
+#define MIB (1024.0 * 1024.0)
+
+struct result {
+	double write_secs;
+	double read_secs;
+	/* Bytes of the virtual disk file actually stored on the host */
+	size_t disk_bytes;
+};
+
+static size_t get_size(const char *arg)
+{
+	char *end;
+	unsigned long long ret = strtoull(arg, &end, 0);
+
+	if (end == arg || *end != '\0' || ret == 0)
+		die("invalid size '%s'", arg);
+	return (size_t)ret;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Lines of words picked at random, about as compressible as log files */
+static void fill_text(char *buf, size_t size)
+{
+	static const char *words[] = {
+		"request", "served", "in", "ms", "from", "cache", "user", "id",
+		"GET", "POST", "/api/v1/files", "status", "200", "404", "error",
+		"the", "block", "was", "written", "to", "disk", "at", "offset",
+	};
+	unsigned int seed = 1;
+	size_t len = 0;
+
+	while (len < size) {
+		const char *word = words[rand_r(&seed) % (sizeof(words) /
+							 sizeof(words[0]))];
+		size_t word_len = strlen(word);
+
+		if (word_len > size - len)
+			word_len = size - len;
+		memcpy(buf + len, word, word_len);
+		len += word_len;
+		if (len < size)
+			buf[len++] = rand_r(&seed) % 8 ? ' ' : '\n';
+	}
+}
+
+static void fill_random(char *buf, size_t size)
+{
+	unsigned int seed = 1;
+
+	for (size_t i = 0; i < size; i++)
+		buf[i] = rand_r(&seed);
+}
+
+static size_t disk_bytes(const char *diskname)
+{
+	struct stat st;
+
+	if (stat(diskname, &st))
+		die_perror("stat");
+	return (size_t)st.st_blocks * 512;
+}
+
+/*
+ * Time writing @size bytes of @data to a new file, unmount included so that
+ * every block is on disk, then reading them back from a fresh mount
+ */
+static void bench_file(const char *diskname, size_t blk_size, const char *data,
+		       size_t size, int compress, struct result *res)
+{
+	struct fs_format_opts opts = { .block_size = blk_size };
+	char *buf;
+	double start;
+	int fd;
+
+	/* Room for the file stored as is, and for the directory and FAT */
+	if (fs_format(diskname, size / blk_size + 64, &opts))
+		die("Cannot format diskname");
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	if (fs_create("bench"))
+		die("Cannot create file");
+	if (compress && fs_compress("bench"))
+		die("Cannot compress file");
+
+	start = now();
+	fd = fs_open("bench");
+	if (fd < 0)
+		die("Cannot open file");
+	for (size_t off = 0; off < size; off += CHUNK_SIZE) {
+		size_t len = size - off < CHUNK_SIZE ? size - off : CHUNK_SIZE;
+
+		if (fs_write(fd, (char *)data + off, len) != (int)len)
+			die("Cannot write file");
+	}
+	fs_close(fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	res->write_secs = now() - start;
+	res->disk_bytes = disk_bytes(diskname);
+
+	buf = malloc(CHUNK_SIZE);
+	if (!buf)
+		die_perror("malloc");
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	start = now();
+	fd = fs_open("bench");
+	if (fd < 0)
+		die("Cannot open file");
+	for (size_t off = 0; off < size; off += CHUNK_SIZE) {
+		size_t len = size - off < CHUNK_SIZE ? size - off : CHUNK_SIZE;
+
+		if (fs_read(fd, buf, len) != (int)len)
+			die("Cannot read file");
+		if (memcmp(buf, data + off, len))
+			die("File reads back wrong at offset %zu", off);
+	}
+	fs_close(fd);
+	res->read_secs = now() - start;
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	free(buf);
+}
+
+/*
+ * Time writing %SMALL_FILES files of random sizes up to %SMALL_FILE_MAX bytes,
+ * then reading them back, return the number of bytes in them
+ */
+static size_t bench_small(const char *diskname, size_t blk_size,
+			  struct result *res)
+{
+	struct fs_format_opts opts = { .block_size = blk_size };
+	char filename[FS_FILENAME_LEN];
+	char data[SMALL_FILE_MAX], buf[SMALL_FILE_MAX];
+	size_t sizes[SMALL_FILES], total = 0;
+	unsigned int seed = 1;
+	double start;
+	int fd;
+
+	fill_text(data, SMALL_FILE_MAX);
+	for (int i = 0; i < SMALL_FILES; i++) {
+		sizes[i] = rand_r(&seed) % SMALL_FILE_MAX + 1;
+		total += sizes[i];
+	}
+
+	if (fs_format(diskname, SMALL_FILES * (SMALL_FILE_MAX / blk_size + 1) +
+		      64, &opts))
+		die("Cannot format diskname");
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	start = now();
+	for (int i = 0; i < SMALL_FILES; i++) {
+		snprintf(filename, sizeof(filename), "small%d", i);
+		if (fs_create(filename))
+			die("Cannot create file");
+		fd = fs_open(filename);
+		if (fd < 0)
+			die("Cannot open file");
+		if (fs_write(fd, data, sizes[i]) != (int)sizes[i])
+			die("Cannot write file");
+		fs_close(fd);
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	res->write_secs = now() - start;
+	res->disk_bytes = disk_bytes(diskname);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	start = now();
+	for (int i = 0; i < SMALL_FILES; i++) {
+		snprintf(filename, sizeof(filename), "small%d", i);
+		fd = fs_open(filename);
+		if (fd < 0)
+			die("Cannot open file");
+		if (fs_read(fd, buf, sizes[i]) != (int)sizes[i])
+			die("Cannot read file");
+		if (memcmp(buf, data, sizes[i]))
+			die("File '%s' reads back wrong", filename);
+		fs_close(fd);
+	}
+	res->read_secs = now() - start;
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	return total;
+}
+
+static void print_result(const char *name, size_t size,
+			 const struct result *res)
+{
+	printf("%-18s write %8.1f MiB/s  read %8.1f MiB/s  disk %8zu KiB\n",
+	       name, size / MIB / res->write_secs, size / MIB / res->read_secs,
+	       res->disk_bytes / 1024);
+}
+
+/* Text and random data, each stored as is and compressed */
+static void bench_compress(const char *diskname, size_t size)
+{
+	char *data = malloc(size);
+	struct result res;
+
+	if (!data)
+		die_perror("malloc");
+
+	fill_text(data, size);
+	bench_file(diskname, 4096, data, size, 0, &res);
+	print_result("text", size, &res);
+	bench_file(diskname, 4096, data, size, 1, &res);
+	print_result("text compressed", size, &res);
+
+	fill_random(data, size);
+	bench_file(diskname, 4096, data, size, 0, &res);
+	print_result("random", size, &res);
+	bench_file(diskname, 4096, data, size, 1, &res);
+	print_result("random compressed", size, &res);
+
+	free(data);
+}
+
+/* A large file and many small ones, at block sizes from 512 B to 64 KiB */
+static void bench_blocks(const char *diskname, size_t size)
+{
+	static const size_t blk_sizes[] = { 512, 4096, 16384, 65536 };
+	char *data = malloc(size);
+	char name[32];
+	struct result res;
+	size_t total;
+
+	if (!data)
+		die_perror("malloc");
+	fill_random(data, size);
+
+	for (size_t i = 0; i < sizeof(blk_sizes) / sizeof(blk_sizes[0]); i++) {
+		bench_file(diskname, blk_sizes[i], data, size, 0, &res);
+		snprintf(name, sizeof(name), "large %zu", blk_sizes[i]);
+		print_result(name, size, &res);
+	}
+	for (size_t i = 0; i < sizeof(blk_sizes) / sizeof(blk_sizes[0]); i++) {
+		total = bench_small(diskname, blk_sizes[i], &res);
+		snprintf(name, sizeof(name), "small %zu", blk_sizes[i]);
+		print_result(name, total, &res);
+	}
+
+	free(data);
+}
+
+int main(int argc, char **argv)
+{
+	char *workload, *diskname;
+	size_t size = 16 * 1024 * 1024;
+
+	if (argc < 3 || argc > 4)
+		die(USAGE);
+
+	workload = argv[1];
+	diskname = argv[2];
+	if (argc == 4)
+		size = get_size(argv[3]);
+
+	if (!strcmp(workload, "compress"))
+		bench_compress(diskname, size);
+	else if (!strcmp(workload, "blocks"))
+		bench_blocks(diskname, size);
+	else
+		die(USAGE);
+
+	unlink(diskname);
+
+	return 0;
+}
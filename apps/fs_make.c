@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define fs_make_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_make_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+#define USAGE "Usage: [-3] [-b <block size>] [-f <filename>[:<size>]]... " \
+	"<diskname> <data block count>"
+
+static size_t get_size(const char *arg)
+{
+	char *end;
+	unsigned long long ret = strtoull(arg, &end, 0);
+
+	if (end == arg || *end != '\0')
+		die("invalid size '%s'", arg);
+	return (size_t)ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_format_opts opts = { 0 };
+	struct fs_format_file *files = NULL;
+	char *diskname, *size;
+	size_t count;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "3b:f:")) != -1) {
+		switch (opt) {
+		case '3':
+			opts.flags |= FS_FORMAT_FAT32;
+			break;
+		case 'b':
+			opts.block_size = get_size(optarg);
+			break;
+		case 'f':
+			/* Files are created in order, their blocks one after the other */
+			files = realloc(files, (opts.num_files + 1) * sizeof(*files));
+			if (!files)
+				die_perror("realloc");
+			size = strchr(optarg, ':');
+			if (size)
+				*size++ = '\0';
+			files[opts.num_files].filename = optarg;
+			files[opts.num_files].size = size ? get_size(size) : 0;
+			opts.num_files++;
+			break;
+		default:
+			die(USAGE);
+		}
+	}
+
+	if (argc - optind != 2)
+		die(USAGE);
+
+	diskname = argv[optind];
+	count = get_size(argv[optind + 1]);
+	opts.files = files;
+
+	if (fs_format(diskname, count, &opts))
+		die("Cannot format diskname");
+
+	printf("Created virtual disk '%s' with '%zu' data blocks\n", diskname,
+	       count);
+	free(files);
+
+	return 0;
+}
@@ -1,6 +1,10 @@
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,236 +38,333 @@ struct thread_arg {
 	char **argv;
 };
 
-void thread_fs_script(void *arg)
+/* Every command mounts the disk on its own, only read the FAT it touches */
+static const struct fs_mount_opts mount_opts = { .flags = FS_MOUNT_LAZY };
+
+/* Commands that only read can run alongside each other on the same disk */
+static const struct fs_mount_opts read_mount_opts = {
+	.flags = FS_MOUNT_LAZY | FS_MOUNT_RDONLY | FS_MOUNT_MMAP
+};
+
+/* Mount flag named in a script or on a batch command line, 0 if unknown */
+static int mount_flag(const char *name)
+{
+	if (strcmp(name, "SPARSE") == 0)
+		return FS_MOUNT_SPARSE;
+	if (strcmp(name, "DISCARD") == 0)
+		return FS_MOUNT_DISCARD;
+	if (strcmp(name, "DEDUP") == 0)
+		return FS_MOUNT_DEDUP;
+	if (strcmp(name, "PACK") == 0)
+		return FS_MOUNT_PACK;
+	if (strcmp(name, "MMAP") == 0)
+		return FS_MOUNT_MMAP;
+	if (strcmp(name, "RDONLY") == 0)
+		return FS_MOUNT_RDONLY;
+	return 0;
+}
+
+struct script_state {
+	char *diskname;
+	int fs_fd;
+	char mounted;
+	/* Disk mounted by a batch, MOUNT and UMOUNT leave it alone */
+	char batch;
+	/* A line without a command was reached */
+	char done;
+};
+
+/* A failed line ends a script, but only fails the command in a batch */
+#define script_error(state, msg)		\
+do {							\
+	if (!(state)->batch) {			\
+		fs_umount();			\
+		die(msg);			\
+	}					\
+	return msg;				\
+} while (0)
+
+#define script_perror(state, msg)		\
+do {							\
+	if (!(state)->batch) {			\
+		fs_umount();			\
+		die_perror(msg);		\
+	}					\
+	return strerror(errno);			\
+} while (0)
+
+/*
+ * Run one line of a script, return NULL if it ran or an error message if it
+ * failed in a batch
+ */
+static const char *script_line(char *line_buffer, struct script_state *state)
 {
-	struct thread_arg *t_arg = arg;
 	struct stat st;
-	char *diskname, *script;
-	FILE *fd_script;
 	char *command, *data_source, *data_description, *data, *fs_filename;
 	const int total_command_parts = 4;
 	char *command_args[total_command_parts];
 	int offset;
-	char mounted = 0;
-
-	char line_buffer[1024];
 	int command_index = 1;
 
-	if (t_arg->argc < 2)
-		die("Usage: <diskname> <script filename>");
+	/* Remove trailing newline from command line */
+	char *nl = strchr(line_buffer, '\n');
+	if (nl)
+		*nl = '\0';
 
-	diskname = t_arg->argv[0];
-	script = t_arg->argv[1];
+	/* Tokenize line */
+	command_args[0] = strtok(line_buffer, "\t");
+	command_index = 1;
+	do {
+		command_args[command_index] = strtok(NULL, "\t");
+	} while (command_index < total_command_parts && command_args[command_index++] != NULL);
+	command = command_args[0];
 
-	/* Open script on host computer */
-	fd_script = fopen(script, "r");
-	if (!fd_script)
-		die_perror("fopen");
+	int data_fd;
+	int count, data_size;
 
-	int fs_fd = -1;
+	char *read_buf;
 
-	/* Loop through the script and execute the specified commands */
-	while (fgets(line_buffer, 1024, fd_script) != NULL) {
-		/* Remove trailing newline from command line */
-		char *nl = strchr(line_buffer, '\n');
-		if (nl)
-			*nl = '\0';
-
-		/* Tokenize line */
-		command_args[0] = strtok(line_buffer, "\t");
-		command_index = 1;
-		do {
-			command_args[command_index] = strtok(NULL, "\t");
-		} while (command_index < total_command_parts && command_args[command_index++] != NULL);
-		command = command_args[0];
-
-		int data_fd;
-		int count, data_size;
-
-		char *read_buf;
-
-		/* End when no command present */
-		if (!command)
-			break;
+	/* End when no command present */
+	if (!command) {
+		state->done = 1;
+		return NULL;
+	}
 
-		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
-				die("Cannot mount disk");
-			else {
-				printf("MOUNT successful.\n");
-				mounted = 1;
-			}
+	if (strcmp(command, "MOUNT") == 0) {
+		struct fs_mount_opts script_opts = mount_opts;
 
-		} else if (strcmp(command, "UMOUNT") == 0) {
-			if (mounted && fs_umount())
-				die("Cannot unmount");
-			else {
-				printf("UMOUNT successful.\n");
-				mounted = 0;
-			}
+		/* A batch keeps the disk mounted for all of its commands */
+		if (state->batch) {
+			printf("MOUNT successful.\n");
+			return NULL;
+		}
 
-		} else if (strcmp(command, "CREATE") == 0) {
-			fs_filename = command_args[1];
+		/* Optional mount flags follow the command */
+		for (int i = 1; i < total_command_parts && command_args[i]; i++) {
+			int flag = mount_flag(command_args[i]);
 
-			if(fs_create(fs_filename)) {
-				fs_umount();
-				die("Cannot create file");
-			}
+			if (!flag)
+				die("Unknown mount flag");
+			script_opts.flags |= flag;
+		}
 
-			printf("CREATE successful.\n");
+		if (fs_mount_ext(state->diskname, &script_opts))
+			die("Cannot mount disk");
+		else {
+			printf("MOUNT successful.\n");
+			state->mounted = 1;
+		}
 
-		} else if (strcmp(command, "DELETE") == 0) {
-			fs_filename = command_args[1];
+	} else if (strcmp(command, "UMOUNT") == 0) {
+		if (state->batch) {
+			printf("UMOUNT successful.\n");
+		} else if (state->mounted && fs_umount())
+			die("Cannot unmount");
+		else {
+			printf("UMOUNT successful.\n");
+			state->mounted = 0;
+		}
 
-			if(fs_delete(fs_filename)) {
-				fs_umount();
-				die("Cannot delete file");
-			}
+	} else if (strcmp(command, "CREATE") == 0) {
+		fs_filename = command_args[1];
 
-			printf("DELETE successful.\n");
+		if(fs_create(fs_filename))
+			script_error(state, "Cannot create file");
 
-		} else if (strcmp(command, "OPEN") == 0) {
-			fs_filename = command_args[1];
+		printf("CREATE successful.\n");
 
-			fs_fd = fs_open(fs_filename);
+	} else if (strcmp(command, "DELETE") == 0) {
+		fs_filename = command_args[1];
 
-			if (fs_fd < 0) {
-				fs_umount();
-				die("Cannot open file");
-			}
+		if(fs_delete(fs_filename))
+			script_error(state, "Cannot delete file");
 
-			printf("OPEN successful.\n");
+		printf("DELETE successful.\n");
 
-		} else if (strcmp(command, "CLOSE") == 0) {
-			if (fs_close(fs_fd)) {
-				fs_umount();
-				die("Cannot close file");
-			}
+	} else if (strcmp(command, "MKDIR") == 0) {
+		fs_filename = command_args[1];
 
-			printf("CLOSE successful.\n");
+		if(fs_mkdir(fs_filename))
+			script_error(state, "Cannot create directory");
 
-		} else if (strcmp(command, "SEEK") == 0) {
-			offset = atoi(command_args[1]);
+		printf("MKDIR successful.\n");
 
-			if (fs_lseek(fs_fd, offset)) {
-				fs_umount();
-				die("Cannot seek to position");
-			} else {
-				printf("SEEK successful.\n");
-			}
+	} else if (strcmp(command, "RMDIR") == 0) {
+		fs_filename = command_args[1];
 
-		} else if (strcmp(command, "WRITE") == 0) {
-			data_source = command_args[1];
-			data_description = command_args[2];
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
-				data_size = st.st_size;
-				data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, data_fd, 0);
-			} else {
-				data = NULL;
-				data_size = 0;
-			}
+		if(fs_rmdir(fs_filename))
+			script_error(state, "Cannot delete directory");
 
-			if (!data) {
-				fs_umount();
-				die_perror("Could not find data to write");
-			}
+		printf("RMDIR successful.\n");
 
-			count = fs_write(fs_fd, data, data_size);
-			if (count < 0) {
-				fs_umount();
-				die("write error");
-			}
-			printf("Wrote %d bytes to file.\n", count);
-
-		} else if (strcmp(command, "READ") == 0) {
-			int read_req_length = atoi(command_args[1]);
-			data_source = command_args[2];
-			data_description = command_args[3];
-
-			char file_loaded = 0;
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
-
-				FILE *data_file = fopen(data_description, "r");
-				data_size = st.st_size;
-				data = calloc(data_size+1, sizeof(char));
-				size_t n = fread (data, sizeof(char), data_size, data_file);
-				assert(n == sizeof(char) * data_size);
-				fclose(data_file);
-				file_loaded = 1;
-			} else {
-				fs_umount();
-				die("Invalid data description");
-			}
+	} else if (strcmp(command, "OPEN") == 0) {
+		fs_filename = command_args[1];
 
-			if (!data) {
-				fs_umount();
-				die_perror("Could not find data to write");
+		state->fs_fd = fs_open(fs_filename);
+
+		if (state->fs_fd < 0)
+			script_error(state, "Cannot open file");
+
+		printf("OPEN successful.\n");
+
+	} else if (strcmp(command, "CLOSE") == 0) {
+		if (fs_close(state->fs_fd))
+			script_error(state, "Cannot close file");
+
+		printf("CLOSE successful.\n");
+
+	} else if (strcmp(command, "SEEK") == 0) {
+		offset = atoi(command_args[1]);
+
+		if (fs_lseek(state->fs_fd, offset)) {
+			script_error(state, "Cannot seek to position");
+		} else {
+			printf("SEEK successful.\n");
+		}
+
+	} else if (strcmp(command, "TRUNCATE") == 0) {
+		offset = atoi(command_args[1]);
+
+		if (fs_ftruncate(state->fs_fd, offset)) {
+			script_error(state, "Cannot truncate file");
+		} else {
+			printf("TRUNCATE successful.\n");
+		}
+
+	} else if (strcmp(command, "WRITE") == 0) {
+		data_source = command_args[1];
+		data_description = command_args[2];
+
+		if (strcmp(data_source, "DATA") == 0) {
+			data = data_description;
+			data_size = strlen(data);
+		} else if (strcmp(data_source, "FILE") == 0) {
+			data_fd = open(data_description, O_RDONLY);
+			if (data_fd < 0)
+				script_perror(state, "open");
+			if (fstat(data_fd, &st)) {
+				close(data_fd);
+				script_perror(state, "fstat");
+			}
+			if (!S_ISREG(st.st_mode)) {
+				close(data_fd);
+				script_error(state, "Not a regular file");
 			}
+			data_size = st.st_size;
+			data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, data_fd, 0);
+			close(data_fd);
+			if (data == MAP_FAILED)
+				data = NULL;
+		} else {
+			data = NULL;
+			data_size = 0;
+		}
 
-			if (read_req_length < 0) {
-				fs_umount();
-				die("invalid data read length");
+		if (!data)
+			script_perror(state, "Could not find data to write");
+
+		count = fs_write(state->fs_fd, data, data_size);
+		if (strcmp(data_source, "FILE") == 0)
+			munmap(data, data_size);
+		if (count < 0)
+			script_error(state, "write error");
+		printf("Wrote %d bytes to file.\n", count);
+
+	} else if (strcmp(command, "READ") == 0) {
+		int read_req_length = atoi(command_args[1]);
+		data_source = command_args[2];
+		data_description = command_args[3];
+
+		char file_loaded = 0;
+
+		if (strcmp(data_source, "DATA") == 0) {
+			data = data_description;
+			data_size = strlen(data);
+		} else if (strcmp(data_source, "FILE") == 0) {
+			data_fd = open(data_description, O_RDONLY);
+			if (data_fd < 0)
+				script_perror(state, "open");
+			if (fstat(data_fd, &st)) {
+				close(data_fd);
+				script_perror(state, "fstat");
 			}
+			close(data_fd);
+			if (!S_ISREG(st.st_mode))
+				script_error(state, "Not a regular file");
+
+			FILE *data_file = fopen(data_description, "r");
+			data_size = st.st_size;
+			data = calloc(data_size+1, sizeof(char));
+			size_t n = fread (data, sizeof(char), data_size, data_file);
+			assert(n == sizeof(char) * data_size);
+			fclose(data_file);
+			file_loaded = 1;
+		} else {
+			script_error(state, "Invalid data description");
+		}
 
-			read_buf = calloc(read_req_length+1, sizeof(char));
-			count = fs_read(fs_fd, read_buf, read_req_length);
+		if (!data)
+			script_perror(state, "Could not find data to write");
 
-			if (count < 0) {
-				fs_umount();
-				die("read error");
-			}
+		if (read_req_length < 0) {
+			if (file_loaded)
+				free(data);
+			script_error(state, "invalid data read length");
+		}
 
-			// both data and read_buf were allocated with an extra zero byte
-			// +1 here to check for the canaries
-			if (memcmp(data, read_buf, data_size+1) == 0)
-				printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
-			else
-				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+		read_buf = calloc(read_req_length+1, sizeof(char));
+		count = fs_read(state->fs_fd, read_buf, read_req_length);
 
+		if (count < 0) {
 			free(read_buf);
-			if(file_loaded){
+			if (file_loaded)
 				free(data);
-			}
+			script_error(state, "read error");
+		}
+
+		// both data and read_buf were allocated with an extra zero byte
+		// +1 here to check for the canaries
+		if (memcmp(data, read_buf, data_size+1) == 0)
+			printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
+		else
+			printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+
+		free(read_buf);
+		if(file_loaded){
+			free(data);
 		}
 	}
 
+	return NULL;
+}
+
+void thread_fs_script(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct script_state state = { .fs_fd = -1 };
+	char *script;
+	FILE *fd_script;
+
+	char line_buffer[1024];
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <script filename>");
+
+	state.diskname = t_arg->argv[0];
+	script = t_arg->argv[1];
+
+	/* Open script on host computer */
+	fd_script = fopen(script, "r");
+	if (!fd_script)
+		die_perror("fopen");
+
+	/* Loop through the script and execute the specified commands */
+	while (!state.done && fgets(line_buffer, 1024, fd_script) != NULL)
+		script_line(line_buffer, &state);
+
 	/* unmount at the end just to be safe in case there is
 	   no UMOUNT command in script */
-	if (mounted && fs_umount())
+	if (state.mounted && fs_umount())
 		die("Cannot unmount diskname");
 
 	fclose(fd_script);
@@ -282,7 +383,7 @@ void thread_fs_stat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_ext(diskname, &read_mount_opts))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -316,12 +417,213 @@ void thread_fs_stat(void *arg)
 	printf("Size of file '%s' is %d bytes\n", filename, stat);
 }
 
+/* Size of the chunks moved between host files and the file system */
+#define HOST_CHUNK (256 * 1024)
+
+/*
+ * Two buffers passed back and forth between a command and a thread doing the
+ * host side of a transfer, so that host reads or writes of one chunk
+ * overlap with the file system I/O of the other
+ */
+struct host_pipe {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;
+	char *buf[2];
+	/* Bytes in each buffer, -1 while it is free, 0 at the end of the data */
+	ssize_t len[2];
+	/* Set by the command to stop a reading thread early */
+	int stop;
+	/* errno of the first failed host read or write */
+	int error;
+};
+
+/*
+ * Wait until buffer @slot holds data, or is free if @full is 0; a stopped
+ * reading thread gets 0 instead of a free buffer
+ */
+static ssize_t host_pipe_wait(struct host_pipe *p, int slot, int full)
+{
+	ssize_t len;
+
+	pthread_mutex_lock(&p->lock);
+	while ((p->len[slot] >= 0) != full && !(p->stop && !full))
+		pthread_cond_wait(&p->cond, &p->lock);
+	len = p->stop && !full ? 0 : p->len[slot];
+	pthread_mutex_unlock(&p->lock);
+
+	return len;
+}
+
+/* Hand buffer @slot over to the other side, with @len bytes or freed */
+static void host_pipe_put(struct host_pipe *p, int slot, ssize_t len)
+{
+	pthread_mutex_lock(&p->lock);
+	p->len[slot] = len;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void *host_pipe_reader(void *arg)
+{
+	struct host_pipe *p = arg;
+	ssize_t len, ret;
+
+	for (int slot = 0;; slot ^= 1) {
+		if (!host_pipe_wait(p, slot, 0))
+			break;
+
+		/* Fill whole chunks so that the file system writes whole blocks */
+		for (len = 0; len < HOST_CHUNK; len += ret) {
+			ret = read(p->fd, p->buf[slot] + len, HOST_CHUNK - len);
+			if (ret < 0) {
+				p->error = errno;
+				len = 0;
+			}
+			if (ret <= 0)
+				break;
+		}
+
+		host_pipe_put(p, slot, len);
+		if (!len)
+			break;
+	}
+
+	return NULL;
+}
+
+static void *host_pipe_writer(void *arg)
+{
+	struct host_pipe *p = arg;
+	ssize_t len, ret;
+
+	for (int slot = 0;; slot ^= 1) {
+		len = host_pipe_wait(p, slot, 1);
+		if (!len)
+			break;
+
+		/* Keep taking chunks after an error so the batch never blocks */
+		for (char *buf = p->buf[slot]; len && !p->error; len -= ret) {
+			ret = write(p->fd, buf, len);
+			if (ret < 0)
+				p->error = errno;
+			else
+				buf += ret;
+		}
+
+		host_pipe_put(p, slot, -1);
+	}
+
+	return NULL;
+}
+
+static int host_pipe_start(struct host_pipe *p, int fd, void *(*func)(void *))
+{
+	memset(p, 0, sizeof(*p));
+	p->fd = fd;
+	p->len[0] = p->len[1] = -1;
+	p->buf[0] = malloc(2 * HOST_CHUNK);
+	if (!p->buf[0])
+		return -1;
+	p->buf[1] = p->buf[0] + HOST_CHUNK;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	if (pthread_create(&p->thread, NULL, func, p)) {
+		free(p->buf[0]);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Stop the host thread, return the errno of its first failure or 0 */
+static int host_pipe_end(struct host_pipe *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	pthread_join(p->thread, NULL);
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p->buf[0]);
+
+	return p->error;
+}
+
+/* Copy host file @fd into open file @fs_fd, return the bytes copied or -1 */
+static ssize_t host_import(int fs_fd, int fd)
+{
+	struct host_pipe p;
+	ssize_t len, total = 0;
+
+	if (host_pipe_start(&p, fd, host_pipe_reader))
+		return -1;
+
+	for (int slot = 0;; slot ^= 1) {
+		len = host_pipe_wait(&p, slot, 1);
+		if (!len)
+			break;
+		if (fs_write(fs_fd, p.buf[slot], len) != len) {
+			total = -1;
+			break;
+		}
+		total += len;
+		host_pipe_put(&p, slot, -1);
+	}
+
+	if (host_pipe_end(&p))
+		return -1;
+
+	return total;
+}
+
+/*
+ * Copy open file @fs_fd into host file @fd, from its file offset on, return the
+ * bytes copied, short if the rest cannot be read, or -1 if @fd cannot be written
+ */
+static ssize_t host_export(int fs_fd, int fd)
+{
+	struct host_pipe p;
+	ssize_t len, total = 0;
+
+	/* Let the host kernel send the blocks straight from the disk image */
+	while ((len = fs_sendfile(fs_fd, fd, HOST_CHUNK)) > 0)
+		total += len;
+	if (!len)
+		return total;
+
+	/* It cannot send to @fd, or failed partway: copy the rest in user space */
+	if (host_pipe_start(&p, fd, host_pipe_writer))
+		return -1;
+
+	for (int slot = 0;; slot ^= 1) {
+		host_pipe_wait(&p, slot, 0);
+		len = fs_read(fs_fd, p.buf[slot], HOST_CHUNK);
+		if (len <= 0) {
+			host_pipe_put(&p, slot, 0);
+			break;
+		}
+		total += len;
+		host_pipe_put(&p, slot, len);
+	}
+
+	if (host_pipe_end(&p))
+		return -1;
+
+	return total;
+}
+
 void thread_fs_cat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
+	ssize_t read;
 	int fs_fd;
-	int stat, read;
+	int stat;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -329,7 +631,7 @@ void thread_fs_cat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_ext(diskname, &read_mount_opts))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -348,14 +650,12 @@ void thread_fs_cat(void *arg)
 		printf("Empty file\n");
 		return;
 	}
-	buf = malloc(stat);
-	if (!buf) {
-		perror("malloc");
-		fs_umount();
-		die("Cannot malloc");
-	}
 
-	read = fs_read(fs_fd, buf, stat);
+	/* The content is streamed as it is read, so the header comes first */
+	printf("Read file '%s' (%d/%d bytes)\n", filename, stat, stat);
+	printf("Content of the file:\n");
+	fflush(stdout);
+	read = host_export(fs_fd, STDOUT_FILENO);
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -365,18 +665,17 @@ void thread_fs_cat(void *arg)
 	if (fs_umount())
 		die("cannot unmount diskname");
 
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
-	printf("Content of the file:\n");
-	fwrite(buf, 1, stat, stdout);
-	fflush(stdout);
-
-	free(buf);
+	if (read != stat)
+		die("Cannot read file");
 }
 
-void thread_fs_rm(void *arg)
+void thread_fs_blocks(void *arg)
 {
 	struct thread_arg *t_arg = arg;
+	struct fs_block_run runs[16];
 	char *diskname, *filename;
+	size_t offset = 0, in_place = 0;
+	int fs_fd, count, stat;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -384,97 +683,483 @@ void thread_fs_rm(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_ext(diskname, &read_mount_opts))
 		die("Cannot mount diskname");
 
-	if (fs_delete(filename)) {
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
 		fs_umount();
-		die("Cannot delete file");
+		die("Cannot open file");
+	}
+	stat = fs_stat(fs_fd);
+
+	/* Ask for the rest of the file until there is nothing left */
+	while ((count = fs_map_blocks(fs_fd, offset, stat, runs,
+				      ARRAY_SIZE(runs))) > 0) {
+		for (int i = 0; i < count; i++) {
+			if (runs[i].block)
+				printf("run: offset %zu, length %zu, block %zu+%zu\n",
+				       runs[i].offset, runs[i].length,
+				       runs[i].block, runs[i].block_offset);
+			else
+				printf("run: offset %zu, length %zu, hole\n",
+				       runs[i].offset, runs[i].length);
+			if (runs[i].data)
+				in_place += runs[i].length;
+		}
+		offset = runs[count - 1].offset + runs[count - 1].length;
+		fs_release_blocks(fs_fd);
+	}
+
+	if (count < 0) {
+		fs_close(fs_fd);
+		fs_umount();
+		die("Cannot map file");
+	}
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
 	}
 
 	if (fs_umount())
-		die("Cannot unmount diskname");
+		die("cannot unmount diskname");
 
-	printf("Removed file '%s'\n", filename);
+	printf("Mapped file '%s' (%zu/%d bytes in place)\n", filename, in_place,
+	       stat);
 }
 
-void thread_fs_add(void *arg)
+void thread_fs_rm(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
-	int fd, fs_fd;
-	struct stat st;
-	int written;
+	char *diskname, *filename;
 
 	if (t_arg->argc < 2)
-		die("Usage: <diskname> <host filename>");
+		die("need <diskname> <filename>");
 
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	/* Open file on host computer */
-	fd = open(filename, O_RDONLY);
-	if (fd < 0)
-		die_perror("open");
-	if (fstat(fd, &st))
-		die_perror("fstat");
-	if (!S_ISREG(st.st_mode))
-		die("Not a regular file: %s\n", filename);
-
-	/* Map file into buffer */
-	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!buf)
-		die_perror("mmap");
-
-	/* Now, deal with our filesystem:
-	 * - mount, create a new file, copy content of host file into this new
-	 *   file, close the new file, and umount
-	 */
-	if (fs_mount(diskname))
+	if (fs_mount_ext(diskname, &mount_opts))
 		die("Cannot mount diskname");
 
-	if (fs_create(filename)) {
-		fs_umount();
-		die("Cannot create file");
-	}
-
-	fs_fd = fs_open(filename);
-	if (fs_fd < 0) {
-		fs_umount();
-		die("Cannot open file");
-	}
-
-	written = fs_write(fs_fd, buf, st.st_size);
-
-	if (fs_close(fs_fd)) {
+	if (fs_delete(filename)) {
 		fs_umount();
-		die("Cannot close file");
+		die("Cannot delete file");
 	}
 
 	if (fs_umount())
 		die("Cannot unmount diskname");
 
-	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
-		   st.st_size);
-
-	munmap(buf, st.st_size);
-	close(fd);
+	printf("Removed file '%s'\n", filename);
 }
 
-void thread_fs_ls(void *arg)
+void thread_fs_clone(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname;
+	char *diskname, *src_filename, *dst_filename;
 
-	if (t_arg->argc < 1)
-		die("Usage: <diskname>");
+	if (t_arg->argc < 3)
+		die("need <diskname> <filename> <new filename>");
 
 	diskname = t_arg->argv[0];
+	src_filename = t_arg->argv[1];
+	dst_filename = t_arg->argv[2];
 
-	if (fs_mount(diskname))
+	if (fs_mount_ext(diskname, &mount_opts))
 		die("Cannot mount diskname");
 
-	fs_ls();
+	if (fs_clone(src_filename, dst_filename)) {
+		fs_umount();
+		die("Cannot clone file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Cloned file '%s' to '%s'\n", src_filename, dst_filename);
+}
+
+void thread_fs_copy(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src_filename, *dst_filename;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <filename> <new filename>");
+
+	diskname = t_arg->argv[0];
+	src_filename = t_arg->argv[1];
+	dst_filename = t_arg->argv[2];
+
+	if (fs_mount_ext(diskname, &mount_opts))
+		die("Cannot mount diskname");
+
+	if (fs_copy(src_filename, dst_filename)) {
+		fs_umount();
+		die("Cannot copy file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Copied file '%s' to '%s'\n", src_filename, dst_filename);
+}
+
+void thread_fs_compress(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	if (fs_mount_ext(diskname, &mount_opts))
+		die("Cannot mount diskname");
+
+	if (fs_compress(filename)) {
+		fs_umount();
+		die("Cannot compress file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Compressed file '%s'\n", filename);
+}
+
+void thread_fs_mkdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <dirname>");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
+
+	if (fs_mount_ext(diskname, &mount_opts))
+		die("Cannot mount diskname");
+
+	if (fs_mkdir(dirname)) {
+		fs_umount();
+		die("Cannot create directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created directory '%s'\n", dirname);
+}
+
+void thread_fs_rmdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <dirname>");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
+
+	if (fs_mount_ext(diskname, &mount_opts))
+		die("Cannot mount diskname");
+
+	if (fs_rmdir(dirname)) {
+		fs_umount();
+		die("Cannot delete directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Removed directory '%s'\n", dirname);
+}
+
+void thread_fs_add(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *buf;
+	int fd, fs_fd;
+	struct stat st;
+	int written;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	/* Open file on host computer */
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode))
+		die("Not a regular file: %s\n", filename);
+
+	/* Map file into buffer */
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (!buf)
+		die_perror("mmap");
+
+	/* Now, deal with our filesystem:
+	 * - mount, create a new file, copy content of host file into this new
+	 *   file, close the new file, and umount
+	 */
+	if (fs_mount_ext(diskname, &mount_opts))
+		die("Cannot mount diskname");
+
+	if (fs_create(filename)) {
+		fs_umount();
+		die("Cannot create file");
+	}
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	written = fs_write(fs_fd, buf, st.st_size);
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
+		   st.st_size);
+
+	munmap(buf, st.st_size);
+	close(fd);
+}
+
+/* Map a host file for fs_import(), NULL with a size of 0 for an empty one */
+static void *map_host_file(int dir_fd, const char *filename, size_t *size)
+{
+	struct stat st;
+	void *buf;
+	int fd;
+
+	fd = openat(dir_fd, filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode))
+		die("Not a regular file: %s\n", filename);
+
+	*size = st.st_size;
+	buf = NULL;
+	if (st.st_size) {
+		buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf == MAP_FAILED)
+			die_perror("mmap");
+	}
+	close(fd);
+
+	return buf;
+}
+
+void thread_fs_import(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_import_file *files;
+	char *diskname, **paths;
+	size_t count = 0, i;
+	int *status, imported;
+	int dir_fd = AT_FDCWD;
+	struct stat st;
+	DIR *dir = NULL;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory> | <host filename>...");
+
+	diskname = t_arg->argv[0];
+
+	/* A directory brings in every regular file in it, under its own name */
+	if (t_arg->argc == 2 && !stat(t_arg->argv[1], &st) &&
+	    S_ISDIR(st.st_mode)) {
+		struct dirent *dirent;
+
+		dir = opendir(t_arg->argv[1]);
+		if (!dir)
+			die_perror("opendir");
+		dir_fd = dirfd(dir);
+		paths = NULL;
+		while ((dirent = readdir(dir))) {
+			if (fstatat(dir_fd, dirent->d_name, &st, 0) ||
+			    !S_ISREG(st.st_mode))
+				continue;
+			paths = realloc(paths, (count + 1) * sizeof(*paths));
+			if (!paths)
+				die_perror("realloc");
+			paths[count++] = dirent->d_name;
+		}
+	} else {
+		paths = &t_arg->argv[1];
+		count = t_arg->argc - 1;
+	}
+
+	files = calloc(count + 1, sizeof(*files));
+	status = calloc(count + 1, sizeof(*status));
+	if (!files || !status)
+		die_perror("calloc");
+	for (i = 0; i < count; i++) {
+		files[i].filename = paths[i];
+		files[i].buf = map_host_file(dir_fd, paths[i], &files[i].size);
+	}
+
+	if (fs_mount_ext(diskname, &mount_opts))
+		die("Cannot mount diskname");
+
+	imported = fs_import(files, count, status);
+	if (imported < 0) {
+		fs_umount();
+		die("Cannot import files");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	for (i = 0; i < count; i++) {
+		if (status[i])
+			test_fs_error("Cannot import file '%s'", files[i].filename);
+		else
+			printf("Imported file '%s' (%zu bytes)\n",
+			       files[i].filename, files[i].size);
+		if (files[i].size)
+			munmap((void *)files[i].buf, files[i].size);
+	}
+	printf("Imported %d/%zu files\n", imported, count);
+
+	if (dir) {
+		closedir(dir);
+		free(paths);
+	}
+	free(files);
+	free(status);
+	if ((size_t)imported != count)
+		exit(1);
+}
+
+void thread_fs_export(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_export_file *files;
+	char *diskname, *hostdir;
+	int *sizes, *status, *fds;
+	int count, exported, i;
+	int dir_fd;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <host directory> <filename>...");
+
+	diskname = t_arg->argv[0];
+	hostdir = t_arg->argv[1];
+	count = t_arg->argc - 2;
+
+	files = calloc(count, sizeof(*files));
+	sizes = calloc(count, sizeof(*sizes));
+	status = calloc(count, sizeof(*status));
+	fds = calloc(count, sizeof(*fds));
+	if (!files || !sizes || !status || !fds)
+		die_perror("calloc");
+
+	if (fs_mount_ext(diskname, &read_mount_opts))
+		die("Cannot mount diskname");
+
+	/*
+	 * Each host file gets its final size and is mapped, the file system
+	 * writes the content straight into the mapping
+	 */
+	fs_stat_batch((const char **)&t_arg->argv[2], count, sizes);
+	dir_fd = open(hostdir, O_RDONLY | O_DIRECTORY);
+	if (dir_fd < 0) {
+		fs_umount();
+		die_perror("open");
+	}
+	for (i = 0; i < count; i++) {
+		char *name = strrchr(t_arg->argv[i + 2], '/');
+
+		files[i].filename = t_arg->argv[i + 2];
+		fds[i] = -1;
+		if (sizes[i] < 0)
+			continue;
+
+		fds[i] = openat(dir_fd, name ? name + 1 : files[i].filename,
+				O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fds[i] < 0 || ftruncate(fds[i], sizes[i])) {
+			fs_umount();
+			die_perror("open");
+		}
+		files[i].size = sizes[i];
+		if (sizes[i]) {
+			files[i].buf = mmap(NULL, sizes[i], PROT_READ | PROT_WRITE,
+					    MAP_SHARED, fds[i], 0);
+			if (files[i].buf == MAP_FAILED) {
+				fs_umount();
+				die_perror("mmap");
+			}
+		}
+	}
+
+	exported = fs_export(files, count, status);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	for (i = 0; i < count; i++) {
+		if (status[i] < 0 || status[i] != sizes[i])
+			test_fs_error("Cannot export file '%s'", files[i].filename);
+		else
+			printf("Exported file '%s' (%d bytes)\n",
+			       files[i].filename, status[i]);
+		if (files[i].size)
+			munmap(files[i].buf, files[i].size);
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+	printf("Exported %d/%d files\n", exported, count);
+
+	close(dir_fd);
+	free(files);
+	free(sizes);
+	free(status);
+	free(fds);
+	if (exported != count)
+		exit(1);
+}
+
+void thread_fs_ls(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<dirname>]");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount_ext(diskname, &read_mount_opts))
+		die("Cannot mount diskname");
+
+	if (t_arg->argc < 2) {
+		fs_ls();
+	} else if (fs_lsdir(t_arg->argv[1])) {
+		fs_umount();
+		die("Cannot list directory");
+	}
 
 	if (fs_umount())
 		die("Cannot unmount diskname");
@@ -490,7 +1175,7 @@ void thread_fs_info(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fs_mount_ext(diskname, &mount_opts))
 		die("Cannot mount diskname");
 
 	fs_info();
@@ -499,6 +1184,392 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_dedup_info(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount_ext(diskname, &mount_opts))
+		die("Cannot mount diskname");
+
+	fs_dedup_info();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_format(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_format_opts opts = { 0 };
+	char *diskname;
+	size_t count;
+	int i;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <data block count> [fat32] [<block size>]");
+
+	diskname = t_arg->argv[0];
+	count = strtoul(t_arg->argv[1], NULL, 0);
+	for (i = 2; i < t_arg->argc; i++) {
+		if (!strcmp(t_arg->argv[i], "fat32"))
+			opts.flags |= FS_FORMAT_FAT32;
+		else
+			opts.block_size = strtoul(t_arg->argv[i], NULL, 0);
+	}
+
+	if (fs_format(diskname, count, &opts))
+		die("Cannot format diskname");
+
+	printf("Created virtual disk '%s' with '%zu' data blocks\n", diskname,
+	       count);
+}
+
+void thread_fs_grow(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t count;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <data block count>");
+
+	diskname = t_arg->argv[0];
+	count = strtoul(t_arg->argv[1], NULL, 0);
+
+	if (fs_mount_ext(diskname, &mount_opts))
+		die("Cannot mount diskname");
+
+	if (fs_grow(count)) {
+		fs_umount();
+		die("Cannot grow diskname");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Grew virtual disk '%s' to '%zu' data blocks\n", diskname, count);
+}
+
+/* Commands of the batch that failed, in full or for some of their files */
+static size_t batch_errors;
+
+static const char *batch_add(int argc, char **argv)
+{
+	char *filename = argc > 1 ? argv[1] : argv[0];
+	struct stat st;
+	ssize_t written;
+	int fd, fs_fd;
+
+	fd = open(argv[0], O_RDONLY);
+	if (fd < 0)
+		return strerror(errno);
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return "Not a regular file";
+	}
+
+	if (fs_create(filename)) {
+		close(fd);
+		return "Cannot create file";
+	}
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		close(fd);
+		return "Cannot open file";
+	}
+
+	written = host_import(fs_fd, fd);
+	close(fd);
+	if (fs_close(fs_fd) || written != st.st_size)
+		return "Cannot write file";
+
+	printf("ok\tadd\t%s\t%zd\n", filename, written);
+	return NULL;
+}
+
+static const char *batch_get(int argc, char **argv)
+{
+	ssize_t read;
+	int fd, fs_fd, size;
+
+	fs_fd = fs_open(argv[0]);
+	if (fs_fd < 0)
+		return "Cannot open file";
+	size = fs_stat(fs_fd);
+	fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fs_close(fs_fd);
+		return strerror(errno);
+	}
+
+	read = host_export(fs_fd, fd);
+	if (close(fd))
+		read = -1;
+	if (fs_close(fs_fd) || read != size)
+		return "Cannot read file";
+
+	printf("ok\tget\t%s\t%zd\n", argv[0], read);
+	return NULL;
+}
+
+static const char *batch_cat(int argc, char **argv)
+{
+	ssize_t read;
+	int fs_fd, size;
+
+	fs_fd = fs_open(argv[0]);
+	if (fs_fd < 0)
+		return "Cannot open file";
+	size = fs_stat(fs_fd);
+
+	/* The content follows the result line, its size tells where it ends */
+	printf("ok\tcat\t%s\t%d\n", argv[0], size);
+	fflush(stdout);
+	read = host_export(fs_fd, STDOUT_FILENO);
+	if (fs_close(fs_fd) || read != size) {
+		/* Zeros stand for what could not be read, the error line follows */
+		for (; read >= 0 && read < size; read++)
+			putchar('\0');
+		return "Cannot read file";
+	}
+
+	return NULL;
+}
+
+static const char *batch_stat(int argc, char **argv)
+{
+	int sizes[argc];
+
+	if (fs_stat_batch((const char **)argv, argc, sizes) < 0)
+		return "Cannot stat file";
+
+	for (int i = 0; i < argc; i++) {
+		if (sizes[i] < 0) {
+			printf("error\tstat\t%s\tNo such file\n", argv[i]);
+			batch_errors++;
+		} else
+			printf("ok\tstat\t%s\t%d\n", argv[i], sizes[i]);
+	}
+	return NULL;
+}
+
+static const char *batch_rm(int argc, char **argv)
+{
+	int status[argc];
+
+	if (fs_delete_batch((const char **)argv, argc, status) < 0)
+		return "Cannot delete file";
+
+	for (int i = 0; i < argc; i++) {
+		if (status[i]) {
+			printf("error\trm\t%s\tCannot delete file\n", argv[i]);
+			batch_errors++;
+		} else
+			printf("ok\trm\t%s\n", argv[i]);
+	}
+	return NULL;
+}
+
+static const char *batch_ls(int argc, char **argv)
+{
+	if (argc ? fs_lsdir(argv[0]) : fs_ls())
+		return "Cannot list directory";
+
+	printf("ok\tls\n");
+	return NULL;
+}
+
+static const char *batch_info(int argc, char **argv)
+{
+	if (fs_info())
+		return "Cannot get info";
+
+	printf("ok\tinfo\n");
+	return NULL;
+}
+
+static const char *batch_dedup_info(int argc, char **argv)
+{
+	if (fs_dedup_info())
+		return "Cannot get dedup info";
+
+	printf("ok\tdedup\n");
+	return NULL;
+}
+
+static const char *batch_mkdir(int argc, char **argv)
+{
+	if (fs_mkdir(argv[0]))
+		return "Cannot create directory";
+
+	printf("ok\tmkdir\t%s\n", argv[0]);
+	return NULL;
+}
+
+static const char *batch_rmdir(int argc, char **argv)
+{
+	if (fs_rmdir(argv[0]))
+		return "Cannot delete directory";
+
+	printf("ok\trmdir\t%s\n", argv[0]);
+	return NULL;
+}
+
+static const char *batch_clone(int argc, char **argv)
+{
+	if (fs_clone(argv[0], argv[1]))
+		return "Cannot clone file";
+
+	printf("ok\tclone\t%s\t%s\n", argv[0], argv[1]);
+	return NULL;
+}
+
+static const char *batch_copy(int argc, char **argv)
+{
+	if (fs_copy(argv[0], argv[1]))
+		return "Cannot copy file";
+
+	printf("ok\tcopy\t%s\t%s\n", argv[0], argv[1]);
+	return NULL;
+}
+
+static const char *batch_compress(int argc, char **argv)
+{
+	if (fs_compress(argv[0]))
+		return "Cannot compress file";
+
+	printf("ok\tcompress\t%s\n", argv[0]);
+	return NULL;
+}
+
+static const char *batch_grow(int argc, char **argv)
+{
+	size_t count = strtoul(argv[0], NULL, 0);
+
+	if (fs_grow(count))
+		return "Cannot grow diskname";
+
+	printf("ok\tgrow\t%zu\n", count);
+	return NULL;
+}
+
+static struct {
+	const char *name;
+	int min_args;
+	int max_args;
+	const char *(*func)(int, char **);
+} batch_commands[] = {
+	{ "info",	0, 0,	batch_info },
+	{ "dedup",	0, 0,	batch_dedup_info },
+	{ "ls",		0, 1,	batch_ls },
+	{ "add",	1, 2,	batch_add },
+	{ "get",	2, 2,	batch_get },
+	{ "cat",	1, 1,	batch_cat },
+	{ "stat",	1, FS_FILE_MAX_COUNT,	batch_stat },
+	{ "rm",		1, FS_FILE_MAX_COUNT,	batch_rm },
+	{ "mkdir",	1, 1,	batch_mkdir },
+	{ "rmdir",	1, 1,	batch_rmdir },
+	{ "clone",	2, 2,	batch_clone },
+	{ "copy",	2, 2,	batch_copy },
+	{ "compress",	1, 1,	batch_compress },
+	{ "grow",	1, 1,	batch_grow },
+};
+
+/*
+ * Run the commands of a file, or of stdin, under a single mount. Each line is
+ * either a test_fs.x command without the disk name, with its arguments
+ * separated by blanks, or a line in the script format (see thread_fs_script()).
+ * Every command prints a tab separated result line, "ok", the command and its
+ * results, or "error", the command and a message; the batch then goes on with
+ * the next command.
+ */
+void thread_fs_batch(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	/* Many commands to come, read the whole FAT from the start */
+	struct fs_mount_opts batch_opts = { .flags = FS_MOUNT_PREFETCH };
+	struct script_state state = { .fs_fd = -1, .batch = 1 };
+	char *line = NULL;
+	size_t line_size = 0;
+	FILE *input = stdin;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<command filename> [<mount flag>]...]");
+
+	state.diskname = t_arg->argv[0];
+	if (t_arg->argc > 1 && strcmp(t_arg->argv[1], "-")) {
+		input = fopen(t_arg->argv[1], "r");
+		if (!input)
+			die_perror("fopen");
+	}
+	for (int i = 2; i < t_arg->argc; i++) {
+		int flag = mount_flag(t_arg->argv[i]);
+
+		if (!flag)
+			die("Unknown mount flag");
+		batch_opts.flags |= flag;
+	}
+
+	if (fs_mount_ext(state.diskname, &batch_opts))
+		die("Cannot mount diskname");
+	state.mounted = 1;
+
+	while (getline(&line, &line_size, input) > 0) {
+		char *argv[FS_FILE_MAX_COUNT + 1];
+		const char *err = NULL;
+		int argc = 0;
+		size_t i;
+
+		/* Script lines start with a command in capitals */
+		if (isupper((unsigned char)line[0])) {
+			err = script_line(line, &state);
+			if (err) {
+				/* The line is cut at the end of its command */
+				printf("error\t%s\t%s\n", line, err);
+				batch_errors++;
+			}
+			continue;
+		}
+
+		for (char *tok = strtok(line, " \t\n"); tok && argc < (int)ARRAY_SIZE(argv);
+		     tok = strtok(NULL, " \t\n"))
+			argv[argc++] = tok;
+		if (!argc || argv[0][0] == '#')
+			continue;
+
+		for (i = 0; i < ARRAY_SIZE(batch_commands); i++)
+			if (!strcmp(argv[0], batch_commands[i].name))
+				break;
+		if (i == ARRAY_SIZE(batch_commands))
+			err = "Invalid command";
+		else if (argc - 1 < batch_commands[i].min_args ||
+			 argc - 1 > batch_commands[i].max_args)
+			err = "Invalid number of arguments";
+		else
+			err = batch_commands[i].func(argc - 1, &argv[1]);
+
+		if (err) {
+			printf("error\t%s\t%s\n", argv[0], err);
+			batch_errors++;
+		}
+	}
+	free(line);
+
+	if (state.mounted && fs_umount())
+		die("Cannot unmount diskname");
+	if (input != stdin)
+		fclose(input);
+
+	if (batch_errors)
+		exit(1);
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -511,13 +1582,25 @@ static struct {
 	const char *name;
 	void(*func)(void *);
 } commands[] = {
+	{ "format",	thread_fs_format },
+	{ "grow",	thread_fs_grow },
 	{ "info",	thread_fs_info },
+	{ "dedup",	thread_fs_dedup_info },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
+	{ "import",	thread_fs_import },
+	{ "export",	thread_fs_export },
 	{ "rm",		thread_fs_rm },
+	{ "mkdir",	thread_fs_mkdir },
+	{ "rmdir",	thread_fs_rmdir },
+	{ "clone",	thread_fs_clone },
+	{ "copy",	thread_fs_copy },
+	{ "compress",	thread_fs_compress },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "blocks",	thread_fs_blocks },
+	{ "script",	thread_fs_script },
+	{ "batch",	thread_fs_batch }
 };
 
 void usage(char *program)
@@ -188,6 +188,32 @@ info_full() {
     log "Score: ${score}"
 }
 
+# Info from the superblock summary, after another driver changed the disk
+info_summary() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool dd if=/dev/urandom of=test-file-1 bs=2048 count=1
+	run_tool dd if=/dev/urandom of=test-file-2 bs=2048 count=4
+	run_tool ./test_fs.x add test.fs test-file-1
+	run_tool ./test_fs.x info test.fs
+	run_tool ./fs_ref.x add test.fs test-file-2
+
+	run_test ./test_fs.x info test.fs
+	rm -f test-file-1 test-file-2 test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	line_array+=("$(select_line "${STDOUT}" "8")")
+	local corr_array=()
+	corr_array+=("fat_free_ratio=96/100")
+	corr_array+=("rdir_free_ratio=126/128")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
 #
 # Phase 2
 #
@@ -244,6 +270,705 @@ END_SCRIPT
     log "Score: ${score}"
 }
 
+# write a file whose FAT chain spans several FAT blocks on a lazy mount
+write_large() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 8192
+	run_tool dd if=/dev/urandom of=test-file-1 bs=4096 count=3000
+	run_tool ./test_fs.x add test.fs test-file-1
+	run_test ./fs_ref.x info test.fs
+	local info_out="${STDOUT}"
+	run_test ./fs_ref.x cat test.fs test-file-1
+	local cat_out="${STDOUT}"
+	rm -f test.fs test-file-1
+
+	local line_array=()
+	line_array+=("$(select_line "${info_out}" "7")")
+	line_array+=("$(select_line "${cat_out}" "1")")
+	local corr_array=()
+	corr_array+=("fat_free_ratio=5191/8192")
+	corr_array+=("Read file 'test-file-1' (12288000/12288000 bytes)")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# shrink a file and check the freed blocks with the reference
+truncate_file() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool dd if=/dev/urandom of=test-file-1 bs=4096 count=5
+	run_tool ./fs_ref.x add test.fs test-file-1
+    cat <<END_SCRIPT > truncate.script
+MOUNT
+OPEN	test-file-1
+TRUNCATE	5000
+CLOSE
+UMOUNT
+END_SCRIPT
+	run_tool ./test_fs.x script test.fs truncate.script
+	run_test ./fs_ref.x ls test.fs
+	local ls_out="${STDOUT}"
+	run_test ./fs_ref.x info test.fs
+	rm -f test.fs test-file-1 truncate.script
+
+	local line_array=()
+	line_array+=("$(select_line "${ls_out}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	local corr_array=()
+	corr_array+=("file: test-file-1, size: 5000, data_blk: 1")
+	corr_array+=("fat_free_ratio=97/100")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+sparse_file() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+    cat <<END_SCRIPT > sparse.script
+MOUNT	SPARSE
+CREATE	sparse-file
+OPEN	sparse-file
+SEEK	100000
+WRITE	DATA	abc
+SEEK	100000
+READ	3	DATA	abc
+CLOSE
+UMOUNT
+END_SCRIPT
+	run_tool ./test_fs.x script test.fs sparse.script
+	run_test ./fs_ref.x ls test.fs
+	local ls_out="${STDOUT}"
+	run_test ./fs_ref.x info test.fs
+	rm -f test.fs sparse.script
+
+	# one map block and one data block, the 24 blocks before are a hole
+	local line_array=()
+	line_array+=("$(select_line "${ls_out}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	local corr_array=()
+	corr_array+=("file: sparse-file, size: 100003, data_blk: 1")
+	corr_array+=("fat_free_ratio=97/100")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+zero_blocks() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool dd if=/dev/zero of=zero-file bs=4096 count=3
+    cat <<END_SCRIPT > zero.script
+MOUNT	SPARSE	DISCARD
+CREATE	sparse-file
+OPEN	sparse-file
+SEEK	8192
+WRITE	FILE	zero-file
+SEEK	8192
+READ	12288	FILE	zero-file
+CLOSE
+UMOUNT
+END_SCRIPT
+	run_tool ./test_fs.x script test.fs zero.script
+	run_test ./fs_ref.x ls test.fs
+	local ls_out="${STDOUT}"
+	run_test ./fs_ref.x info test.fs
+	rm -f test.fs zero-file zero.script
+
+	# blocks of zeros stay holes, only the map block is allocated
+	local line_array=()
+	line_array+=("$(select_line "${ls_out}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	local corr_array=()
+	corr_array+=("file: sparse-file, size: 20480, data_blk: 1")
+	corr_array+=("fat_free_ratio=98/100")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+clone_file() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	yes hello | head -c 20480 > test-file-1
+	run_tool ./fs_ref.x add test.fs test-file-1
+	run_tool ./test_fs.x clone test.fs test-file-1 test-file-2
+	run_test ./test_fs.x cat test.fs test-file-2
+	local cat_out="${STDOUT}"
+	run_test ./fs_ref.x ls test.fs
+	local ls_out="${STDOUT}"
+	run_test ./fs_ref.x info test.fs
+	rm -f test.fs test-file-1
+
+	# the 5 data blocks are shared, the new blocks are the reference count
+	# table and one map block per file
+	local line_array=()
+	line_array+=("$(select_line "${cat_out}" "3")")
+	line_array+=("$(select_line "${ls_out}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	local corr_array=()
+	corr_array+=("hello")
+	corr_array+=("file: test-file-2, size: 20480, data_blk: 8")
+	corr_array+=("fat_free_ratio=91/100")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+copy_file() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	yes hello | head -c 20480 > test-file-1
+	run_tool ./fs_ref.x add test.fs test-file-1
+	run_tool ./test_fs.x copy test.fs test-file-1 test-file-2
+	run_test ./fs_ref.x cat test.fs test-file-2
+	local cat_out="${STDOUT}"
+	run_test ./fs_ref.x ls test.fs
+	local ls_out="${STDOUT}"
+	run_test ./fs_ref.x info test.fs
+	rm -f test.fs test-file-1
+
+	# the copy gets its own 5 data blocks, right after the source's
+	local line_array=()
+	line_array+=("$(select_line "${cat_out}" "3")")
+	line_array+=("$(select_line "${ls_out}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	local corr_array=()
+	corr_array+=("hello")
+	corr_array+=("file: test-file-2, size: 20480, data_blk: 6")
+	corr_array+=("fat_free_ratio=89/100")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+dedup_blocks() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool dd if=/dev/urandom of=test-file-1 bs=4096 count=4
+    cat <<END_SCRIPT > dedup.script
+MOUNT	DEDUP
+CREATE	test-file-1
+CREATE	test-file-2
+OPEN	test-file-1
+WRITE	FILE	test-file-1
+CLOSE
+OPEN	test-file-2
+WRITE	FILE	test-file-1
+SEEK	0
+READ	16384	FILE	test-file-1
+CLOSE
+UMOUNT
+END_SCRIPT
+	run_tool ./test_fs.x script test.fs dedup.script
+	run_test ./fs_ref.x ls test.fs
+	local ls_out="${STDOUT}"
+	run_test ./test_fs.x dedup test.fs
+	rm -f test.fs test-file-1 dedup.script
+
+	# the second file only gets a map block, its 4 data blocks are shared;
+	# the reference count and hash tables take a block each
+	local line_array=()
+	line_array+=("$(select_line "${ls_out}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "4")")
+	local corr_array=()
+	corr_array+=("file: test-file-2, size: 16384, data_blk: 8")
+	corr_array+=("used_blk_count=8")
+	corr_array+=("dedup_ratio=12/8")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+compress_file() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	yes hello | head -c 20480 > test-file-1
+	run_tool ./fs_ref.x add test.fs test-file-1
+	run_tool ./test_fs.x compress test.fs test-file-1
+	run_test ./test_fs.x cat test.fs test-file-1
+	local cat_out="${STDOUT}"
+	run_test ./fs_ref.x ls test.fs
+	local ls_out="${STDOUT}"
+	run_test ./fs_ref.x info test.fs
+	local info_out="${STDOUT}"
+
+	# a block that does not compress is better left as is next to holes
+	(head -c 4096 /dev/urandom; head -c 28672 /dev/zero) > test-file-2
+	run_tool ./fs_ref.x add test.fs test-file-2
+	run_tool ./test_fs.x compress test.fs test-file-2
+	run_test ./fs_ref.x info test.fs
+	rm -f test.fs test-file-1 test-file-2
+
+	# the 5 data blocks shrink to a map block and a compressed one
+	local line_array=()
+	line_array+=("$(select_line "${cat_out}" "3")")
+	line_array+=("$(select_line "${ls_out}" "2")")
+	line_array+=("$(select_line "${info_out}" "7")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	local corr_array=()
+	corr_array+=("hello")
+	corr_array+=("file: test-file-1, size: 20480, data_blk: 6")
+	corr_array+=("fat_free_ratio=97/100")
+	corr_array+=("fat_free_ratio=95/100")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+pack_small_files() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	echo "hello world" > test-file-1
+	yes hello | head -c 5000 > test-file-2
+    cat <<END_SCRIPT > pack.script
+MOUNT	PACK
+CREATE	test-file-1
+CREATE	test-file-2
+OPEN	test-file-1
+WRITE	FILE	test-file-1
+CLOSE
+OPEN	test-file-2
+WRITE	FILE	test-file-2
+CLOSE
+UMOUNT
+END_SCRIPT
+	run_tool ./test_fs.x script test.fs pack.script
+	run_test ./test_fs.x cat test.fs test-file-1
+	local cat_out="${STDOUT}"
+	run_test ./fs_ref.x ls test.fs
+	local ls_out="${STDOUT}"
+	run_test ./fs_ref.x info test.fs
+	rm -f test.fs test-file-1 test-file-2 pack.script
+
+	# the first file and the tail of the second share one pack block
+	local line_array=()
+	line_array+=("$(select_line "${cat_out}" "3")")
+	line_array+=("$(select_line "${ls_out}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	local corr_array=()
+	corr_array+=("hello world")
+	corr_array+=("file: test-file-1, size: 12, data_blk: 65535")
+	corr_array+=("fat_free_ratio=97/100")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+subdirectories() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+    cat <<END_SCRIPT > dir.script
+MOUNT
+MKDIR	docs
+MKDIR	docs/old
+CREATE	docs/old/note
+OPEN	docs/old/note
+WRITE	DATA	hello world
+CLOSE
+UMOUNT
+END_SCRIPT
+	run_tool ./test_fs.x script test.fs dir.script
+	run_test ./test_fs.x cat test.fs docs/old/note
+	local cat_out="${STDOUT}"
+	run_test ./test_fs.x ls test.fs docs/old
+	local ls_out="${STDOUT}"
+	# a directory has to be empty to go
+	run_test ./test_fs.x rmdir test.fs docs
+	local rmdir_out="${STDERR}"
+	run_tool ./test_fs.x rm test.fs docs/old/note
+	run_tool ./test_fs.x rmdir test.fs docs/old
+	run_tool ./test_fs.x rmdir test.fs docs
+	run_test ./fs_ref.x info test.fs
+	rm -f test.fs dir.script
+
+	local line_array=()
+	line_array+=("$(select_line "${cat_out}" "3")")
+	line_array+=("$(select_line "${ls_out}" "2")")
+	line_array+=("$(select_line "${rmdir_out}" "1")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	local corr_array=()
+	corr_array+=("hello world")
+	corr_array+=("file: note, size: 11, data_blk: 5")
+	corr_array+=("thread_fs_rmdir: Cannot delete directory")
+	corr_array+=("fat_free_ratio=99/100")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+large_directory() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	# with 512 byte blocks the hash table of a directory takes several blocks
+	run_tool ./test_fs.x format test.fs 4096 512
+	{
+		echo "MOUNT"
+		echo "MKDIR	docs"
+		for i in $(seq 1 3000); do
+			echo "CREATE	docs/note${i}"
+		done
+		echo "UMOUNT"
+	} > dir.script
+	run_tool ./test_fs.x script test.fs dir.script
+	run_test ./test_fs.x ls test.fs docs
+	local count=$(grep -c "^file: note" <<< "${STDOUT}")
+	local ls_out="$(grep "file: note2999," <<< "${STDOUT}")"
+	run_test ./test_fs.x stat test.fs docs/note3000
+	rm -f test.fs dir.script
+
+	local line_array=()
+	line_array+=("${count}")
+	line_array+=("${ls_out}")
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	local corr_array=()
+	corr_array+=("3000")
+	corr_array+=("file: note2999, size: 0")
+	corr_array+=("Empty file")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+fat32_image() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	# past what 16-bit block indices reach, only the FAT blocks are written
+	run_tool ./test_fs.x format test.fs 100000
+	echo "hello" > note
+	run_tool ./test_fs.x add test.fs note
+	run_test ./test_fs.x ls test.fs
+	local ls_out="${STDOUT}"
+	run_test ./fs_ref.x info test.fs
+	local ref_out="${STDERR}"
+	run_test ./test_fs.x info test.fs
+	rm -f test.fs note
+
+	local line_array=()
+	line_array+=("$(select_line "${ls_out}" "2")")
+	line_array+=("$(select_line "${ref_out}" "1")")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	local corr_array=()
+	corr_array+=("file: note, size: 6, data_blk: 1")
+	corr_array+=("thread_fs_info: Cannot mount diskname")
+	corr_array+=("fat_blk_count=98")
+	corr_array+=("fat_free_ratio=99998/100000")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+small_blocks() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	# the root dir spans 8 blocks of 512 bytes, a 1500 byte file takes 3
+	run_tool ./test_fs.x format test.fs 4096 512
+	head -c 1500 /dev/urandom > note
+	run_tool ./test_fs.x add test.fs note
+	run_test ./test_fs.x ls test.fs
+	local ls_out="${STDOUT}"
+	run_test ./test_fs.x info test.fs
+	rm -f test.fs note
+
+	local line_array=()
+	line_array+=("$(select_line "${ls_out}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "4")")
+	line_array+=("$(select_line "${STDOUT}" "5")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	line_array+=("$(select_line "${STDOUT}" "9")")
+	local corr_array=()
+	corr_array+=("file: note, size: 1500, data_blk: 1")
+	corr_array+=("rdir_blk=33")
+	corr_array+=("data_blk=41")
+	corr_array+=("fat_free_ratio=4092/4096")
+	corr_array+=("blk_size=512")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+preallocated_files() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	# files made along with the image get consecutive blocks from block 1 on
+	run_tool ./fs_make.x -f first:10000 -f empty -f last:1 test.fs 100
+	run_test ./fs_ref.x ls test.fs
+	local ls_out="${STDOUT}"
+	run_test ./fs_ref.x info test.fs
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${ls_out}" "2")")
+	line_array+=("$(select_line "${ls_out}" "3")")
+	line_array+=("$(select_line "${ls_out}" "4")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	local corr_array=()
+	corr_array+=("file: first, size: 10000, data_blk: 1")
+	corr_array+=("file: empty, size: 0, data_blk: 65535")
+	corr_array+=("file: last, size: 1, data_blk: 4")
+	corr_array+=("fat_free_ratio=95/100")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+grow_image() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	# growing past the last FAT block moves the blocks the FAT now covers
+	run_tool ./fs_make.x -f first:10000 test.fs 100
+	run_tool ./test_fs.x grow test.fs 5000
+	run_test ./fs_ref.x ls test.fs
+	local ls_out="${STDOUT}"
+	run_test ./fs_ref.x info test.fs
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${ls_out}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "6")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	local corr_array=()
+	corr_array+=("file: first, size: 10000, data_blk: 98")
+	corr_array+=("fat_blk_count=3")
+	corr_array+=("data_blk_count=5000")
+	corr_array+=("fat_free_ratio=4996/5000")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+batch_commands() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	echo "hello" > test-file-1
+	# commands and script lines run one after the other under a single mount
+	printf "add test-file-1\nstat test-file-1 missing\nMOUNT\nCREATE\ttest-file-2\nUMOUNT\ncat test-file-1\n" > commands.batch
+	run_test ./test_fs.x batch test.fs commands.batch
+	local batch_out="${STDOUT}"
+	run_test ./fs_ref.x ls test.fs
+	rm -f test.fs test-file-1 commands.batch
+
+	local line_array=()
+	line_array+=("$(select_line "${batch_out}" "1")")
+	line_array+=("$(select_line "${batch_out}" "3")")
+	line_array+=("$(select_line "${batch_out}" "7")")
+	line_array+=("$(select_line "${batch_out}" "8")")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	local corr_array=()
+	corr_array+=("ok add test-file-1 6")
+	corr_array+=("error stat missing No such file")
+	corr_array+=("ok cat test-file-1 6")
+	corr_array+=("hello")
+	corr_array+=("file: test-file-2, size: 0, data_blk: 65535")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+import_export() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool dd if=/dev/urandom of=test-file-1 bs=5000 count=1
+	echo -n "x" > test-file-2
+	run_tool dd if=/dev/urandom of=test-file-3 bs=4096 count=2
+	# the three files get consecutive blocks and are written back once
+	run_tool ./test_fs.x import test.fs test-file-1 test-file-2 test-file-3
+	run_test ./fs_ref.x ls test.fs
+	local ls_out="${STDOUT}"
+	mkdir -p export.dir
+	run_test ./test_fs.x export test.fs export.dir test-file-1 test-file-3
+	local export_out="${STDOUT}"
+	local same="differ"
+	cmp -s test-file-1 export.dir/test-file-1 &&
+		cmp -s test-file-3 export.dir/test-file-3 && same="same"
+	rm -rf test.fs test-file-1 test-file-2 test-file-3 export.dir
+
+	local line_array=()
+	line_array+=("$(select_line "${ls_out}" "2")")
+	line_array+=("$(select_line "${ls_out}" "3")")
+	line_array+=("$(select_line "${ls_out}" "4")")
+	line_array+=("$(select_line "${export_out}" "3")")
+	line_array+=("${same}")
+	local corr_array=()
+	corr_array+=("file: test-file-1, size: 5000, data_blk: 1")
+	corr_array+=("file: test-file-2, size: 1, data_blk: 3")
+	corr_array+=("file: test-file-3, size: 8192, data_blk: 4")
+	corr_array+=("Exported 2/2 files")
+	corr_array+=("same")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+stream_cat() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool dd if=/dev/urandom of=test-file bs=4096 count=20
+	run_tool dd if=/dev/urandom of=test-file-2 bs=1000 count=1
+	run_tool ./test_fs.x add test.fs test-file
+	run_tool ./test_fs.x add test.fs test-file-2
+	# a file is sent straight from the image, while an output in append mode
+	# cannot be sent to and gets the content copied instead
+	./test_fs.x cat test.fs test-file > cat.out 2>&1
+	rm -f cat-append.out
+	./test_fs.x cat test.fs test-file-2 >> cat-append.out 2>&1
+	local header="$(head -n 1 cat.out)"
+	local same="differ" same_append="differ"
+	tail -n +3 cat.out | cmp -s - test-file && same="same"
+	tail -n +3 cat-append.out | cmp -s - test-file-2 && same_append="same"
+	rm -f test.fs test-file test-file-2 cat.out cat-append.out
+
+	local line_array=()
+	line_array+=("${header}")
+	line_array+=("${same}")
+	line_array+=("${same_append}")
+	local corr_array=()
+	corr_array+=("Read file 'test-file' (81920/81920 bytes)")
+	corr_array+=("same")
+	corr_array+=("same")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+map_blocks() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool dd if=/dev/urandom of=test-file bs=10000 count=1
+	run_tool ./test_fs.x add test.fs test-file
+    cat <<END_SCRIPT > map.script
+MOUNT	SPARSE
+CREATE	hole-file
+OPEN	hole-file
+SEEK	8192
+WRITE	DATA	abc
+CLOSE
+UMOUNT
+END_SCRIPT
+	run_tool ./test_fs.x script test.fs map.script
+	run_test ./test_fs.x blocks test.fs test-file
+	local file_out="${STDOUT}"
+	run_test ./test_fs.x blocks test.fs hole-file
+	local hole_out="${STDOUT}"
+	# the run is where the file's bytes are in the image
+	local same="differ"
+	dd if=test.fs bs=4096 skip=4 count=3 2>/dev/null | head -c 10000 |
+		cmp -s - test-file && same="same"
+	rm -f test.fs test-file map.script
+
+	local line_array=()
+	line_array+=("$(select_line "${file_out}" "1")")
+	line_array+=("$(select_line "${file_out}" "2")")
+	line_array+=("${same}")
+	line_array+=("$(select_line "${hole_out}" "1")")
+	line_array+=("$(select_line "${hole_out}" "2")")
+	line_array+=("$(select_line "${hole_out}" "3")")
+	local corr_array=()
+	corr_array+=("run: offset 0, length 10000, block 4+0")
+	corr_array+=("Mapped file 'test-file' (10000/10000 bytes in place)")
+	corr_array+=("same")
+	corr_array+=("run: offset 0, length 8192, hole")
+	corr_array+=("run: offset 8192, length 3, block 8+0")
+	corr_array+=("Mapped file 'hole-file' (3/8195 bytes in place)")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+readonly_mount() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	echo "hello" > test-file
+	echo "world" > other-file
+	run_tool ./test_fs.x add test.fs test-file
+	run_tool ./test_fs.x info test.fs
+	local sum_before="$(md5sum < test.fs)"
+	# a batch keeps the disk mounted read-only while other commands run: the
+	# readers share it, the writer is turned away
+	rm -f batch.in batch.out
+	mkfifo batch.in batch.out
+	./test_fs.x batch test.fs - RDONLY < batch.in > batch.out 2>&1 &
+	exec 4> batch.in 5< batch.out
+	echo "cat test-file" >&4
+	local batch_header
+	read -r batch_header <&5
+	run_test ./test_fs.x stat test.fs test-file
+	local stat_out="${STDOUT}"
+	run_test ./test_fs.x add test.fs other-file
+	local add_err="${STDERR}"
+	run_test ./fs_make.x test.fs 100
+	local make_err="${STDERR}"
+	# and the batch itself cannot change anything
+	printf "add other-file\nrm test-file\n" >&4
+	exec 4>&-
+	local batch_out="$(cat <&5)"
+	exec 5<&-
+	wait
+	local sum_after="$(md5sum < test.fs)"
+	local same="differ"
+	[[ "${sum_before}" == "${sum_after}" ]] && same="same"
+	rm -f test.fs test-file other-file batch.in batch.out
+
+	local line_array=()
+	line_array+=("${batch_header}")
+	line_array+=("${stat_out}")
+	line_array+=("$(select_line "${add_err}" "1")")
+	line_array+=("$(select_line "${make_err}" "1")")
+	line_array+=("$(select_line "${batch_out}" "2")")
+	line_array+=("$(select_line "${batch_out}" "3")")
+	line_array+=("${same}")
+	local corr_array=()
+	corr_array+=("ok	cat	test-file	6")
+	corr_array+=("Size of file 'test-file' is 6 bytes")
+	corr_array+=("disk 'test.fs' is in use")
+	corr_array+=("disk 'test.fs' is in use")
+	corr_array+=("error add Cannot create file")
+	corr_array+=("error rm Cannot delete file")
+	corr_array+=("same")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
 #
 # Run tests
 #
@@ -251,10 +976,31 @@ run_tests() {
 	# Phase 1
 	info
 	info_full
+	info_summary
 	# Phase 2
 	create_simple
     # Phase 3 + 4
 	read_block
+	write_large
+	truncate_file
+	sparse_file
+	zero_blocks
+	clone_file
+	copy_file
+	dedup_blocks
+	compress_file
+	pack_small_files
+	subdirectories
+	fat32_image
+	small_blocks
+	large_directory
+	preallocated_files
+	grow_image
+	batch_commands
+	import_export
+	stream_cat
+	map_blocks
+	readonly_mount
 }
 
 make_fs() {
@@ -1,6 +1,12 @@
+#define _GNU_SOURCE /* for fallocate() and copy_file_range() */
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -10,6 +16,9 @@
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
+/* Largest transfer when block_copy() has to go through user space */
+#define COPY_CHUNK_BLOCKS 64
+
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
@@ -19,12 +28,46 @@ struct disk {
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Block size */
+	size_t bsize;
+	/* File size */
+	off_t size;
+	/* Read-only mapping of the whole file, NULL if not mapped */
+	void *map;
+	/* Opened with block_disk_open_readonly() */
+	int readonly;
 };
 
 /* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+static struct disk disk = { .fd = INVALID_FD, .bsize = BLOCK_SIZE_DEFAULT };
 
-int block_disk_open(const char *diskname)
+static int block_size_valid(size_t size)
+{
+	return size >= BLOCK_SIZE_MIN && size <= BLOCK_SIZE_MAX &&
+		!(size & (size - 1));
+}
+
+size_t block_size(void)
+{
+	return disk.bsize;
+}
+
+/*
+ * Any number of readers can share the disk image, a writer has it to itself.
+ * Host file systems without locks leave that to the user.
+ */
+static int disk_lock(int fd, const char *diskname, int readonly)
+{
+	if (flock(fd, (readonly ? LOCK_SH : LOCK_EX) | LOCK_NB) &&
+	    errno == EWOULDBLOCK) {
+		block_error("disk '%s' is in use", diskname);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int disk_open(const char *diskname, int readonly)
 {
 	int fd;
 	struct stat st;
@@ -39,29 +82,220 @@ int block_disk_open(const char *diskname)
 		return -1;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
+	if ((fd = open(diskname, readonly ? O_RDONLY : O_RDWR, 0644)) < 0) {
 		perror("open");
 		return -1;
 	}
 
+	if (disk_lock(fd, diskname, readonly)) {
+		close(fd);
+		return -1;
+	}
+
 	if (fstat(fd, &st)) {
 		perror("fstat");
+		close(fd);
 		return -1;
 	}
 
-	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
+	/*
+	 * The disk image's size should be a multiple of the block size, which is
+	 * not known yet
+	 */
+	if (st.st_size % BLOCK_SIZE_MIN != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+			    st.st_size, BLOCK_SIZE_MIN);
+		close(fd);
 		return -1;
 	}
 
 	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk.size = st.st_size;
+	disk.bsize = BLOCK_SIZE_MIN;
+	disk.bcount = st.st_size / BLOCK_SIZE_MIN;
+	disk.readonly = readonly;
+
+	return 0;
+}
+
+int block_disk_open(const char *diskname)
+{
+	return disk_open(diskname, 0);
+}
+
+int block_disk_open_readonly(const char *diskname)
+{
+	return disk_open(diskname, 1);
+}
+
+/* Writing functions refuse a disk opened read-only */
+static int disk_writable(void)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return 0;
+	}
+
+	if (disk.readonly) {
+		block_error("disk is open read-only");
+		return 0;
+	}
+
+	return 1;
+}
+
+int block_disk_set_size(size_t size)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (!block_size_valid(size) || disk.size % size != 0) {
+		block_error("invalid block size '%zu'", size);
+		return -1;
+	}
+
+	disk.bsize = size;
+	disk.bcount = disk.size / size;
+
+	return 0;
+}
+
+int block_disk_create(const char *diskname, size_t count, size_t size)
+{
+	int fd;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	if (!block_size_valid(size)) {
+		block_error("invalid block size '%zu'", size);
+		return -1;
+	}
+
+	if (disk.fd != INVALID_FD) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	/* An existing image is only truncated once nobody else has it open */
+	if ((fd = open(diskname, O_RDWR | O_CREAT, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (disk_lock(fd, diskname, 0)) {
+		close(fd);
+		return -1;
+	}
+
+	/*
+	 * Set the size without writing anything: the blocks read back as zeros
+	 * and the host only stores the ones written later.
+	 */
+	if (ftruncate(fd, 0) || ftruncate(fd, (off_t)count * size)) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	disk.fd = fd;
+	disk.size = (off_t)count * size;
+	disk.bsize = size;
+	disk.bcount = count;
+	disk.readonly = 0;
+
+	return 0;
+}
+
+int block_disk_map(void)
+{
+	void *map;
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (disk.map)
+		return 0;
+
+	/* Shared, so that it sees the blocks written through the file */
+	map = mmap(NULL, disk.size, PROT_READ, MAP_SHARED, disk.fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	disk.map = map;
+
+	return 0;
+}
+
+const void *block_addr(size_t block)
+{
+	if (!disk.map || block >= disk.bcount)
+		return NULL;
+
+	return (const char *)disk.map + block * disk.bsize;
+}
+
+static void block_disk_unmap(void)
+{
+	if (disk.map)
+		munmap(disk.map, disk.size);
+	disk.map = NULL;
+}
+
+static int disk_resize(size_t count)
+{
+	int mapped;
+
+	if (ftruncate(disk.fd, (off_t)count * disk.bsize)) {
+		perror("ftruncate");
+		return -1;
+	}
+
+	/* A mapping does not follow the file, map it again */
+	mapped = disk.map != NULL;
+	block_disk_unmap();
+	disk.size = (off_t)count * disk.bsize;
+	disk.bcount = count;
+	if (mapped)
+		block_disk_map();
 
 	return 0;
 }
 
+int block_disk_grow(size_t count)
+{
+	if (!disk_writable())
+		return -1;
+
+	if (count < disk.bcount) {
+		block_error("cannot shrink disk (%zu/%zu)", count, disk.bcount);
+		return -1;
+	}
+
+	/* As at creation, the new blocks are a hole until they get written */
+	return disk_resize(count);
+}
+
+int block_disk_shrink(size_t count)
+{
+	if (!disk_writable())
+		return -1;
+
+	if (count == 0 || count > disk.bcount) {
+		block_error("cannot grow disk (%zu/%zu)", count, disk.bcount);
+		return -1;
+	}
+
+	return disk_resize(count);
+}
+
 int block_disk_close(void)
 {
 	if (disk.fd == INVALID_FD) {
@@ -69,6 +303,7 @@ int block_disk_close(void)
 		return -1;
 	}
 
+	block_disk_unmap();
 	close(disk.fd);
 
 	disk.fd = INVALID_FD;
@@ -87,6 +322,30 @@ int block_disk_count(void)
 }
 
 int block_write(size_t block, const void *buf)
+{
+	if (!disk_writable())
+		return -1;
+
+	if (block >= disk.bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, disk.bcount);
+		return -1;
+	}
+
+	/*
+	 * Perform the actual write into the disk image. Positional I/O keeps the
+	 * shared file offset out of the picture so that several threads can
+	 * access the disk at once.
+	 */
+	if (pwrite(disk.fd, buf, disk.bsize, block * disk.bsize) < 0) {
+		perror("pwrite");
+		return -1;
+	}
+
+	return 0;
+}
+
+int block_read(size_t block, void *buf)
 {
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
@@ -99,46 +358,206 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	/* A mapped disk image is read without a system call */
+	if (disk.map) {
+		memcpy(buf, (char *)disk.map + block * disk.bsize, disk.bsize);
+		return 0;
+	}
+
+	/* Perform the actual read from the disk image */
+	if (pread(disk.fd, buf, disk.bsize, block * disk.bsize) < 0) {
+		perror("pread");
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	return 0;
+}
+
+
+int block_write_run(size_t block, const void *buf, size_t count)
+{
+	size_t len = count * disk.bsize;
+	off_t off = block * disk.bsize;
+
+	if (!disk_writable())
+		return -1;
+
+	if (block > disk.bcount || count > disk.bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
 		return -1;
 	}
 
+	/* Large writes may be cut short by the host, go on where they stop */
+	while (len > 0) {
+		ssize_t n = pwrite(disk.fd, buf, len, off);
+
+		if (n < 0) {
+			perror("pwrite");
+			return -1;
+		}
+		buf = (const char *)buf + n;
+		off += n;
+		len -= n;
+	}
+
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+int block_read_run(size_t block, void *buf, size_t count)
 {
+	size_t len = count * disk.bsize;
+	off_t off = block * disk.bsize;
+
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (block > disk.bcount || count > disk.bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (disk.map) {
+		memcpy(buf, (char *)disk.map + off, len);
+		return 0;
+	}
+
+	while (len > 0) {
+		ssize_t n = pread(disk.fd, buf, len, off);
+
+		if (n <= 0) {
+			if (n < 0)
+				perror("pread");
+			return -1;
+		}
+		buf = (char *)buf + n;
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+ssize_t block_send(int out_fd, size_t block, size_t offset, size_t len)
+{
+	off_t off = block * disk.bsize + offset;
+	size_t sent = 0;
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	if (block > disk.bcount || offset > (disk.bcount - block) * disk.bsize ||
+	    len > (disk.bcount - block) * disk.bsize - offset) {
+		block_error("byte range out of bounds (%zu:%zu+%zu/%zu)",
+			    block, offset, len, disk.bcount);
+		return -1;
+	}
+
+	/* sendfile() moves the data at off, and off after it, in the host */
+	while (sent < len) {
+		ssize_t n = sendfile(out_fd, disk.fd, &off, len - sent);
+
+		if (n <= 0) {
+			/* Not every output can be sent to, that's no error */
+			if (n < 0 && errno != EINVAL && errno != ENOSYS)
+				perror("sendfile");
+			break;
+		}
+		sent += n;
+	}
+
+	return sent || !len ? (ssize_t)sent : -1;
+}
+
+int block_discard(size_t block, size_t count)
+{
+	if (!disk_writable())
+		return -1;
+
+	if (block > disk.bcount || count > disk.bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		return -1;
+	}
+
+	/*
+	 * Punch a hole in the disk image: the blocks read back as zeros and the
+	 * host gets their storage back, while the image keeps its size.
+	 */
+	if (fallocate(disk.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      block * disk.bsize, count * disk.bsize) < 0) {
+		/* Not every host file system can punch holes, that's no error */
+		if (errno != EOPNOTSUPP && errno != ENOSYS)
+			perror("fallocate");
 		return -1;
 	}
 
 	return 0;
 }
 
+int block_copy(size_t dst_block, size_t src_block, size_t count)
+{
+	off_t off_in, off_out;
+	size_t len;
+	char *buf;
+
+	if (!disk_writable())
+		return -1;
+
+	if (src_block > disk.bcount || count > disk.bcount - src_block ||
+	    dst_block > disk.bcount || count > disk.bcount - dst_block) {
+		block_error("block range out of bounds (%zu,%zu+%zu/%zu)",
+			    dst_block, src_block, count, disk.bcount);
+		return -1;
+	}
+
+	/*
+	 * Let the kernel move the data without a round trip through user space;
+	 * host file systems that can share extents do not even copy it.
+	 */
+	off_in = src_block * disk.bsize;
+	off_out = dst_block * disk.bsize;
+	len = count * disk.bsize;
+	while (len > 0) {
+		ssize_t n = copy_file_range(disk.fd, &off_in, disk.fd, &off_out,
+					    len, 0);
+		if (n <= 0)
+			break;
+		len -= n;
+	}
+	if (len == 0)
+		return 0;
+
+	/* Not supported by the host, finish with large reads and writes */
+	buf = malloc(COPY_CHUNK_BLOCKS * disk.bsize);
+	if (!buf) {
+		perror("malloc");
+		return -1;
+	}
+	while (len > 0) {
+		size_t chunk = len < COPY_CHUNK_BLOCKS * disk.bsize ?
+			len : COPY_CHUNK_BLOCKS * disk.bsize;
+
+		if (pread(disk.fd, buf, chunk, off_in) != (ssize_t)chunk) {
+			perror("pread");
+			free(buf);
+			return -1;
+		}
+		if (pwrite(disk.fd, buf, chunk, off_out) != (ssize_t)chunk) {
+			perror("pwrite");
+			free(buf);
+			return -1;
+		}
+		off_in += chunk;
+		off_out += chunk;
+		len -= chunk;
+	}
+	free(buf);
+
+	return 0;
+}
@@ -2,9 +2,26 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/types.h> /* for ssize_t definition */
 
-/** Size of a disk block in bytes */
-#define BLOCK_SIZE 4096
+/** Size of a disk block in bytes, unless the virtual disk says otherwise */
+#define BLOCK_SIZE_DEFAULT 4096
+
+/** Range of disk block sizes, both powers of 2 */
+#define BLOCK_SIZE_MIN 512
+#define BLOCK_SIZE_MAX 65536
+
+/** Size of a disk block in bytes, that of the currently open virtual disk */
+#define BLOCK_SIZE block_size()
+
+/**
+ * block_size - Get disk's block size
+ *
+ * Return: The size in bytes of the blocks of the currently open virtual disk,
+ * as set by block_disk_set_size() or block_disk_create(), or
+ * %BLOCK_SIZE_DEFAULT if none was ever opened.
+ */
+size_t block_size(void) __attribute__((pure));
 
 /**
  * block_disk_open - Open virtual disk file
@@ -12,13 +29,117 @@
  *
  * Open virtual disk file @diskname. A virtual disk file must be opened before
  * blocks can be read from it with block_read() or written to it with
- * block_write().
+ * block_write(). Its blocks are %BLOCK_SIZE_MIN bytes until
+ * block_disk_set_size() is called, enough to read whatever in block 0 tells
+ * their actual size.
+ *
+ * The virtual disk file is locked for the process while it is open, so that
+ * it cannot be opened by another one at the same time, even read-only.
  *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
- * or is already open. 0 otherwise.
+ * or is already open, or if its size is not a multiple of %BLOCK_SIZE_MIN. 0
+ * otherwise.
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_readonly - Open virtual disk file for reading only
+ * @diskname: Name of the virtual disk file
+ *
+ * Same as block_disk_open(), but the virtual disk file is opened read-only:
+ * every function that writes to the disk fails. Any number of processes can
+ * have the same virtual disk file open read-only at once, as long as none has
+ * it open with block_disk_open().
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or is already open, or if its size is not a multiple of %BLOCK_SIZE_MIN. 0
+ * otherwise.
+ */
+int block_disk_open_readonly(const char *diskname);
+
+/**
+ * block_disk_set_size - Set disk's block size
+ * @size: Size of a block in bytes
+ *
+ * Make the blocks of the currently open virtual disk @size bytes long, a power
+ * of 2 between %BLOCK_SIZE_MIN and %BLOCK_SIZE_MAX. Block indices and the block
+ * count are in the new unit from then on.
+ *
+ * Return: -1 if there was no virtual disk file opened, if @size is invalid or
+ * if the size of the virtual disk file is not a multiple of it. 0 otherwise.
+ */
+int block_disk_set_size(size_t size);
+
+/**
+ * block_disk_create - Create and open virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @count: Number of blocks of the virtual disk
+ * @size: Size of a block in bytes, see block_disk_set_size()
+ *
+ * Create virtual disk file @diskname, or truncate it if it exists, with room
+ * for @count blocks of @size bytes, and open it. The file starts out sparse:
+ * every block reads as zeros and takes no storage on the host until it is
+ * written. The file is locked as with block_disk_open(), and an existing one
+ * is only truncated once the lock is held.
+ *
+ * Return: -1 if @diskname or @size is invalid, if the virtual disk file cannot
+ * be created or is open in another process, or if a virtual disk file is
+ * already open. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t count, size_t size);
+
+/**
+ * block_disk_grow - Grow virtual disk file
+ * @count: New number of blocks of the virtual disk
+ *
+ * Extend the currently open virtual disk to @count blocks. The blocks added at
+ * the end read as zeros and take no storage on the host until they are
+ * written, as with block_disk_create().
+ *
+ * Return: -1 if there was no virtual disk file opened, if @count is less than
+ * its current block count or if the virtual disk file cannot be extended. 0
+ * otherwise.
+ */
+int block_disk_grow(size_t count);
+
+/**
+ * block_disk_shrink - Shrink virtual disk file
+ * @count: New number of blocks of the virtual disk
+ *
+ * Cut the currently open virtual disk down to its first @count blocks. The
+ * blocks past them are lost.
+ *
+ * Return: -1 if there was no virtual disk file opened, if @count is 0 or more
+ * than its current block count or if the virtual disk file cannot be cut. 0
+ * otherwise.
+ */
+int block_disk_shrink(size_t count);
+
+/**
+ * block_disk_map - Map virtual disk file in memory
+ *
+ * Map the whole currently open virtual disk file read-only in memory, so that
+ * block_addr() can tell where its blocks are. The mapping is shared with the
+ * file: blocks written with block_write() and the like read the same through
+ * it, and block_read() and block_read_run() copy from it instead of reading
+ * the file. It follows block_disk_grow(), at a new address, and goes away with
+ * block_disk_close().
+ *
+ * Return: -1 if there was no virtual disk file opened, or if it cannot be
+ * mapped. 0 otherwise.
+ */
+int block_disk_map(void);
+
+/**
+ * block_addr - Get address of a mapped block
+ * @block: Index of the block
+ *
+ * Return: The address of the first byte of block @block in the mapping made by
+ * block_disk_map(), or NULL if the virtual disk is not mapped or if @block is
+ * out of bounds.
+ */
+const void *block_addr(size_t block);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -60,5 +181,84 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_run - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @buf: Data buffer to write in the blocks
+ * @count: Number of blocks to write
+ *
+ * Write the content of buffer @buf (@count times %BLOCK_SIZE bytes) in the
+ * @count blocks starting at @block, with as few host writes as it takes. Like
+ * block_write(), it can be called from several threads at once.
+ *
+ * Return: -1 if the range is out of bounds or inaccessible, or if the writing
+ * operation fails. 0 otherwise.
+ */
+int block_write_run(size_t block, const void *buf, size_t count);
+
+/**
+ * block_read_run - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @buf: Data buffer to be filled with content of the blocks
+ * @count: Number of blocks to read
+ *
+ * Read the content of the @count blocks starting at @block into buffer @buf
+ * (@count times %BLOCK_SIZE bytes), with as few host reads as it takes.
+ *
+ * Return: -1 if the range is out of bounds or inaccessible, or if the reading
+ * operation fails. 0 otherwise.
+ */
+int block_read_run(size_t block, void *buf, size_t count);
+
+/**
+ * block_send - Send bytes of consecutive blocks to a host file
+ * @out_fd: Host file descriptor to send to
+ * @block: Index of the first block to send from
+ * @offset: Offset in bytes inside @block of the first byte to send
+ * @len: Number of bytes to send
+ *
+ * Send @len bytes of the blocks starting at @block, from byte @offset of
+ * @block on, to host file descriptor @out_fd at its current position. The
+ * host kernel moves the data itself, it never goes through a user space
+ * buffer. Hosts that cannot send to @out_fd this way make it fail without
+ * sending anything, the data then has to be read with block_read_run() and
+ * written by the caller.
+ *
+ * Return: -1 if the range is out of bounds or inaccessible, or if nothing
+ * could be sent. Otherwise the number of bytes sent, less than @len only if
+ * sending failed partway.
+ */
+ssize_t block_send(int out_fd, size_t block, size_t offset, size_t len);
+
+/**
+ * block_discard - Discard blocks of the disk
+ * @block: Index of the first block to discard
+ * @count: Number of blocks to discard
+ *
+ * Tell the host that the content of the @count blocks starting at @block is no
+ * longer needed. The blocks read back as zeros afterwards, and the host file
+ * system releases the storage behind them; the size of the virtual disk file
+ * does not change.
+ *
+ * Return: -1 if the range is out of bounds, or if the host file system cannot
+ * discard blocks, in which case their content is left untouched. 0 otherwise.
+ */
+int block_discard(size_t block, size_t count);
+
+/**
+ * block_copy - Copy blocks within the disk
+ * @dst_block: Index of the first block to copy to
+ * @src_block: Index of the first block to copy from
+ * @count: Number of blocks to copy
+ *
+ * Copy the @count blocks starting at @src_block over the @count blocks starting
+ * at @dst_block. The two ranges must not overlap. The copy is done by the host
+ * kernel when it can, and by large reads and writes otherwise.
+ *
+ * Return: -1 if either range is out of bounds, or if the copy fails. 0
+ * otherwise.
+ */
+int block_copy(size_t dst_block, size_t src_block, size_t count);
+
 #endif /* _DISK_H */
 
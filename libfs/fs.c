@@ -1,17 +1,84 @@
 #include <assert.h>
+#include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <sched.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include "disk.h"
 #include "fs.h"
+#include "lz.h"
 
-#define FAT_EOC 0xffff
+//blk indices are 32 bits in memory whatever the format, FAT_EOC stands for
+//the end of chain of either
+#define FAT_EOC 0xffffffff
+#define FAT_EOC16 0xffff	//end of chain as stored by the 16 bit format
+
+//images past what 16 bit blk indices can reach use the 32 bit format, which
+//has its own signature so that drivers that only know the base format turn
+//it down instead of misreading it
+#define SB_SIGNATURE "ECS150FS"
+#define SB_SIGNATURE32 "ECSFAT32"
+#define FAT16_DATA_BLKS_MAX 65500	//so that num_blks_vd fits in 16 bits
+//the 16 bit format has blks of BLOCK_SIZE_DEFAULT bytes, the 32 bit one says
+//how large they are; the root dir spans as many blks as it takes
+#define RDIR_SIZE (FS_FILE_MAX_COUNT * sizeof(struct DiskEntry))
+#define RDIR_BLKS ((RDIR_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+//superblock extension stored in the base format's padding
+#define SB_EXT_SIGNATURE "ECSX"
+#define SB_EXT_VERSION 5
+//a grow that has not finished, see fs_grow; what the new layout puts in
+//place of the old one is journaled past its end first
+#define GROW_STARTED 1	//the old layout is as it was, rolled back at mount
+#define GROW_COMMITTED 2	//the journal is complete, replayed at mount
+#define GROW_REPLAYED 3	//the new layout is in place, the journal is dropped
+
+//number of blk indices held by one FAT or map blk
+#define FAT_ENTRIES_PER_BLK (BLOCK_SIZE / blk_index_size)
+
+//index_first_data_blk heads a FAT chain of map blks instead of the data;
+//map blks list the data blk of every logical blk, so holes cost nothing
+#define FILE_MAPPED 0x1
+#define MAP_ENTRIES_PER_BLK FAT_ENTRIES_PER_BLK
+#define MAP_HOLE 0	//data blk 0 is never handed out, so it marks a hole
+//mapped files only; writes store whole clusters of logical blks compressed
+//when that saves a blk, the compressed cluster lists its blks first and
+//MAP_COMPRESSED in the entries left over, which are never a data blk
+#define FILE_COMPRESSED 0x2
+#define CLUSTER_BLKS 8
+#define CLUSTER_SIZE (CLUSTER_BLKS * BLOCK_SIZE)
+//a compressed cluster saves at least a blk
+#define CLUSTER_PACKED_SIZE ((CLUSTER_BLKS - 1) * BLOCK_SIZE)
+#define MAP_COMPRESSED FAT_EOC
+//the last partial blk of the file is not in its chain or map but in a pack
+//blk, at tail_offset in tail_blk; pack blks hold the tails of several files
+#define FILE_PACKED 0x4
+#define PACK_TAIL_MAX (BLOCK_SIZE / 2)	//longest tail worth packing
+//a subdirectory, a plain FAT chain of a DirHeader and DirBuckets
+#define FILE_DIR 0x8
+#define DIR_SIGNATURE "ECSXDIR"
+#define DIR_DEPTH_MAX 12	//less if the table does not fit in the header
+#define DIR_TABLE_MAX (1 << DIR_DEPTH_MAX)
+#define DIR_ENTRIES_MIN (1 << 15)	//a new directory's full table indexes at
+					//least this many entries
+#define DIR_HEADER_BLKS_MAX \
+	((sizeof(struct DirHeader) + BLOCK_SIZE_MIN - 1) / BLOCK_SIZE_MIN)
+#define DIR_BUCKET_ENTRIES (BLOCK_SIZE / sizeof(struct DiskEntry) - 1)
+#define DIR_BUCKET_ENTRIES_MAX (BLOCK_SIZE_MAX / sizeof(struct DiskEntry) - 1)
+#define DIR_ROOT -1	//directory index of the root dir
+//largest file size, fs_stat returns it as an int
+#define FILE_SIZE_MAX INT_MAX
 
 typedef enum {false, true} bool;
 
-struct Superblock	//unsigned specs
+struct DiskSuperblock	//unsigned specs
 {
 	uint8_t signature[8]; //ECS150FS
 	uint16_t num_blks_vd;
@@ -19,597 +86,6049 @@ struct Superblock	//unsigned specs
 	uint16_t data_blk_start_index;
 	uint16_t num_data_blks;
 	uint8_t num_blks_fat;
-	uint8_t padding[4079];
+	//extension, versioned so that later revisions can grow it
+	uint8_t ext_signature[4]; //ECSX
+	uint8_t ext_version;
+	uint8_t ext_clean;	//1 if the summary below matches FAT and root dir
+	uint16_t num_free_data_blks;
+	uint16_t num_free_rdir_entries;
+	uint16_t first_free_fat_hint;	//no free FAT entry below this index
+	uint32_t rdir_checksum;	//root dir the summary was computed against
+	//version 2
+	uint8_t ext_reclaim_pending;	//deleted chains may still be in the FAT
+	//version 3
+	uint16_t refcnt_first_blk;	//chain of the reference count table, 0 if none
+	//version 4
+	uint16_t dedup_first_blk;	//chain of the block hash table, 0 if none
+	//version 5
+	uint8_t grow_state;	//GROW_*, 0 if no grow is under way
+	uint16_t grow_num_data_blks;	//data blks once grown
+	uint16_t grow_jnl_blk;	//first blk of the journal, past the grown image
+	uint16_t grow_jnl_len;	//blks the journal writes back
 } __attribute__((__packed__));
 
-struct FATEntry
+struct DiskSuperblock32	//same fields, 32 bit FAT and blk indices
+{
+	uint8_t signature[8]; //ECSFAT32
+	uint32_t num_blks_vd;
+	uint32_t root_dir_blk_index;
+	uint32_t data_blk_start_index;
+	uint32_t num_data_blks;
+	uint32_t num_blks_fat;
+	uint32_t block_size;
+	uint8_t ext_signature[4]; //ECSX
+	uint8_t ext_version;
+	uint8_t ext_clean;
+	uint32_t num_free_data_blks;
+	uint16_t num_free_rdir_entries;
+	uint32_t first_free_fat_hint;
+	uint32_t rdir_checksum;
+	uint8_t ext_reclaim_pending;
+	uint32_t refcnt_first_blk;
+	uint32_t dedup_first_blk;
+	uint8_t grow_state;
+	uint32_t grow_num_data_blks;
+	uint32_t grow_jnl_blk;
+	uint32_t grow_jnl_len;
+} __attribute__((__packed__));
+
+struct Superblock	//either format once read, see sb_decode
+{
+	uint32_t num_blks_vd;
+	uint32_t root_dir_blk_index;
+	uint32_t data_blk_start_index;
+	uint32_t num_data_blks;
+	uint32_t num_blks_fat;
+	uint32_t block_size;
+	bool has_ext;	//the extension was there, ext_* below are 0 if not
+	uint8_t ext_version;
+	uint8_t ext_clean;
+	uint32_t num_free_data_blks;
+	uint32_t num_free_rdir_entries;
+	uint32_t first_free_fat_hint;
+	uint32_t rdir_checksum;
+	uint8_t ext_reclaim_pending;
+	uint32_t refcnt_first_blk;
+	uint32_t dedup_first_blk;
+	uint8_t grow_state;
+	uint32_t grow_num_data_blks;
+	uint32_t grow_jnl_blk;
+	uint32_t grow_jnl_len;
+};
+
+struct RootDirEntry	//either format once read, see entry_decode
 {
-	uint16_t value; //can be 0/num/FAT_EOC
+	uint8_t filename[FS_FILENAME_LEN];
+	uint32_t size_file_bytes;
+	uint32_t index_first_data_blk;
+	uint8_t flags;	//FILE_* layout flags, 0 for a plain FAT chain
+	uint32_t flags_tag;	//rdir_entry_tag of the entry when flags was set
+	uint32_t tail_blk;	//FILE_PACKED only, pack blk holding the tail
+	uint16_t tail_offset;	//FILE_PACKED only, where the tail starts in it
 } __attribute__((__packed__));
 
-struct RootDirEntry
+struct DiskEntry	//root dir and directory entry of the 16 bit format
 {
 	uint8_t filename[FS_FILENAME_LEN];
 	uint32_t size_file_bytes;
 	uint16_t index_first_data_blk;
-	uint8_t padding[10];
+	uint8_t flags;
+	uint32_t flags_tag;
+	uint16_t tail_blk;
+	uint16_t tail_offset;
+	uint8_t padding[1];
+} __attribute__((__packed__));
+
+struct DiskEntry32	//the same in 32 bits, with no room left for a tag; only
+{	//we read the 32 bit format, so its flags are always trusted
+	uint8_t filename[FS_FILENAME_LEN];
+	uint32_t size_file_bytes;
+	uint32_t index_first_data_blk;
+	uint8_t flags;
+	uint32_t tail_blk;
+	uint16_t tail_offset;
+	uint8_t padding[1];
 } __attribute__((__packed__));
 
+struct DirHeader	//first blks of a directory; an entry is in the bucket the
+{	//low depth bits of the hash of its name select in the table
+	uint8_t signature[8];	//ECSXDIR
+	uint8_t depth;	//2^depth entries of the table are in use
+	uint8_t num_blks;	//blks the header takes, 0 for 1
+	uint8_t padding[6];
+	uint16_t bucket[DIR_TABLE_MAX];	//logical blk of the bucket of each hash,
+					//as much of it as fits in the header blks
+} __attribute__((__packed__));
+
+struct DirBucket	//the other blks of a directory, decoded; on disk the depth
+{	//takes the room of an entry
+	uint8_t depth;	//hashes of the entries here agree on this many low bits
+	struct RootDirEntry entry[DIR_BUCKET_ENTRIES_MAX];	//empty if no filename
+};
+
+struct DirSlot	//where an entry loaded past the root dir entries is on disk
+{
+	int dir_index;	//entry of its directory, DIR_ROOT if the slot is free
+	uint16_t bucket;	//logical blk of the directory holding it
+	uint16_t pos;	//its index in the bucket
+	uint16_t refs;	//lookups and open fds holding it, and loaded entries of
+			//its own if it is a directory
+	struct RootDirEntry disk;	//the entry as it was last written
+};
+
+struct FileMap	//in-core copy of a mapped file's map, see FILE_MAPPED
+{
+	uint32_t *data_blk;	//MAP_ENTRIES_PER_BLK entries per map blk
+	uint32_t *map_blk;	//blks of the map chain, in order
+	uint8_t *dirty;	//one per map blk
+	size_t num_map_blks;
+	size_t cap_map_blks;	//map blks the arrays have room for
+	uint32_t *released;	//data blks no longer listed, let go by map_flush
+	size_t num_released;
+	size_t cap_released;
+};
+
+struct BlkTable	//one entry per data blk, kept in a FAT chain the superblock
+{	//points to, like a file nobody can open
+	void *entries;	//NULL while the image has no table
+	size_t entry_size;
+	uint32_t *blk;	//blks of the table's chain, in order
+	uint8_t *blk_dirty;	//one per table blk
+	size_t num_blks;
+};
+
+struct ReclaimItem	//chain waiting to be freed
+{
+	uint32_t blk;	//first blk left to free
+	bool mapped;	//chain of map blks, the data blks they list go too
+};
+
+struct GrowMove	//how data blk indices change when the FAT grows into the
+{	//data blks, see fs_grow
+	uint32_t shift;	//new FAT blks, the data blks start this much later
+	uint32_t *moved;	//new index of each of data blks 1 to shift, if used
+	uint32_t data_start;	//first data blk on disk once grown
+	uint32_t num_data_blks;	//data blks before growing
+	uint8_t *done;	//old data blks of maps and directories rewritten already
+	uint8_t *fat;	//FAT once grown, built before it takes over
+	uint8_t *fat_loaded;
+	uint8_t *fat_dirty;
+	struct RootDirEntry *rootdir;	//root dir once grown
+	uint32_t jnl_blk;	//first blk of the journal, past the grown image
+	uint32_t *jnl_dst;	//where each journaled blk goes
+	size_t jnl_len;
+	size_t jnl_cap;	//blks the image has room for past jnl_blk, index aside
+};
+
+struct ChainHint	//where the last transfer through an fd left a FAT chain
+{
+	size_t lblk;
+	uint32_t data_blk;	//0 if there is no hint
+	uint32_t prev_data_blk;
+	uint32_t gen;	//chain_gen when the hint was taken
+};
+
 struct FD	//packed not needed because this info is not written to disk
 {
-	char filename[FS_FILENAME_LEN];
+	int rdir_index;	//file's entry in root dir, -1 when the fd is free
 	size_t offset;	//offset can not be negative
+	int next_free;	//next fd on the free list while this one is free
+	struct ChainHint hint;	//so sequential transfers do not walk the chain
+	uint16_t pins;	//fs_map_blocks calls not released yet
 };
 
 static struct Superblock *superblock;
-static struct FATEntry *fat;
+static bool fat32;	//the image is in the 32 bit format
+static size_t blk_index_size;	//bytes of a blk index in the FAT and maps
+static uint8_t *fat;	//as stored, see fat_get
 static struct RootDirEntry *rootdir;
-static struct FD *fdtable;
+static struct FD *fdtable;	//grows on demand up to fd_open_max entries
+static int fdtable_size;
+static int fd_free_head;	//first free fd in fdtable, -1 if none
+static int fd_open_max;	//open limit chosen at mount
 static int fd_open;
+//entries in subdirectories are loaded in rootdir past the root dir entries
+//while they are in use, rdir_cap entries in all; rootdir grows, so pointers
+//to entries are not kept across lookups
+static int rdir_cap;
+static struct DirSlot *dir_slot;	//rdir_cap - FS_FILE_MAX_COUNT slots
+static uint8_t rdir_disk[RDIR_SIZE];	//root dir as last written
+static bool rdir_disk_stale;	//the root dir moved, none of it is written yet
+//number of fds open on each entry, kept next to the entries
+static uint16_t *rdir_open_count;
+static uint16_t *rdir_pin_count;	//pins of all the fds, see fs_map_blocks
+//map of each mapped file, loaded while the file is open
+static struct FileMap **rdir_map;
+static bool sparse_enabled;	//offsets past the end of file are allowed
+//bumped whenever blks leave a FAT chain, older chain hints are not trusted
+static uint32_t chain_gen;
 static bool fsmounted;	//boolean; either one fs is mounted or none
+static bool readonly;	//mounted with FS_MOUNT_RDONLY, nothing gets written
+//reads of file data share it, writes take it alone: a write changes the
+//chain or map, the size and the FAT blks of its file, and the root dir of
+//every file; taken before any other lock
+static pthread_rwlock_t io_lock = PTHREAD_RWLOCK_INITIALIZER;
 
-//phase 1
-
-int fs_mount(const char *diskname)
-{
-	if(diskname == NULL || fsmounted) return -1;
+//FAT blocks are read on first use (lazy mount) and written back only if dirty
+//one byte per FAT block; loaded is read without fat_lock by the fast path
+static uint8_t *fat_blk_loaded;
+static uint8_t *fat_blk_dirty;
+//serializes FAT block loading between callers and the prefetch thread
+static pthread_mutex_t fat_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t fat_prefetcher;
+static bool fat_prefetching;
+static volatile bool fat_prefetch_stop;
 
-	if(block_disk_open(diskname) == -1) return -1;
+//free space summary, either loaded from a clean superblock or rescanned
+static bool free_counts_valid;
+static uint32_t num_free_data_blks;
+static uint16_t num_free_rdir_entries;
+static uint32_t fat_free_hint;	//lowest FAT index that may be free
+static bool sb_dirty_on_disk;	//superblock on disk says not clean
+static bool sb_reclaim_on_disk;	//superblock on disk says reclaim pending
+static bool sb_tables_dirty;	//superblock points to a table not on disk yet
 
-	//map or mount superblock
-	superblock = malloc(BLOCK_SIZE);
-	if(block_read(0, superblock) == -1) return -1;
+//freed data blks are punched out of the image in runs, see FS_MOUNT_DISCARD
+static bool discard_enabled;
+static uint32_t discard_start;	//first blk of the run not discarded yet
+static size_t discard_len;
 
-	//validate disk 
-	//validate superblock
-	if(memcmp(superblock->signature, "ECS150FS", 8) != 0) 
-		return -1; //signature
-	if(1 + superblock->num_blks_fat + 1 + superblock->num_data_blks
-		!= superblock->num_blks_vd) return -1;	//block amount
-	if(superblock->num_blks_vd != block_disk_count()) return -1; //block amount
+//owners past the first of every data blk, only mapped files share blks (see
+//fs_clone); the table is created by the first clone
+static struct BlkTable refcnt_table = { .entry_size = sizeof(uint16_t) };
 
-	//validate FAT using ceiling function
-	//https://www.geeksforgeeks.org/find-ceil-ab-without-using-ceil-function/
-	//check if num_blks_fat = ceil((num_data_blks*2)/BLOCK_SIZE)
-	if(superblock->num_blks_fat != ((superblock->num_data_blks * 2) / 
-		BLOCK_SIZE) + (((superblock->num_data_blks * 2) % BLOCK_SIZE) != 0))
-		return -1;
+//hash of the content of every data blk that full blk writes can share, 0 for
+//none; the table is created by the first mount with FS_MOUNT_DEDUP and is
+//indexed by hash in memory, through chains of data blks with the same bucket
+static struct BlkTable dedup_table = { .entry_size = sizeof(uint32_t) };
+static uint32_t *dedup_bucket;	//first data blk of every bucket, 0 if none
+static uint32_t *dedup_next;	//next data blk in the same bucket
+static size_t dedup_num_buckets;	//power of 2
+static bool dedup_enabled;	//full blk writes look for a blk to share
+static size_t dedup_hits;	//blk writes saved by sharing since mount
 
-	//validate disk order
-	if(1 + superblock->num_blks_fat != superblock->root_dir_blk_index)
-		return -1;	//root index
-	if(superblock->root_dir_blk_index + 1 != superblock->data_blk_start_index)
-		return -1; //first data index
+//tails of files nobody has open are packed, see FS_MOUNT_PACK; which pack
+//blk bytes are taken is only known from the root dir entries pointing there
+static bool pack_enabled;
+static uint8_t pack_cache[BLOCK_SIZE_MAX];	//last pack blk read or written
+static uint32_t pack_cache_blk;	//its data blk, 0 if none
+//guards the cache, fs_pread callers read packed tails at once; taken after
+//alloc_lock, never held while allocating
+static pthread_mutex_t pack_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	//map or mount FAT; 4096 bytes * num FAT blocks
-	//a different procedure because fat is not one block like the others
-	fat = malloc(BLOCK_SIZE * superblock->num_blks_fat); 
-	//copy block by block
-	for(size_t i = 1, j = 0; i < superblock->root_dir_blk_index; i++, j++)
-	{
-		if(block_read(i, (void*)fat + j * BLOCK_SIZE) == -1) return -1;
-	}
+//header of the last directory looked in, see dir_header
+static struct DirHeader dir_cache;
+static uint32_t dir_cache_blk;	//its data blk, 0 if none
 
-	//validate Fat array
-	if(fat[0].value != FAT_EOC) return -1;
+//chains of deleted files, freed later by the worker or by the allocator
+#define RECLAIM_BATCH 256	//blks freed per step, bounds lock hold time
+static struct ReclaimItem *reclaim_queue;
+static size_t reclaim_len;
+static size_t reclaim_cap;
+//serializes FAT changes, the allocator and the queue with the worker
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t reclaimer;
+static bool reclaiming;
+static bool reclaim_stop;
 
-	//map or mount root dir
-	rootdir = malloc(BLOCK_SIZE);
-	if(block_read(superblock->root_dir_blk_index, rootdir) == -1) return -1;
+static int sb_write(void);
+static uint32_t rdir_entry_tag(const struct RootDirEntry *rootdirentry);
+static int blk_table_create(struct BlkTable *table);
+static int refcnt_create(void);
+static int tail_pack(int rdir_index);
+static int tail_unpack(int rdir_index);
+static size_t dir_header_blks(const struct DirHeader *header);
+static bool dir_header_valid(const struct DirHeader *header, size_t num_blks);
+static bool dir_entry_live(const struct DirHeader *header, uint16_t bucket,
+	const struct RootDirEntry *entry);
+static int slot_write(int rdir_index);
+static int entry_get(int dir_index, const char *filename);
+uint32_t index_data_blk(uint32_t data_start_index , size_t file_offset);
+uint32_t allocate_new_data_blk(uint32_t prev_blk_index);
+static int allocate_data_blks(uint32_t *blks, size_t count);
+static bool filename_valid(const char *filename);
+static int grow_recover(void);
 
-	//allocate and reset fd table
-	fdtable = calloc(FS_OPEN_MAX_COUNT, sizeof(struct FD));
+//---start of format helper functions
+//fields both superblock formats have, copied between either and the decoded
+//one
+#define SB_COPY(dst, src) do { \
+	(dst)->num_blks_vd = (src)->num_blks_vd; \
+	(dst)->root_dir_blk_index = (src)->root_dir_blk_index; \
+	(dst)->data_blk_start_index = (src)->data_blk_start_index; \
+	(dst)->num_data_blks = (src)->num_data_blks; \
+	(dst)->num_blks_fat = (src)->num_blks_fat; \
+} while(0)
+#define SB_EXT_COPY(dst, src) do { \
+	(dst)->ext_version = (src)->ext_version; \
+	(dst)->ext_clean = (src)->ext_clean; \
+	(dst)->num_free_data_blks = (src)->num_free_data_blks; \
+	(dst)->num_free_rdir_entries = (src)->num_free_rdir_entries; \
+	(dst)->first_free_fat_hint = (src)->first_free_fat_hint; \
+	(dst)->rdir_checksum = (src)->rdir_checksum; \
+	(dst)->ext_reclaim_pending = (src)->ext_reclaim_pending; \
+	(dst)->refcnt_first_blk = (src)->refcnt_first_blk; \
+	(dst)->dedup_first_blk = (src)->dedup_first_blk; \
+	(dst)->grow_state = (src)->grow_state; \
+	(dst)->grow_num_data_blks = (src)->grow_num_data_blks; \
+	(dst)->grow_jnl_blk = (src)->grow_jnl_blk; \
+	(dst)->grow_jnl_len = (src)->grow_jnl_len; \
+} while(0)
 
-	fsmounted = true;
+static int sb_decode(const void *buf, struct Superblock *sb)
+{
+	//decode blk 0 and pick the format, -1 if blk 0 is neither
+	const struct DiskSuperblock *sb16 = buf;
+	const struct DiskSuperblock32 *sb32 = buf;
+	memset(sb, 0, sizeof(struct Superblock));
+	if(memcmp(sb16->signature, SB_SIGNATURE, 8) == 0)
+	{
+		fat32 = false;
+		SB_COPY(sb, sb16);
+		sb->block_size = BLOCK_SIZE_DEFAULT;
+		sb->has_ext = memcmp(sb16->ext_signature, SB_EXT_SIGNATURE,
+			4) == 0;
+		if(sb->has_ext) SB_EXT_COPY(sb, sb16);
+	}
+	else if(memcmp(sb32->signature, SB_SIGNATURE32, 8) == 0)
+	{
+		fat32 = true;
+		SB_COPY(sb, sb32);
+		sb->block_size = sb32->block_size;
+		sb->has_ext = memcmp(sb32->ext_signature, SB_EXT_SIGNATURE,
+			4) == 0;
+		if(sb->has_ext) SB_EXT_COPY(sb, sb32);
+	}
+	else
+	{
+		return -1;
+	}
+	blk_index_size = fat32 ? sizeof(uint32_t) : sizeof(uint16_t);
 
 	return 0;
 }
 
-int fs_umount(void)
+static void sb_encode(const struct Superblock *sb, void *buf)
 {
-	//error check
-	if(!fsmounted || fd_open > 0) return -1;
-
-	//save disk and close
-	//dont need to write back superblock because we didnt change it
-
-	//write back FAT, which starts at block index 1 in disk
-	for(size_t i = 1, j = 0; i < superblock->root_dir_blk_index; i++, j++)
+	//blk 0 in the format of the image
+	struct DiskSuperblock *sb16 = buf;
+	struct DiskSuperblock32 *sb32 = buf;
+	memset(buf, 0, sb->block_size);
+	if(!fat32)
 	{
-		if(block_write(i, (void*)fat + j * BLOCK_SIZE) == -1) return -1;
+		memcpy(sb16->signature, SB_SIGNATURE, 8);
+		SB_COPY(sb16, sb);
+		if(!sb->has_ext) return;
+		memcpy(sb16->ext_signature, SB_EXT_SIGNATURE, 4);
+		SB_EXT_COPY(sb16, sb);
 	}
+	else
+	{
+		memcpy(sb32->signature, SB_SIGNATURE32, 8);
+		SB_COPY(sb32, sb);
+		sb32->block_size = sb->block_size;
+		if(!sb->has_ext) return;
+		memcpy(sb32->ext_signature, SB_EXT_SIGNATURE, 4);
+		SB_EXT_COPY(sb32, sb);
+	}
+}
 
-	//write back root dir
-	if(block_write(superblock->root_dir_blk_index, rootdir) == -1) return -1;
-
-	if(block_disk_close() == -1) return -1;
+static uint32_t blk_index_decode(const void *buf, size_t i)
+{
+	//i-th entry of a FAT or map blk as stored
+	if(fat32) return ((const uint32_t*)buf)[i];
+	uint16_t value = ((const uint16_t*)buf)[i];
 
-	free(superblock);
-	free(fat);
-	free(rootdir);
-	free(fdtable);
+	return value == FAT_EOC16 ? FAT_EOC : value;
+}
 
-	fsmounted = false;
+static void blk_index_encode(void *buf, size_t i, uint32_t value)
+{
+	if(fat32)
+		((uint32_t*)buf)[i] = value;
+	else
+		((uint16_t*)buf)[i] = value;	//FAT_EOC becomes FAT_EOC16
+}
 
-	return 0;
+static void map_blk_decode(const void *buf, uint32_t *entries)
+{
+	//every entry of a map blk as stored
+	for(size_t i = 0; i < MAP_ENTRIES_PER_BLK; i++)
+		entries[i] = blk_index_decode(buf, i);
 }
 
-int fs_info(void)
+static void map_blk_encode(const uint32_t *entries, void *buf)
 {
-	if(!fsmounted) return -1;
+	for(size_t i = 0; i < MAP_ENTRIES_PER_BLK; i++)
+		blk_index_encode(buf, i, entries[i]);
+}
 
-	printf("FS Info:\n");
-	printf("total_blk_count=%i\n", superblock->num_blks_vd);
-	printf("fat_blk_count=%i\n", superblock->num_blks_fat);
-	printf("rdir_blk=%i\n", superblock->root_dir_blk_index);
-	printf("data_blk=%i\n", superblock->data_blk_start_index);
-	printf("data_blk_count=%i\n", superblock->num_data_blks);
+static void entry_encode16(const struct RootDirEntry *entry, 
+	struct DiskEntry *disk_entry)
+{
+	memset(disk_entry, 0, sizeof(struct DiskEntry));
+	memcpy(disk_entry->filename, entry->filename, FS_FILENAME_LEN);
+	disk_entry->size_file_bytes = entry->size_file_bytes;
+	disk_entry->index_first_data_blk = entry->index_first_data_blk;
+	disk_entry->flags = entry->flags;
+	disk_entry->flags_tag = entry->flags_tag;
+	disk_entry->tail_blk = entry->tail_blk;
+	disk_entry->tail_offset = entry->tail_offset;
+}
 
-	int num_fat_free_entries = 0;
-	//can skip first FAT_EOC
-	for(uint16_t i = 1; i < superblock->num_data_blks; i++)	
+static void entry_decode(const void *buf, struct RootDirEntry *entry)
+{
+	//an entry of the root dir or of a directory blk as stored
+	if(!fat32)
 	{
-		//free entry in FAT if value is 0
-		if(fat[i].value == 0) num_fat_free_entries++;
+		const struct DiskEntry *disk_entry = buf;
+		memcpy(entry->filename, disk_entry->filename, FS_FILENAME_LEN);
+		entry->size_file_bytes = disk_entry->size_file_bytes;
+		entry->index_first_data_blk = disk_entry->index_first_data_blk == 
+			FAT_EOC16 ? FAT_EOC : disk_entry->index_first_data_blk;
+		entry->flags = disk_entry->flags;
+		entry->flags_tag = disk_entry->flags_tag;
+		entry->tail_blk = disk_entry->tail_blk;
+		entry->tail_offset = disk_entry->tail_offset;
+		return;
 	}
-	printf("fat_free_ratio=%d/%d\n", num_fat_free_entries, 
-	superblock->num_data_blks);
 
-	int num_rootdir_free_entries = 0;
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	const struct DiskEntry32 *disk_entry = buf;
+	memcpy(entry->filename, disk_entry->filename, FS_FILENAME_LEN);
+	entry->size_file_bytes = disk_entry->size_file_bytes;
+	entry->index_first_data_blk = disk_entry->index_first_data_blk;
+	entry->flags = disk_entry->flags;
+	entry->tail_blk = disk_entry->tail_blk;
+	entry->tail_offset = disk_entry->tail_offset;
+	entry->flags_tag = rdir_entry_tag(entry);
+}
+
+static void entry_encode(const struct RootDirEntry *entry, void *buf)
+{
+	if(!fat32)
 	{
-		//free entry in root dir if first char of filename is null
-		if(rootdir[i].filename[0] == '\0') num_rootdir_free_entries++;
+		entry_encode16(entry, buf);
+		return;
 	}
-	printf("rdir_free_ratio=%d/%d\n", num_rootdir_free_entries,
-		FS_FILE_MAX_COUNT);
-	
-	return 0;
-}
 
-//phase 2
+	struct DiskEntry32 *disk_entry = buf;
+	memset(disk_entry, 0, sizeof(struct DiskEntry32));
+	memcpy(disk_entry->filename, entry->filename, FS_FILENAME_LEN);
+	disk_entry->size_file_bytes = entry->size_file_bytes;
+	disk_entry->index_first_data_blk = entry->index_first_data_blk;
+	disk_entry->flags = entry->flags;
+	disk_entry->tail_blk = entry->tail_blk;
+	disk_entry->tail_offset = entry->tail_offset;
+}
 
-int fs_create(const char *filename)
+static void dir_header_decode(const uint8_t *buf, size_t lblk, 
+	struct DirHeader *header)
 {
-	if(!fsmounted || filename == NULL || strlen(filename) + 1
-		> FS_FILENAME_LEN) return -1;
+	//logical blk lblk of a directory's header as stored, blk 0 first; the
+	//table goes on in the blks after it, small blks hold less of it
+	size_t start = lblk * BLOCK_SIZE;
+	if(lblk == 0) memset(header, 0, sizeof(struct DirHeader));
+	if(start >= sizeof(struct DirHeader)) return;
+	size_t len = sizeof(struct DirHeader) - start < BLOCK_SIZE ? 
+		sizeof(struct DirHeader) - start : BLOCK_SIZE;
+	memcpy((uint8_t*)header + start, buf, len);
+}
 
-	int num_files = 0, first_available_index = -1;	//-1 for invalid
+static void dir_header_encode(const struct DirHeader *header, size_t lblk,
+	uint8_t *buf)
+{
+	size_t start = lblk * BLOCK_SIZE;
+	memset(buf, 0, BLOCK_SIZE);
+	if(start >= sizeof(struct DirHeader)) return;
+	size_t len = sizeof(struct DirHeader) - start < BLOCK_SIZE ? 
+		sizeof(struct DirHeader) - start : BLOCK_SIZE;
+	memcpy(buf, (const uint8_t*)header + start, len);
+}
 
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
-	{	//need to check every entry before we decide
-		//filename already exists
-		if(strcmp((char*)rootdir[i].filename, filename) == 0) return -1;
-		if(rootdir[i].filename[0] != '\0')
-		{
-			num_files++;
-		}
-		else if(first_available_index == -1)
-		{
-			first_available_index = i;
-		}
-	}
-	//root directory already has 128 files
-	if(num_files == FS_FILE_MAX_COUNT) return -1;
+static void dir_bucket_decode(const uint8_t *buf, struct DirBucket *dir_bucket)
+{
+	//a directory blk past the header as stored, the depth in place of entry 0
+	dir_bucket->depth = buf[0];
+	for(size_t pos = 0; pos < DIR_BUCKET_ENTRIES; pos++)
+		entry_decode(buf + (pos + 1) * sizeof(struct DiskEntry), 
+			&dir_bucket->entry[pos]);
+}
 
-	//else, safe to create this new file in root dir
-	strcpy((char*)rootdir[first_available_index].filename, filename);
-	rootdir[first_available_index].size_file_bytes = 0;
-	rootdir[first_available_index].index_first_data_blk = FAT_EOC;
+static void dir_bucket_encode(const struct DirBucket *dir_bucket, uint8_t *buf)
+{
+	memset(buf, 0, sizeof(struct DiskEntry));
+	buf[0] = dir_bucket->depth;
+	for(size_t pos = 0; pos < DIR_BUCKET_ENTRIES; pos++)
+		entry_encode(&dir_bucket->entry[pos], 
+			buf + (pos + 1) * sizeof(struct DiskEntry));
+}
+//---end of format helper functions
 
-	if(block_write(superblock->root_dir_blk_index, rootdir) == -1) return -1;
-	
-	return 0;
+//---start of blk table helper functions
+static size_t blk_table_blks_needed(const struct BlkTable *table)
+{
+	//ceiling function from geeks for geeks
+	size_t per_blk = BLOCK_SIZE / table->entry_size;
+	return (superblock->num_data_blks / per_blk) + 
+		((superblock->num_data_blks % per_blk) != 0);
 }
 
-int fs_delete(const char *filename)
+static void blk_table_mark(struct BlkTable *table, uint32_t data_blk)
 {
-	if(!fsmounted || filename == NULL || strlen(filename) + 1
-		> FS_FILENAME_LEN) return -1;
+	//the table blk holding data_blk's entry changed
+	table->blk_dirty[data_blk / (BLOCK_SIZE / table->entry_size)] = 1;
+}
 
-	//check if the file is currently open in fd_table
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+static int blk_table_flush(struct BlkTable *table)
+{
+	//write back the table blks that changed
+	for(size_t i = 0; i < table->num_blks; i++)
 	{
-		if(strcmp(fdtable[i].filename, filename) == 0)
-		{
-			return -1;
-		}
+		if(!table->blk_dirty[i]) continue;
+		if(block_write(superblock->data_blk_start_index + table->blk[i], 
+			(uint8_t*)table->entries + i * BLOCK_SIZE) == -1) return -1;
+		table->blk_dirty[i] = 0;
 	}
 
-	//find file in root dir
-	int i = 0;
-	bool found_file = false;
-	for(; i < FS_FILE_MAX_COUNT; i++)
-	{
-		if(strcmp((char*)rootdir[i].filename, filename) == 0)
-		{
-			found_file = true;
-			break;
-		}
-	}
-	//file not found
-	if(found_file == false) return -1;
+	return 0;
+}
 
-	//otherwise, clean file's contents in root dir and FAT
-	uint16_t index_cur_data_blk = rootdir[i].index_first_data_blk;
+static void blk_table_release(struct BlkTable *table)
+{
+	free(table->entries);
+	free(table->blk);
+	free(table->blk_dirty);
+	table->entries = NULL;
+	table->blk = NULL;
+	table->blk_dirty = NULL;
+	table->num_blks = 0;
+}
+//---end of blk table helper functions
 
-	//clean file's contents in root dir
-	rootdir[i].filename[0] = '\0';
-	rootdir[i].index_first_data_blk = '\0';
+//---start of refcount helper functions
+static uint16_t refcnt_get(uint32_t data_blk)
+{
+	uint16_t *refcnt = refcnt_table.entries;
+	return refcnt != NULL ? refcnt[data_blk] : 0;
+}
 
-	//clean file's contents in FAT
-	while(index_cur_data_blk != FAT_EOC)
-	{
-		uint16_t index_next_data_blk = fat[index_cur_data_blk].value;
-		fat[index_cur_data_blk].value = 0;
-		index_cur_data_blk = index_next_data_blk;
-	}
+static void refcnt_set(uint32_t data_blk, uint16_t value)
+{
+	//caller holds alloc_lock, and the table exists
+	((uint16_t*)refcnt_table.entries)[data_blk] = value;
+	blk_table_mark(&refcnt_table, data_blk);
+}
+//---end of refcount helper functions
 
-	//write back FAT, which starts at block index 1 in disk
-	for(size_t i = 1, j = 0; i < superblock->root_dir_blk_index; i++, j++)
+//---start of dedup helper functions
+static uint32_t dedup_hash_blk(const void *buf)
+{
+	//FNV-1a a word at a time, folded to 32 bits; 0 means no hash
+	const uint8_t *byte = buf;
+	uint64_t hash = 14695981039346656037u;
+	for(size_t i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t))
 	{
-		if(block_write(i, (void*)fat + j * BLOCK_SIZE) == -1) return -1;
+		uint64_t word;
+		memcpy(&word, byte + i, sizeof(uint64_t));	//buf may be unaligned
+		hash ^= word;
+		hash *= 1099511628211u;
 	}
+	uint32_t folded = (uint32_t)(hash ^ (hash >> 32));
 
-	//write back root dir
-	if(block_write(superblock->root_dir_blk_index, rootdir) == -1) return -1;
+	return folded != 0 ? folded : 1;
+}
 
-	return 0;
+static void dedup_insert(uint32_t data_blk, uint32_t hash)
+{
+	//index data_blk under hash, caller holds alloc_lock and data_blk is not
+	//indexed
+	uint32_t *hashes = dedup_table.entries;
+	size_t bucket = hash & (dedup_num_buckets - 1);
+	hashes[data_blk] = hash;
+	blk_table_mark(&dedup_table, data_blk);
+	dedup_next[data_blk] = dedup_bucket[bucket];
+	dedup_bucket[bucket] = data_blk;
 }
 
-int fs_ls(void)
+static void dedup_forget(uint32_t data_blk)
 {
-	if(!fsmounted) return -1;
+	//the content of data_blk is about to change or the blk is freed, drop it 
+	//from the index; caller holds alloc_lock
+	//before the index is built at mount, the whole table is about to be
+	//dropped or rebuilt anyway
+	uint32_t *hashes = dedup_table.entries;
+	if(dedup_bucket == NULL || hashes[data_blk] == 0) return;
 
-	printf("FS Ls:\n");
+	uint32_t *link = &dedup_bucket[hashes[data_blk] & (dedup_num_buckets - 1)];
+	while(*link != 0 && *link != data_blk) link = &dedup_next[*link];
+	if(*link == data_blk) *link = dedup_next[data_blk];
+	hashes[data_blk] = 0;
+	blk_table_mark(&dedup_table, data_blk);
+}
 
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+static int dedup_index_build(bool trusted)
+{
+	//hash the table into buckets; a table we cannot trust is emptied instead
+	dedup_num_buckets = 1;
+	while(dedup_num_buckets < superblock->num_data_blks) dedup_num_buckets *= 2;
+	dedup_bucket = calloc(dedup_num_buckets, sizeof(uint32_t));
+	dedup_next = calloc(superblock->num_data_blks, sizeof(uint32_t));
+	if(dedup_bucket == NULL || dedup_next == NULL) return -1;
+
+	uint32_t *hashes = dedup_table.entries;
+	for(uint32_t i = superblock->num_data_blks - 1; i > 0; i--)
 	{
-		if(rootdir[i].filename[0] != '\0')
-		{
-			printf("file: %s, size: %i, data_blk: %i\n", 
-			rootdir[i].filename, rootdir[i].size_file_bytes
-			, rootdir[i].index_first_data_blk);
-		}
+		uint32_t hash = hashes[i];
+		if(hash == 0) continue;
+		hashes[i] = 0;
+		if(trusted) 
+			dedup_insert(i, hash);
+		else
+			blk_table_mark(&dedup_table, i);
 	}
 
 	return 0;
 }
 
-//phase 3
+static void dedup_release(void)
+{
+	blk_table_release(&dedup_table);
+	free(dedup_bucket);
+	free(dedup_next);
+	dedup_bucket = NULL;
+	dedup_next = NULL;
+	dedup_num_buckets = 0;
+}
+//---end of dedup helper functions
 
-int fs_open(const char *filename)
+//---start of FAT helper functions
+static int fat_load_blk(size_t fat_blk)
 {
-	//validation
-	if(!fsmounted || filename == NULL || strlen(filename) + 1
-		> FS_FILENAME_LEN || fd_open == FS_OPEN_MAX_COUNT) return -1;
+	//fast path, block already in memory
+	if(__atomic_load_n(&fat_blk_loaded[fat_blk], __ATOMIC_ACQUIRE)) return 0;
 
-	//validate file is already created in root dir
-	bool file_created = false;
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	int ret = 0;
+	pthread_mutex_lock(&fat_lock);
+	//someone else may have loaded it while we waited for the lock
+	if(!fat_blk_loaded[fat_blk])
 	{
-		if(strcmp((char*)rootdir[i].filename, filename) == 0) //equal
-		{
-			file_created = true;
-			break;
-		}
+		if(block_read(1 + fat_blk, fat + fat_blk * BLOCK_SIZE) == -1)
+			ret = -1;
+		else
+			__atomic_store_n(&fat_blk_loaded[fat_blk], 1, __ATOMIC_RELEASE);
 	}
-	if(file_created == false) return -1;
+	pthread_mutex_unlock(&fat_lock);
 
-	//get an empty fd
-	int fd = 0;
-	for(; fd < FS_OPEN_MAX_COUNT; fd++)
-	{
-		//apply same concept for when a entry is empty in root dir
-		if(fdtable[fd].filename[0] == '\0')
-		{
-			strcpy((char*)fdtable[fd].filename, filename);
-			fdtable[fd].offset = 0;
-			fd_open++;
-			break;
-		}
-	}
-	
-	return fd;
+	return ret;
 }
 
-int fs_close(int fd)
+static uint32_t fat_get(uint32_t index)
 {
-	//validation
-	if(!fsmounted || fd < 0 || fd >= FS_OPEN_MAX_COUNT 
-		|| fdtable[fd].filename[0] == '\0') return -1;
+	//an unreadable FAT block ends the chain instead of following garbage
+	if(fat_load_blk(index / FAT_ENTRIES_PER_BLK) == -1) return FAT_EOC;
 
-	//otherwise, safe to close fd and reset it for another file
-	fdtable[fd].filename[0] = '\0';
-	fd_open--;
+	return blk_index_decode(fat, index);
+}
+
+static void fat_set(uint32_t index, uint32_t value)
+{
+	//entries are always read before they are written, so the block is loaded
+	blk_index_encode(fat, index, value);
+	fat_blk_dirty[index / FAT_ENTRIES_PER_BLK] = 1;
+}
+
+static int fat_flush(void)
+{
+	//write back FAT blocks that changed, FAT starts at block index 1 in disk
+	for(size_t i = 0; i < superblock->num_blks_fat; i++)
+	{
+		if(!fat_blk_dirty[i]) continue;
+		if(block_write(1 + i, fat + i * BLOCK_SIZE) == -1) return -1;
+		fat_blk_dirty[i] = 0;
+	}
+
+	//the tables change along with the FAT, they go out together
+	if(blk_table_flush(&refcnt_table) == -1) return -1;
+	if(blk_table_flush(&dedup_table) == -1) return -1;
+
+	//a new table is on disk by now, the superblock can point to it
+	if(!sb_tables_dirty) return 0;
+	if(sb_write() == -1) return -1;
+	sb_tables_dirty = false;
 
 	return 0;
 }
 
-int fs_stat(int fd)
+static void *fat_prefetch(void *arg)
 {
-	//validation
-	if(!fsmounted || fd < 0 || fd >= FS_OPEN_MAX_COUNT 
-		|| fdtable[fd].filename[0] == '\0') return -1;
+	(void)arg;
 
-	//otherwise, return file size
-	uint32_t file_size = -1;
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	//pull in whatever the foreground has not faulted in yet
+	for(size_t i = 0; i < superblock->num_blks_fat && !fat_prefetch_stop; i++)
 	{
-		if(strcmp((char*)rootdir[i].filename, 
-		fdtable[fd].filename) == 0)
-		{
-			file_size = rootdir[i].size_file_bytes;
-		}
+		if(fat_load_blk(i) == -1) break;
 	}
 
-	return file_size;
+	return NULL;
 }
 
-int fs_lseek(int fd, size_t offset)
+static void fat_prefetch_end(void)
 {
-	//validation
-	if(!fsmounted || fd < 0 || fd >= FS_OPEN_MAX_COUNT 
-		|| offset > (size_t)fs_stat(fd)
-		|| fdtable[fd].filename[0] == '\0') return -1;
+	if(!fat_prefetching) return;
+	fat_prefetch_stop = true;
+	pthread_join(fat_prefetcher, NULL);
+	fat_prefetching = false;
+}
 
-	//set new offset
-	fdtable[fd].offset = offset;
+static void fat_release(void)
+{
+	fat_prefetch_end();
 
-	return 0;
+	free(fat);
+	free(fat_blk_loaded);
+	free(fat_blk_dirty);
+	fat = NULL;
+	fat_blk_loaded = NULL;
+	fat_blk_dirty = NULL;
 }
+//---end of FAT helper functions
 
-//phase 4
-
-//---start of helper functions
-uint16_t index_data_blk(uint16_t data_start_index , size_t file_offset)
+//---start of free space helper functions
+static uint32_t rdir_checksum(void)
 {
-	//index of data blk according to offset and the start index
-	//update data_start_index using fat entry pointers
-	//Example: we read 1st block if offset 4095 and 2nd block if offset 4096
-	int num_blk_skip = file_offset / BLOCK_SIZE;
-	while(num_blk_skip > 0 && data_start_index != FAT_EOC)
+	//FNV-1a over the root dir as written; drivers that ignore our extension
+	//still change the root dir whenever they change the FAT, which invalidates
+	//the summary
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < RDIR_SIZE; i++)
 	{
-		data_start_index = fat[data_start_index].value;
-		num_blk_skip--;
+		hash ^= rdir_disk[i];
+		hash *= 16777619u;
 	}
 
-	return data_start_index;
+	return hash;
 }
 
-uint16_t allocate_new_data_blk()
+static void free_counts_rescan(void)
 {
-	//allocate the first avaliable fat entry and data block
-	//note claiming fat entry 0 or data blk 0 is not allowed by disk format
-	for(uint16_t fat_index = 1; fat_index < superblock->num_data_blks
-		; fat_index++)
+	num_free_data_blks = 0;
+	fat_free_hint = superblock->num_data_blks;
+	//can skip first FAT_EOC
+	for(uint32_t i = 1; i < superblock->num_data_blks; i++)	
 	{
-		if(fat[fat_index].value == 0)
+		//free entry in FAT if value is 0
+		if(fat_get(i) == 0)
 		{
-			fat[fat_index].value = FAT_EOC;
-			return fat_index;
+			if(num_free_data_blks == 0) fat_free_hint = i;
+			num_free_data_blks++;
 		}
 	}
 
-	//else failed to allocate a new data blk
-	//note again claiming data blk 0 is illegal by disk format
-	//so this will be our error flag
-	return 0;
+	num_free_rdir_entries = 0;
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		//free entry in root dir if first char of filename is null
+		if(rootdir[i].filename[0] == '\0') num_free_rdir_entries++;
+	}
+
+	free_counts_valid = true;
 }
-//---end of helper functions
 
-int fs_write(int fd, void *buf, size_t count)
+static void discard_flush(void)
 {
-	//validation
-	if (!fsmounted || fd < 0 || fd >= FS_OPEN_MAX_COUNT || 
-		fdtable[fd].filename[0] == '\0' || buf == NULL) return -1;
+	//discard the pending run of freed blks, caller holds alloc_lock and must
+	//call this before the blks can be handed out again
+	//a host that cannot punch holes just keeps the storage
+	if(discard_len == 0) return;
+	block_discard(superblock->data_blk_start_index + discard_start, 
+		discard_len);
+	discard_len = 0;
+}
 
-	if(count == 0) return 0; //user input want to write nothing
+static void release_data_blk(uint32_t fat_index)
+{
+	//give a data blk back to the allocator; blks listed in a map are freed
+	//without their FAT entry ever being read, so its block may not be in
+	//memory yet, an unreadable one leaks the blk for the orphan sweep
+	if(fat_load_blk(fat_index / FAT_ENTRIES_PER_BLK) == -1) return;
+	fat_set(fat_index, 0);
+	dedup_forget(fat_index);
+	if(fat_index < fat_free_hint) fat_free_hint = fat_index;
+	if(free_counts_valid) num_free_data_blks++;
 
-	//prep
-	//find file entry in root dir for changing file size if necessary
-	struct RootDirEntry *rootdirentry = NULL;
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	if(!discard_enabled) return;
+	//chains are mostly laid out in order, grow the run while they are
+	if(discard_len > 0 && discard_start + discard_len == fat_index)
 	{
-		if(strcmp((char*)rootdir[i].filename, 
-		fdtable[fd].filename) == 0)
-		{
-			rootdirentry = &rootdir[i];
-		}
+		discard_len++;
+		return;
 	}
-	size_t offset = fdtable[fd].offset;
+	discard_flush();
+	discard_start = fat_index;
+	discard_len = 1;
+}
 
-	//allocate more blks if necessary
-	if(offset + count > rootdirentry->size_file_bytes)
-	{
-		//empty file gets its own first block
-		if(rootdirentry->index_first_data_blk == FAT_EOC)
-		{
-			uint16_t new_blk_index = allocate_new_data_blk();
-			if(new_blk_index == 0) return 0;	//no space on disk to write
-			rootdirentry->index_first_data_blk = new_blk_index;
-		}
-		uint16_t data_index = rootdirentry->index_first_data_blk;
+static void unref_data_blk(uint32_t fat_index)
+{
+	//drop one owner of a data blk listed in a map, the last one frees it
+	//caller holds alloc_lock
+	uint16_t count = refcnt_get(fat_index);
+	if(count > 0)
+		refcnt_set(fat_index, count - 1);
+	else
+		release_data_blk(fat_index);
+}
 
-		//ceiling function from geeks for geeks
-		int blocks_want = ((count + offset) / BLOCK_SIZE) 
-			+ (((count + offset) % BLOCK_SIZE) != 0);
+static int sb_write(void)
+{
+	//whatever we write is in the extended format
+	superblock->has_ext = true;
+	superblock->ext_version = SB_EXT_VERSION;
+	uint8_t buf[BLOCK_SIZE];
+	sb_encode(superblock, buf);
 
-		//reaching here means atleast 1 blk is allocated to file
-		//so we can move forward one blk
-		blocks_want--;
+	return block_write(0, buf);
+}
 
-		while(blocks_want > 0)
-		{
-			if(fat[data_index].value == FAT_EOC)
-			{
-				uint16_t new_blk_index = allocate_new_data_blk();
-				if(new_blk_index == 0) break; //no more blocks to allocate
-				fat[data_index].value = new_blk_index;
-			}
-			data_index = fat[data_index].value;
-			blocks_want--;
-		}
+static int sb_mark_dirty(void)
+{
+	//the summary on disk goes stale with our first change, say so on disk 
+	//before making the change so a crash leaves an image we rescan
+	if(sb_dirty_on_disk) return 0;
+
+	superblock->ext_clean = 0;
+	if(sb_write() == -1) return -1;
+	sb_dirty_on_disk = true;
+
+	return 0;
+}
+
+static int sb_mark_reclaim_pending(void)
+{
+	//a deleted chain is about to outlive its root dir entry, so a crash 
+	//before it is freed must be followed by an orphan sweep
+	if(sb_dirty_on_disk && sb_reclaim_on_disk) return 0;
+
+	superblock->ext_clean = 0;
+	superblock->ext_reclaim_pending = 1;
+	if(sb_write() == -1) return -1;
+	sb_dirty_on_disk = true;
+	sb_reclaim_on_disk = true;
+
+	return 0;
+}
+
+static int sb_write_clean(void)
+{
+	//every deleted chain is freed by now
+	superblock->ext_reclaim_pending = 0;
+
+	//nothing to record if we never learned the counts; an unchanged image
+	//keeps whatever summary it had
+	if(!free_counts_valid)
+		return sb_reclaim_on_disk ? sb_write() : 0;
+	//a summary that says the same as the clean one on disk is left alone,
+	//so that an unchanged image is not written to
+	uint32_t checksum = rdir_checksum();
+	if(!sb_dirty_on_disk && !sb_reclaim_on_disk && superblock->ext_clean &&
+		superblock->num_free_data_blks == num_free_data_blks &&
+		superblock->num_free_rdir_entries == num_free_rdir_entries &&
+		superblock->first_free_fat_hint == fat_free_hint &&
+		superblock->rdir_checksum == checksum) return 0;
+
+	superblock->ext_clean = 1;
+	superblock->num_free_data_blks = num_free_data_blks;
+	superblock->num_free_rdir_entries = num_free_rdir_entries;
+	superblock->first_free_fat_hint = fat_free_hint;
+	superblock->rdir_checksum = checksum;
+
+	return sb_write();
+}
+//---end of free space helper functions
+
+//---start of reclaim helper functions
+static size_t reclaim_step(size_t max_blks)
+{
+	//free up to max_blks blks of queued chains, caller holds alloc_lock
+	size_t freed = 0;
+	while(freed < max_blks && reclaim_len > 0)
+	{
+		struct ReclaimItem *item = &reclaim_queue[reclaim_len - 1];
+		uint32_t index_cur_data_blk = item->blk;
+		if(item->mapped)
+		{
+			//a map blk goes with every data blk it lists
+			uint8_t entries[BLOCK_SIZE];
+			if(block_read(superblock->data_blk_start_index + 
+				index_cur_data_blk, entries) == 0)
+			{
+				for(size_t i = 0; i < MAP_ENTRIES_PER_BLK; i++)
+				{
+					uint32_t data_blk = blk_index_decode(entries, i);
+					if(data_blk == MAP_HOLE || 
+						data_blk >= superblock->num_data_blks) continue;
+					unref_data_blk(data_blk);
+					freed++;
+				}
+			}
+		}
+		uint32_t index_next_data_blk = fat_get(index_cur_data_blk);
+		release_data_blk(index_cur_data_blk);
+		freed++;
+
+		//a free entry in the middle of a chain means it is damaged, stop there
+		if(index_next_data_blk == FAT_EOC || index_next_data_blk == 0)
+			reclaim_len--;
+		else
+			item->blk = index_next_data_blk;
+	}
+	discard_flush();
+
+	return freed;
+}
+
+static void reclaim_push(uint32_t index_first_data_blk, bool mapped)
+{
+	//queue a deleted file's chain, caller holds alloc_lock
+	if(index_first_data_blk == FAT_EOC) return;	//empty file
+	chain_gen++;
+
+	if(reclaim_len == reclaim_cap)
+	{
+		size_t new_cap = reclaim_cap ? reclaim_cap * 2 : 16;
+		struct ReclaimItem *new_queue = realloc(reclaim_queue, 
+			new_cap * sizeof(struct ReclaimItem));
+		if(new_queue == NULL)
+		{
+			//no room to defer, free it right away instead through a one
+			//item queue
+			struct ReclaimItem item = { index_first_data_blk, mapped };
+			struct ReclaimItem *queue = reclaim_queue;
+			size_t len = reclaim_len;
+			reclaim_queue = &item;
+			reclaim_len = 1;
+			reclaim_step(SIZE_MAX);
+			reclaim_queue = queue;
+			reclaim_len = len;
+			return;
+		}
+		reclaim_queue = new_queue;
+		reclaim_cap = new_cap;
+	}
+	reclaim_queue[reclaim_len].blk = index_first_data_blk;
+	reclaim_queue[reclaim_len].mapped = mapped;
+	reclaim_len++;
+	pthread_cond_signal(&reclaim_cond);
+}
+
+static void *reclaim_worker(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&alloc_lock);
+	while(!reclaim_stop)
+	{
+		if(reclaim_len == 0)
+		{
+			pthread_cond_wait(&reclaim_cond, &alloc_lock);
+			continue;
+		}
+		reclaim_step(RECLAIM_BATCH);
+
+		//let the foreground in between batches
+		pthread_mutex_unlock(&alloc_lock);
+		sched_yield();
+		pthread_mutex_lock(&alloc_lock);
+	}
+	pthread_mutex_unlock(&alloc_lock);
+
+	return NULL;
+}
+
+static void reclaim_release(void)
+{
+	//stop the worker and free what is left, before the FAT is written back
+	if(reclaiming)
+	{
+		pthread_mutex_lock(&alloc_lock);
+		reclaim_stop = true;
+		pthread_cond_signal(&reclaim_cond);
+		pthread_mutex_unlock(&alloc_lock);
+		pthread_join(reclaimer, NULL);
+		reclaiming = false;
+	}
+
+	reclaim_step(SIZE_MAX);
+	free(reclaim_queue);
+	reclaim_queue = NULL;
+	reclaim_len = 0;
+	reclaim_cap = 0;
+}
+
+static void reclaim_mark(const struct RootDirEntry *entry, uint8_t *reachable,
+	uint16_t *owners)
+{
+	//mark every blk an entry reaches, the entries of a directory included
+	if((entry->flags & FILE_PACKED) && 
+		entry->tail_blk < superblock->num_data_blks) 
+		reachable[entry->tail_blk] = 1;
+	uint32_t index_cur_data_blk = entry->index_first_data_blk;
+	//a directory reached already is not walked twice, the tree may loop
+	bool dir = (entry->flags & FILE_DIR) && index_cur_data_blk != 0 &&
+		index_cur_data_blk < superblock->num_data_blks && 
+		!reachable[index_cur_data_blk];
+	//stop at the end of the chain, or if it loops or leaves the disk
+	while(index_cur_data_blk != FAT_EOC && index_cur_data_blk != 0 &&
+		index_cur_data_blk < superblock->num_data_blks &&
+		!reachable[index_cur_data_blk])
+	{
+		reachable[index_cur_data_blk] = 1;
+		//map blks also reach the data blks they list
+		uint8_t entries[BLOCK_SIZE];
+		if((entry->flags & FILE_MAPPED) && block_read(
+			superblock->data_blk_start_index + index_cur_data_blk, 
+			entries) == 0)
+		{
+			for(size_t j = 0; j < MAP_ENTRIES_PER_BLK; j++)
+			{
+				uint32_t data_blk = blk_index_decode(entries, j);
+				if(data_blk == MAP_HOLE || 
+					data_blk >= superblock->num_data_blks) continue;
+				reachable[data_blk] = 1;
+				if(owners != NULL && owners[data_blk] < UINT16_MAX) 
+					owners[data_blk]++;
+			}
+		}
+		index_cur_data_blk = fat_get(index_cur_data_blk);
+	}
+	if(!dir) return;
+
+	//then every entry of every bucket, as found through the header
+	struct DirHeader *header = malloc(sizeof(struct DirHeader));
+	struct DirBucket *bucket = malloc(sizeof(struct DirBucket));
+	uint8_t *buf = malloc(BLOCK_SIZE);
+	size_t num_blks = entry->size_file_bytes / BLOCK_SIZE;
+	bool header_valid = false;
+	size_t lblk = 0;
+	for(index_cur_data_blk = entry->index_first_data_blk;
+		header != NULL && bucket != NULL && buf != NULL &&
+		index_cur_data_blk != FAT_EOC && index_cur_data_blk != 0 &&
+		index_cur_data_blk < superblock->num_data_blks && lblk < num_blks;
+		index_cur_data_blk = fat_get(index_cur_data_blk), lblk++)
+	{
+		//an unreadable header blk leaves the entries to the sweep
+		if(block_read(superblock->data_blk_start_index + 
+			index_cur_data_blk, buf) == -1)
+		{
+			if(!header_valid) break;
+			continue;
+		}
+		if(lblk == 0 || (!header_valid && lblk < dir_header_blks(header) &&
+			lblk < DIR_HEADER_BLKS_MAX))
+		{
+			dir_header_decode(buf, lblk, header);
+			header_valid = lblk + 1 == dir_header_blks(header) && 
+				dir_header_valid(header, num_blks);
+			continue;
+		}
+		if(!header_valid) break;
+		dir_bucket_decode(buf, bucket);
+		for(size_t pos = 0; pos < DIR_BUCKET_ENTRIES; pos++)
+		{
+			if(dir_entry_live(header, lblk, &bucket->entry[pos]))
+				reclaim_mark(&bucket->entry[pos], reachable, owners);
+		}
+	}
+	free(header);
+	free(bucket);
+	free(buf);
+}
+
+static int reclaim_orphans(void)
+{
+	//after a crash with chains still queued, free every allocated blk that
+	//no entry reaches
+	uint8_t *reachable = calloc(superblock->num_data_blks, sizeof(uint8_t));
+	if(reachable == NULL) return -1;
+	//reference counts are rebuilt from the maps that are left
+	uint16_t *owners = NULL;
+	if(refcnt_table.entries != NULL)
+	{
+		owners = calloc(superblock->num_data_blks, sizeof(uint16_t));
+		if(owners == NULL)
+		{
+			free(reachable);
+			return -1;
+		}
+	}
+	for(size_t i = 0; i < refcnt_table.num_blks; i++) 
+		reachable[refcnt_table.blk[i]] = 1;
+	for(size_t i = 0; i < dedup_table.num_blks; i++) 
+		reachable[dedup_table.blk[i]] = 1;
+
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if(rootdir[i].filename[0] != '\0') 
+			reclaim_mark(&rootdir[i], reachable, owners);
+	}
+
+	for(uint32_t i = 1; i < superblock->num_data_blks; i++)
+	{
+		if(!reachable[i] && fat_get(i) != 0) release_data_blk(i);
+		uint16_t count = owners != NULL && owners[i] > 0 ? owners[i] - 1 : 0;
+		if(count != refcnt_get(i)) refcnt_set(i, count);
+	}
+	discard_flush();
+	free(reachable);
+	free(owners);
+
+	return fat_flush();
+}
+//---end of reclaim helper functions
+
+//---start of root dir helper functions
+static int rdir_lookup(const char *filename)
+{
+	//index of the entry named filename, -1 if there is none
+	if(filename[0] == '\0') return -1;
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if(strcmp((char*)rootdir[i].filename, filename) == 0) return i;
+	}
+
+	return -1;
+}
+
+static int rdir_lookup_free(void)
+{
+	//index of the first free entry, -1 if root dir is full
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if(rootdir[i].filename[0] == '\0') return i;
+	}
+
+	return -1;
+}
+
+static uint32_t rdir_entry_tag(const struct RootDirEntry *rootdirentry)
+{
+	//FNV-1a over the entry up to its tag, as the 16 bit format stores it;
+	//drivers that ignore the flags byte reuse entries without clearing it,
+	//but change what the tag covers
+	struct DiskEntry disk_entry;
+	entry_encode16(rootdirentry, &disk_entry);
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < offsetof(struct DiskEntry, flags_tag); i++)
+	{
+		hash ^= ((const uint8_t*)&disk_entry)[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static int rdir_check_flags(void)
+{
+	//drop flags the tag does not vouch for, returns how many were dropped
+	int num_dropped = 0;
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if(rootdir[i].flags == 0) continue;
+		//a packed tail must fit in a data blk
+		size_t tail_len = rootdir[i].size_file_bytes % BLOCK_SIZE;
+		bool tail_bad = (rootdir[i].flags & FILE_PACKED) && (tail_len == 0 ||
+			rootdir[i].tail_blk == 0 || 
+			rootdir[i].tail_blk >= superblock->num_data_blks ||
+			rootdir[i].tail_offset + tail_len > BLOCK_SIZE);
+		if(rootdir[i].filename[0] == '\0' || tail_bad ||
+			rootdir[i].flags_tag != rdir_entry_tag(&rootdir[i]))
+		{
+			rootdir[i].flags = 0;
+			num_dropped++;
+		}
+	}
+
+	return num_dropped;
+}
+
+static void rdir_encode(uint8_t *buf)
+{
+	//root dir as stored, with the tag of every flagged entry up to date
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if(rootdir[i].flags != 0)
+			rootdir[i].flags_tag = rdir_entry_tag(&rootdir[i]);
+	}
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		entry_encode(&rootdir[i], buf + i * sizeof(struct DiskEntry));
+}
+
+static int rdir_write(void)
+{
+	//write back root dir and the loaded entries of other directories that
+	//changed
+	int ret = 0;
+	for(int i = FS_FILE_MAX_COUNT; i < rdir_cap; i++)
+	{
+		if(dir_slot[i - FS_FILE_MAX_COUNT].dir_index != DIR_ROOT &&
+			memcmp(&rootdir[i], &dir_slot[i - FS_FILE_MAX_COUNT].disk,
+			sizeof(struct RootDirEntry)) != 0 && slot_write(i) == -1) ret = -1;
+	}
+
+	//only the root dir blks that changed, if it takes several
+	uint8_t buf[RDIR_SIZE];
+	rdir_encode(buf);
+	uint8_t blk[BLOCK_SIZE];
+	for(size_t i = 0; i < RDIR_BLKS; i++)
+	{
+		size_t start = i * BLOCK_SIZE;
+		size_t len = RDIR_SIZE - start < BLOCK_SIZE ? RDIR_SIZE - start : 
+			BLOCK_SIZE;
+		if(!rdir_disk_stale && memcmp(buf + start, rdir_disk + start, len) == 0)
+			continue;
+		memset(blk, 0, BLOCK_SIZE);
+		memcpy(blk, buf + start, len);
+		if(block_write(superblock->root_dir_blk_index + i, blk) == -1) 
+			return -1;
+		memcpy(rdir_disk + start, buf + start, len);
+	}
+	rdir_disk_stale = false;
+
+	return ret;
+}
+//---end of root dir helper functions
+
+//---start of pack helper functions
+static int pack_load(uint32_t pack_blk)
+{
+	//bring a pack blk into the cache, tails packed together are read once;
+	//caller holds pack_lock
+	if(pack_cache_blk == pack_blk) return 0;
+	pack_cache_blk = 0;
+	if(block_read(superblock->data_blk_start_index + pack_blk, pack_cache)
+		== -1) return -1;
+	pack_cache_blk = pack_blk;
+
+	return 0;
+}
+
+static bool pack_gap(uint32_t pack_blk, size_t len, uint16_t *tail_offset)
+{
+	//first gap of len bytes between the tails in pack_blk, false if there is
+	//none or if nothing is packed there
+	uint32_t start[FS_FILE_MAX_COUNT];
+	uint32_t end[FS_FILE_MAX_COUNT];
+	int num_tails = 0;
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if(!(rootdir[i].flags & FILE_PACKED) || rootdir[i].tail_blk != pack_blk)
+			continue;
+		//insertion sort by offset, there are few tails per blk
+		int j = num_tails++;
+		for(; j > 0 && start[j - 1] > rootdir[i].tail_offset; j--)
+		{
+			start[j] = start[j - 1];
+			end[j] = end[j - 1];
+		}
+		start[j] = rootdir[i].tail_offset;
+		end[j] = rootdir[i].tail_offset + 
+			rootdir[i].size_file_bytes % BLOCK_SIZE;
+	}
+	if(num_tails == 0) return false;
+
+	size_t gap_start = 0;
+	for(int j = 0; j < num_tails; j++)
+	{
+		if(start[j] >= gap_start + len) break;
+		if(end[j] > gap_start) gap_start = end[j];
+	}
+	if(gap_start + len > BLOCK_SIZE) return false;
+	*tail_offset = gap_start;
+
+	return true;
+}
+
+static uint32_t pack_find(size_t len, uint16_t *tail_offset)
+{
+	//pack blk with room for a tail of len bytes, 0 if none; the one in the
+	//cache is tried first so that tails packed in a row end up together;
+	//caller holds pack_lock
+	if(pack_cache_blk != 0 && pack_gap(pack_cache_blk, len, tail_offset))
+		return pack_cache_blk;
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if(!(rootdir[i].flags & FILE_PACKED)) continue;
+		uint32_t pack_blk = rootdir[i].tail_blk;
+		//every pack blk is tried once, at its first tail
+		int j = 0;
+		while(j < i && !((rootdir[j].flags & FILE_PACKED) && 
+			rootdir[j].tail_blk == pack_blk)) j++;
+		if(j == i && pack_blk != pack_cache_blk && 
+			pack_gap(pack_blk, len, tail_offset)) return pack_blk;
+	}
+
+	return 0;
+}
+
+static void pack_blk_put(uint32_t pack_blk)
+{
+	//free a pack blk once no entry packs its tail there anymore; caller holds
+	//alloc_lock and has written back root dir
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if((rootdir[i].flags & FILE_PACKED) && rootdir[i].tail_blk == pack_blk)
+			return;
+	}
+	pthread_mutex_lock(&pack_lock);
+	if(pack_cache_blk == pack_blk) pack_cache_blk = 0;
+	pthread_mutex_unlock(&pack_lock);
+	reclaim_push(pack_blk, false);
+}
+
+static int tail_read(const struct RootDirEntry *rootdirentry, void *buf)
+{
+	//fill a blk sized buf with the packed tail of a file, zeros after it
+	size_t tail_len = rootdirentry->size_file_bytes % BLOCK_SIZE;
+	pthread_mutex_lock(&pack_lock);
+	int ret = pack_load(rootdirentry->tail_blk);
+	if(ret == 0) memcpy(buf, pack_cache + rootdirentry->tail_offset, tail_len);
+	pthread_mutex_unlock(&pack_lock);
+	if(ret == -1) return -1;
+	memset((uint8_t*)buf + tail_len, 0, BLOCK_SIZE - tail_len);
+
+	return 0;
+}
+//---end of pack helper functions
+
+//---start of directory helper functions
+static uint32_t dir_hash(const char *filename)
+{
+	//FNV-1a, the low bits pick the bucket
+	uint32_t hash = 2166136261u;
+	for(; *filename != '\0'; filename++)
+	{
+		hash ^= (uint8_t)*filename;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static size_t dir_header_blks(const struct DirHeader *header)
+{
+	//directories made before headers could span blks say 0
+	return header->num_blks > 0 ? header->num_blks : 1;
+}
+
+static uint8_t dir_depth_max(const struct DirHeader *header)
+{
+	//deepest table that fits in the header blks
+	uint8_t depth = DIR_DEPTH_MAX;
+	while(offsetof(struct DirHeader, bucket) + ((size_t)1 << depth) * 
+		sizeof(uint16_t) > dir_header_blks(header) * BLOCK_SIZE) depth--;
+
+	return depth;
+}
+
+static size_t dir_new_header_blks(void)
+{
+	//blks for the header of a new directory: one, or as many as it takes for
+	//a full table of small buckets to index DIR_ENTRIES_MIN entries
+	uint8_t depth = 0;
+	while(depth < DIR_DEPTH_MAX && 
+		((size_t)1 << depth) * DIR_BUCKET_ENTRIES < DIR_ENTRIES_MIN) depth++;
+	size_t len = offsetof(struct DirHeader, bucket) + 
+		((size_t)1 << depth) * sizeof(uint16_t);
+
+	return (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+static bool dir_header_valid(const struct DirHeader *header, size_t num_blks)
+{
+	//every hash must lead to a bucket inside the directory, past the header
+	size_t header_blks = dir_header_blks(header);
+	if(memcmp(header->signature, DIR_SIGNATURE, sizeof(DIR_SIGNATURE)) != 0 ||
+		header_blks > DIR_HEADER_BLKS_MAX ||
+		header->depth > dir_depth_max(header)) return false;
+	for(size_t i = 0; i < ((size_t)1 << header->depth); i++)
+	{
+		if(header->bucket[i] < header_blks || header->bucket[i] >= num_blks) 
+			return false;
+	}
+
+	return true;
+}
+
+static bool dir_entry_live(const struct DirHeader *header, uint16_t bucket,
+	const struct RootDirEntry *entry)
+{
+	//a split that did not finish leaves copies of entries in the old bucket,
+	//the header sends their names elsewhere
+	if(entry->filename[0] == '\0' || 
+		entry->filename[FS_FILENAME_LEN - 1] != '\0') return false;
+	uint32_t mask = (1u << header->depth) - 1;
+
+	return header->bucket[dir_hash((const char*)entry->filename) & mask] 
+		== bucket;
+}
+
+static uint32_t dir_blk(int dir_index, size_t lblk)
+{
+	//data blk of a logical blk of a directory, 0 if the chain is too short
+	uint32_t data_blk = index_data_blk(rootdir[dir_index].index_first_data_blk,
+		lblk * BLOCK_SIZE);
+	if(data_blk == FAT_EOC || data_blk >= superblock->num_data_blks) return 0;
+
+	return data_blk;
+}
+
+static struct DirHeader *dir_header(int dir_index)
+{
+	//header of a directory, NULL if it is not one or cannot be read; it stays
+	//in the cache until another directory is looked in
+	uint32_t data_blk = rootdir[dir_index].index_first_data_blk;
+	if(!(rootdir[dir_index].flags & FILE_DIR) || data_blk == 0 || 
+		data_blk >= superblock->num_data_blks) return NULL;
+	if(dir_cache_blk == data_blk) return &dir_cache;
+
+	dir_cache_blk = 0;
+	uint8_t buf[BLOCK_SIZE];
+	if(block_read(superblock->data_blk_start_index + data_blk, buf) == -1)
+		return NULL;
+	dir_header_decode(buf, 0, &dir_cache);
+	for(size_t lblk = 1; lblk < dir_header_blks(&dir_cache) &&
+		lblk < DIR_HEADER_BLKS_MAX; lblk++)
+	{
+		uint32_t header_blk = dir_blk(dir_index, lblk);
+		if(header_blk == 0 || block_read(superblock->data_blk_start_index + 
+			header_blk, buf) == -1) return NULL;
+		dir_header_decode(buf, lblk, &dir_cache);
+	}
+	if(!dir_header_valid(&dir_cache, 
+		rootdir[dir_index].size_file_bytes / BLOCK_SIZE)) return NULL;
+	dir_cache_blk = data_blk;
+
+	return &dir_cache;
+}
+
+static int dir_bucket_read(int dir_index, uint16_t bucket, 
+	struct DirBucket *dir_bucket)
+{
+	uint32_t data_blk = dir_blk(dir_index, bucket);
+	uint8_t buf[BLOCK_SIZE];
+	if(data_blk == 0 || block_read(superblock->data_blk_start_index + 
+		data_blk, buf) == -1) return -1;
+	dir_bucket_decode(buf, dir_bucket);
+
+	return 0;
+}
+
+static int dir_bucket_write(int dir_index, uint16_t bucket, 
+	const struct DirBucket *dir_bucket)
+{
+	uint32_t data_blk = dir_blk(dir_index, bucket);
+	if(data_blk == 0) return -1;
+	uint8_t buf[BLOCK_SIZE];
+	dir_bucket_encode(dir_bucket, buf);
+
+	return block_write(superblock->data_blk_start_index + data_blk, buf);
+}
+
+static int dir_find(int dir_index, const char *filename, uint16_t *bucket,
+	uint16_t *pos, struct RootDirEntry *entry)
+{
+	//where filename is in a directory: a header read, if it is not cached,
+	//and a bucket read
+	struct DirHeader *header = dir_header(dir_index);
+	if(header == NULL) return -1;
+	*bucket = header->bucket[dir_hash(filename) & ((1u << header->depth) - 1)];
+	struct DirBucket dir_bucket;
+	if(dir_bucket_read(dir_index, *bucket, &dir_bucket) == -1) return -1;
+
+	for(*pos = 0; *pos < DIR_BUCKET_ENTRIES; (*pos)++)
+	{
+		if(strcmp((char*)dir_bucket.entry[*pos].filename, filename) == 0 &&
+			dir_entry_live(header, *bucket, &dir_bucket.entry[*pos]))
+		{
+			*entry = dir_bucket.entry[*pos];
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static bool dir_empty(int dir_index)
+{
+	//true if no bucket of a directory has a live entry
+	struct DirHeader *header = dir_header(dir_index);
+	if(header == NULL) return false;
+	struct DirBucket dir_bucket;
+	for(size_t lblk = dir_header_blks(header); 
+		lblk < rootdir[dir_index].size_file_bytes / BLOCK_SIZE; lblk++)
+	{
+		if(dir_bucket_read(dir_index, lblk, &dir_bucket) == -1) return false;
+		for(size_t pos = 0; pos < DIR_BUCKET_ENTRIES; pos++)
+		{
+			if(dir_entry_live(header, lblk, &dir_bucket.entry[pos]))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static int slot_find(int dir_index, const char *filename)
+{
+	//entry named filename of a directory if it is loaded already, else -1
+	for(int i = FS_FILE_MAX_COUNT; i < rdir_cap; i++)
+	{
+		if(dir_slot[i - FS_FILE_MAX_COUNT].dir_index == dir_index &&
+			strcmp((char*)rootdir[i].filename, filename) == 0) return i;
+	}
+
+	return -1;
+}
+
+static int slot_alloc(void)
+{
+	//a free slot, the arrays are doubled like the fd table if there is none
+	for(int i = FS_FILE_MAX_COUNT; i < rdir_cap; i++)
+	{
+		if(dir_slot[i - FS_FILE_MAX_COUNT].dir_index == DIR_ROOT) return i;
+	}
+
+	int new_cap = rdir_cap * 2;
+	struct RootDirEntry *new_rootdir = realloc(rootdir, 
+		new_cap * sizeof(struct RootDirEntry));
+	if(new_rootdir == NULL) return -1;
+	rootdir = new_rootdir;
+	uint16_t *new_open_count = realloc(rdir_open_count, 
+		new_cap * sizeof(uint16_t));
+	if(new_open_count == NULL) return -1;
+	rdir_open_count = new_open_count;
+	uint16_t *new_pin_count = realloc(rdir_pin_count, 
+		new_cap * sizeof(uint16_t));
+	if(new_pin_count == NULL) return -1;
+	rdir_pin_count = new_pin_count;
+	struct FileMap **new_map = realloc(rdir_map, 
+		new_cap * sizeof(struct FileMap*));
+	if(new_map == NULL) return -1;
+	rdir_map = new_map;
+	struct DirSlot *new_slot = realloc(dir_slot, 
+		(new_cap - FS_FILE_MAX_COUNT) * sizeof(struct DirSlot));
+	if(new_slot == NULL) return -1;
+	dir_slot = new_slot;
+
+	for(int i = rdir_cap; i < new_cap; i++)
+	{
+		memset(&rootdir[i], 0, sizeof(struct RootDirEntry));
+		rdir_open_count[i] = 0;
+		rdir_pin_count[i] = 0;
+		rdir_map[i] = NULL;
+		dir_slot[i - FS_FILE_MAX_COUNT].dir_index = DIR_ROOT;
+	}
+	int rdir_index = rdir_cap;
+	rdir_cap = new_cap;
+
+	return rdir_index;
+}
+
+static int slot_load(int dir_index, uint16_t bucket, uint16_t pos,
+	const struct RootDirEntry *entry)
+{
+	//load an entry of a directory with a reference taken, the directory
+	//stays loaded for as long as it is
+	int rdir_index = slot_alloc();
+	if(rdir_index == -1) return -1;
+	struct DirSlot *slot = &dir_slot[rdir_index - FS_FILE_MAX_COUNT];
+	slot->dir_index = dir_index;
+	slot->bucket = bucket;
+	slot->pos = pos;
+	slot->refs = 1;
+	slot->disk = *entry;
+	rootdir[rdir_index] = *entry;
+	//flags the tag does not vouch for are dropped, as at mount; tails are
+	//only packed in the root dir
+	if(rootdir[rdir_index].flags != 0 && ((entry->flags & FILE_PACKED) ||
+		entry->flags_tag != rdir_entry_tag(entry))) 
+		rootdir[rdir_index].flags = 0;
+	if(dir_index >= FS_FILE_MAX_COUNT) 
+		dir_slot[dir_index - FS_FILE_MAX_COUNT].refs++;
+
+	return rdir_index;
+}
+
+static int slot_write(int rdir_index)
+{
+	//write a loaded entry back to its place in its directory
+	struct DirSlot *slot = &dir_slot[rdir_index - FS_FILE_MAX_COUNT];
+	if(rootdir[rdir_index].flags != 0)
+		rootdir[rdir_index].flags_tag = rdir_entry_tag(&rootdir[rdir_index]);
+	struct DirBucket dir_bucket;
+	if(dir_bucket_read(slot->dir_index, slot->bucket, &dir_bucket) == -1)
+		return -1;
+	dir_bucket.entry[slot->pos] = rootdir[rdir_index];
+	if(dir_bucket_write(slot->dir_index, slot->bucket, &dir_bucket) == -1)
+		return -1;
+	slot->disk = rootdir[rdir_index];
+
+	return 0;
+}
+
+static void entry_put(int rdir_index)
+{
+	//drop a reference taken by a lookup; root dir entries are always there,
+	//a slot goes once the last one is dropped, then maybe its directory's
+	while(rdir_index >= FS_FILE_MAX_COUNT)
+	{
+		struct DirSlot *slot = &dir_slot[rdir_index - FS_FILE_MAX_COUNT];
+		if(--slot->refs > 0) return;
+		//not fatal, every change was written back already unless it failed
+		if(memcmp(&rootdir[rdir_index], &slot->disk, 
+			sizeof(struct RootDirEntry)) != 0) slot_write(rdir_index);
+		int dir_index = slot->dir_index;
+		slot->dir_index = DIR_ROOT;
+		memset(&rootdir[rdir_index], 0, sizeof(struct RootDirEntry));
+		rdir_index = dir_index;
+	}
+}
+
+static int dir_split(int dir_index, uint16_t bucket, 
+	struct DirBucket *old_bucket)
+{
+	//make room in a full bucket: the hashes of it with the next bit set go
+	//to a new bucket at the end of the directory, the table is doubled first
+	//if it has no bit left to tell them apart
+	struct DirHeader *old_header = dir_header(dir_index);
+	if(old_header == NULL) return -1;
+	struct DirHeader header = *old_header;
+	uint8_t depth = old_bucket->depth < header.depth ? old_bucket->depth :
+		header.depth;
+	if(depth == header.depth)
+	{
+		if(header.depth == dir_depth_max(&header)) return -1;
+		memcpy(&header.bucket[1 << header.depth], &header.bucket[0], 
+			((size_t)1 << header.depth) * sizeof(uint16_t));
+		header.depth++;
+	}
+	uint16_t new_bucket = rootdir[dir_index].size_file_bytes / BLOCK_SIZE;
+	for(size_t i = 0; i < ((size_t)1 << header.depth); i++)
+	{
+		if(header.bucket[i] == bucket && ((i >> depth) & 1))
+			header.bucket[i] = new_bucket;
+	}
+
+	//entries keep their position, the ones a split left behind are dropped
+	struct DirBucket dir_bucket;
+	memset(&dir_bucket, 0, sizeof(struct DirBucket));
+	dir_bucket.depth = old_bucket->depth = depth + 1;
+	for(size_t pos = 0; pos < DIR_BUCKET_ENTRIES; pos++)
+	{
+		struct RootDirEntry *entry = &old_bucket->entry[pos];
+		if(!dir_entry_live(old_header, bucket, entry))
+		{
+			memset(entry, 0, sizeof(struct RootDirEntry));
+		}
+		else if((dir_hash((char*)entry->filename) >> depth) & 1)
+		{
+			dir_bucket.entry[pos] = *entry;
+			memset(entry, 0, sizeof(struct RootDirEntry));
+		}
+	}
+
+	//a blk left linked past the end by a split that did not finish is reused
+	uint32_t last_blk = dir_blk(dir_index, new_bucket - 1);
+	if(last_blk == 0) return -1;
+	uint32_t new_blk = fat_get(last_blk);
+	if(new_blk == FAT_EOC || new_blk == 0 || 
+		new_blk >= superblock->num_data_blks) 
+		new_blk = allocate_new_data_blk(last_blk);
+	if(new_blk == 0) return -1;
+
+	//the new bucket and the chain reaching it are on disk before the size
+	//that covers them, which is before the header pointing there; the old
+	//bucket goes last, its moved entries are not live from then on anyway
+	uint8_t buf[BLOCK_SIZE];
+	dir_bucket_encode(&dir_bucket, buf);
+	if(block_write(superblock->data_blk_start_index + new_blk, buf) == -1)
+		return -1;
+	pthread_mutex_lock(&alloc_lock);
+	int ret = fat_flush();
+	pthread_mutex_unlock(&alloc_lock);
+	if(ret == -1) return -1;
+	rootdir[dir_index].size_file_bytes += BLOCK_SIZE;
+	if(rdir_write() == -1) return -1;
+	//header blks that changed go from last to first, so that the depth in
+	//blk 0 only grows once the table entries it brings in are on disk
+	uint8_t old_buf[BLOCK_SIZE];
+	for(size_t lblk = dir_header_blks(&header); lblk-- > 0;)
+	{
+		dir_header_encode(old_header, lblk, old_buf);
+		dir_header_encode(&header, lblk, buf);
+		if(memcmp(old_buf, buf, BLOCK_SIZE) == 0) continue;
+		uint32_t header_blk = dir_blk(dir_index, lblk);
+		if(header_blk == 0 || block_write(superblock->data_blk_start_index + 
+			header_blk, buf) == -1) return -1;
+	}
+	*old_header = header;
+	if(dir_bucket_write(dir_index, bucket, old_bucket) == -1) return -1;
+
+	//loaded entries that moved follow
+	for(int i = FS_FILE_MAX_COUNT; i < rdir_cap; i++)
+	{
+		struct DirSlot *slot = &dir_slot[i - FS_FILE_MAX_COUNT];
+		if(slot->dir_index == dir_index && slot->bucket == bucket &&
+			dir_bucket.entry[slot->pos].filename[0] != '\0') 
+			slot->bucket = new_bucket;
+	}
+
+	return 0;
+}
+
+static int dir_insert(int dir_index, const struct RootDirEntry *entry,
+	uint16_t *bucket, uint16_t *pos)
+{
+	//write a new entry to the bucket its name hashes to, splitting the bucket
+	//as long as it is full
+	for(;;)
+	{
+		struct DirHeader *header = dir_header(dir_index);
+		if(header == NULL) return -1;
+		*bucket = header->bucket[dir_hash((char*)entry->filename) & 
+			((1u << header->depth) - 1)];
+		struct DirBucket dir_bucket;
+		if(dir_bucket_read(dir_index, *bucket, &dir_bucket) == -1) return -1;
+
+		for(*pos = 0; *pos < DIR_BUCKET_ENTRIES; (*pos)++)
+		{
+			if(dir_entry_live(header, *bucket, &dir_bucket.entry[*pos])) 
+				continue;
+			dir_bucket.entry[*pos] = *entry;
+			return dir_bucket_write(dir_index, *bucket, &dir_bucket);
+		}
+
+		if(dir_split(dir_index, *bucket, &dir_bucket) == -1) return -1;
+	}
+}
+
+static int dir_init(uint32_t *first_blk, size_t *num_blks)
+{
+	//header and bucket of a new directory, every hash goes to the bucket
+	size_t header_blks = dir_new_header_blks();
+	uint32_t blks[DIR_HEADER_BLKS_MAX + 1];
+	if(allocate_data_blks(blks, header_blks + 1) == -1) return -1;
+
+	struct DirHeader header;
+	memset(&header, 0, sizeof(struct DirHeader));
+	memcpy(header.signature, DIR_SIGNATURE, sizeof(DIR_SIGNATURE));
+	header.num_blks = header_blks;
+	header.bucket[0] = header_blks;
+	uint8_t buf[BLOCK_SIZE];
+	memset(buf, 0, BLOCK_SIZE);	//an empty bucket in either format
+
+	pthread_mutex_lock(&alloc_lock);
+	for(size_t i = 0; i < header_blks; i++) fat_set(blks[i], blks[i + 1]);
+	pthread_mutex_unlock(&alloc_lock);
+	int ret = block_write(superblock->data_blk_start_index + 
+		blks[header_blks], buf);
+	for(size_t i = 0; ret == 0 && i < header_blks; i++)
+	{
+		dir_header_encode(&header, i, buf);
+		ret = block_write(superblock->data_blk_start_index + blks[i], buf);
+	}
+	pthread_mutex_lock(&alloc_lock);
+	if(ret == 0) ret = fat_flush();
+	if(ret == -1) reclaim_push(blks[0], false);
+	pthread_mutex_unlock(&alloc_lock);
+	*first_blk = blks[0];
+	*num_blks = header_blks + 1;
+
+	return ret;
+}
+
+static bool path_parent(const char *path, int *dir_index, char *filename)
+{
+	//directory the last component of path is in, loaded with a reference
+	//taken; the component goes to filename. False if a directory on the way
+	//is missing or if a component is empty or too long
+	int cur_dir_index = DIR_ROOT;
+	if(path[0] == '/') path++;
+	for(;;)
+	{
+		size_t len = strcspn(path, "/");
+		if(len == 0 || len + 1 > FS_FILENAME_LEN) break;
+		memcpy(filename, path, len);
+		filename[len] = '\0';
+		if(path[len] == '\0')
+		{
+			*dir_index = cur_dir_index;
+			return true;
+		}
+
+		//the entry of the next directory holds a reference on this one
+		int next_dir_index = entry_get(cur_dir_index, filename);
+		entry_put(cur_dir_index);
+		cur_dir_index = next_dir_index;
+		if(cur_dir_index == -1) return false;
+		if(!(rootdir[cur_dir_index].flags & FILE_DIR)) break;
+		path += len + 1;
+	}
+	entry_put(cur_dir_index);
+
+	return false;
+}
+
+static int entry_get(int dir_index, const char *filename)
+{
+	//entry named filename in a directory, loaded with a reference taken;
+	//-1 if there is none
+	if(dir_index == DIR_ROOT) return rdir_lookup(filename);
+	int rdir_index = slot_find(dir_index, filename);
+	if(rdir_index != -1)
+	{
+		dir_slot[rdir_index - FS_FILE_MAX_COUNT].refs++;
+		return rdir_index;
+	}
+
+	uint16_t bucket, pos;
+	struct RootDirEntry entry;
+	if(dir_find(dir_index, filename, &bucket, &pos, &entry) == -1) return -1;
+
+	return slot_load(dir_index, bucket, pos, &entry);
+}
+
+static int path_lookup(const char *path)
+{
+	//entry a path names, loaded with a reference taken; -1 if there is none
+	char filename[FS_FILENAME_LEN];
+	int dir_index;
+	if(path == NULL || !path_parent(path, &dir_index, filename)) return -1;
+	int rdir_index = entry_get(dir_index, filename);
+	entry_put(dir_index);
+
+	return rdir_index;
+}
+
+static int entry_add(int dir_index, const struct RootDirEntry *entry)
+{
+	//new entry in a directory, written back and loaded with a reference
+	//taken; -1 if the directory is full
+	struct RootDirEntry new_entry = *entry;
+	if(new_entry.flags != 0) new_entry.flags_tag = rdir_entry_tag(&new_entry);
+	if(dir_index == DIR_ROOT)
+	{
+		int rdir_index = rdir_lookup_free();
+		if(rdir_index == -1 || sb_mark_dirty() == -1) return -1;
+		rootdir[rdir_index] = new_entry;
+		if(free_counts_valid) num_free_rdir_entries--;
+		return rdir_write() == -1 ? -1 : rdir_index;
+	}
+
+	uint16_t bucket, pos;
+	if(dir_insert(dir_index, &new_entry, &bucket, &pos) == -1) return -1;
+
+	return slot_load(dir_index, bucket, pos, &new_entry);
+}
+
+static void entry_remove(int rdir_index)
+{
+	//clear an entry, the caller writes it back
+	rootdir[rdir_index].filename[0] = '\0';
+	rootdir[rdir_index].index_first_data_blk = '\0';
+	rootdir[rdir_index].flags = 0;
+	if(rdir_index < FS_FILE_MAX_COUNT && free_counts_valid) 
+		num_free_rdir_entries++;
+}
+
+static void ls_print(const struct RootDirEntry *entry)
+{
+	//the first data blk as the format stores it
+	uint32_t data_blk = entry->index_first_data_blk;
+	if(!fat32 && data_blk == FAT_EOC) data_blk = FAT_EOC16;
+	printf("%s: %s, size: %i, data_blk: %u\n", 
+		(entry->flags & FILE_DIR) ? "dir" : "file", entry->filename, 
+		entry->size_file_bytes, data_blk);
+}
+//---end of directory helper functions
+
+//phase 1
+
+static int blk_table_load(struct BlkTable *table, uint32_t first_blk)
+{
+	//read a table the superblock points to, if there is one
+	uint32_t index_cur_data_blk = first_blk;
+	if(index_cur_data_blk == 0) return 0;
+
+	table->num_blks = blk_table_blks_needed(table);
+	table->entries = malloc(table->num_blks * BLOCK_SIZE);
+	table->blk = malloc(table->num_blks * sizeof(uint32_t));
+	table->blk_dirty = calloc(table->num_blks, sizeof(uint8_t));
+	if(table->entries == NULL || table->blk == NULL || table->blk_dirty == NULL)
+		return -1;
+	for(size_t i = 0; i < table->num_blks; i++)
+	{
+		//the chain must be exactly as long as the table
+		if(index_cur_data_blk == FAT_EOC || index_cur_data_blk == 0 ||
+			index_cur_data_blk >= superblock->num_data_blks) return -1;
+		if(block_read(superblock->data_blk_start_index + index_cur_data_blk,
+			(uint8_t*)table->entries + i * BLOCK_SIZE) == -1) return -1;
+		table->blk[i] = index_cur_data_blk;
+		index_cur_data_blk = fat_get(index_cur_data_blk);
+	}
+
+	return index_cur_data_blk == FAT_EOC ? 0 : -1;
+}
+
+static int fs_mount_fail(void)
+{
+	blk_table_release(&refcnt_table);
+	dedup_release();
+	fat_release();
+	free(superblock);
+	free(rootdir);
+	free(rdir_open_count);
+	free(rdir_pin_count);
+	free(rdir_map);
+	superblock = NULL;
+	rootdir = NULL;
+	rdir_open_count = NULL;
+	rdir_pin_count = NULL;
+	rdir_map = NULL;
+	block_disk_close();
+
+	return -1;
+}
+
+int fs_mount(const char *diskname)
+{
+	return fs_mount_ext(diskname, NULL);
+}
+
+int fs_mount_ext(const char *diskname, const struct fs_mount_opts *opts)
+{
+	if(diskname == NULL || fsmounted) return -1;
+
+	int flags = opts ? opts->flags : 0;
+	int open_max = opts && opts->open_max > 0 ? opts->open_max : 
+		FS_OPEN_MAX_COUNT;
+	//prefetching only makes sense on top of a lazy mount
+	if(flags & FS_MOUNT_PREFETCH) flags |= FS_MOUNT_LAZY;
+	//a read-only mount has no use for what only helps writes
+	readonly = (flags & FS_MOUNT_RDONLY) != 0;
+	if(readonly) flags &= ~(FS_MOUNT_RECLAIM | FS_MOUNT_DISCARD | 
+		FS_MOUNT_DEDUP | FS_MOUNT_PACK);
+
+	if((readonly ? block_disk_open_readonly(diskname) : 
+		block_disk_open(diskname)) == -1) return -1;
+
+	//map or mount superblock, its signature tells the format; it fits in
+	//the smallest blk and says how large the others are
+	uint8_t buf[BLOCK_SIZE_MIN];
+	superblock = malloc(sizeof(struct Superblock));
+	if(superblock == NULL || block_read(0, buf) == -1) 
+		return fs_mount_fail();
+
+	//validate disk 
+	//validate superblock
+	if(sb_decode(buf, superblock) == -1) return fs_mount_fail(); //signature
+	if(block_disk_set_size(superblock->block_size) == -1)
+		return fs_mount_fail();	//block size
+	//a grow cut short is rolled back or finished before anything is read
+	if(superblock->ext_version >= 5 && superblock->grow_state != 0 &&
+		grow_recover() == -1) return fs_mount_fail();
+	if(1 + (size_t)superblock->num_blks_fat + RDIR_BLKS + 
+		superblock->num_data_blks
+		!= superblock->num_blks_vd) return fs_mount_fail();	//block amount
+	if(superblock->num_blks_vd != (size_t)block_disk_count())
+		return fs_mount_fail(); //block amount
+
+	//validate FAT using ceiling function
+	//https://www.geeksforgeeks.org/find-ceil-ab-without-using-ceil-function/
+	//check if num_blks_fat = ceil((num_data_blks*entry size)/BLOCK_SIZE)
+	size_t fat_bytes = (size_t)superblock->num_data_blks * blk_index_size;
+	if(superblock->num_blks_fat != (fat_bytes / BLOCK_SIZE) + 
+		((fat_bytes % BLOCK_SIZE) != 0)) return fs_mount_fail();
+	//an index must never read as the end of chain
+	if(superblock->num_data_blks >= (fat32 ? FAT_EOC : FAT_EOC16))
+		return fs_mount_fail();
+
+	//validate disk order
+	if(1 + superblock->num_blks_fat != superblock->root_dir_blk_index)
+		return fs_mount_fail();	//root index
+	if(superblock->root_dir_blk_index + RDIR_BLKS != 
+		superblock->data_blk_start_index) 
+		return fs_mount_fail(); //first data index
+
+	//map or mount FAT; 4096 bytes * num FAT blocks
+	//a different procedure because fat is not one block like the others
+	fat = malloc((size_t)BLOCK_SIZE * superblock->num_blks_fat); 
+	fat_blk_loaded = calloc(superblock->num_blks_fat, sizeof(uint8_t));
+	fat_blk_dirty = calloc(superblock->num_blks_fat, sizeof(uint8_t));
+	fat_prefetch_stop = false;
+	//copy block by block, or only the first one for a lazy mount
+	size_t fat_blks_now = (flags & FS_MOUNT_LAZY) ? 1 : superblock->num_blks_fat;
+	for(size_t i = 0; i < fat_blks_now; i++)
+	{
+		if(fat_load_blk(i) == -1) return fs_mount_fail();
+	}
+
+	//validate Fat array
+	if(fat_get(0) != FAT_EOC) return fs_mount_fail();
+
+	//map or mount root dir, with room for entries of other directories to
+	//be loaded past it later
+	rdir_cap = FS_FILE_MAX_COUNT;
+	rootdir = malloc(rdir_cap * sizeof(struct RootDirEntry));
+	rdir_open_count = calloc(rdir_cap, sizeof(uint16_t));
+	rdir_pin_count = calloc(rdir_cap, sizeof(uint16_t));
+	rdir_map = calloc(rdir_cap, sizeof(struct FileMap*));
+	dir_slot = NULL;
+	dir_cache_blk = 0;
+	if(rootdir == NULL || rdir_open_count == NULL || rdir_pin_count == NULL ||
+		rdir_map == NULL) return fs_mount_fail();
+	uint8_t blk[BLOCK_SIZE];
+	for(size_t i = 0; i < RDIR_BLKS; i++)
+	{
+		size_t start = i * BLOCK_SIZE;
+		if(block_read(superblock->root_dir_blk_index + i, blk) == -1)
+			return fs_mount_fail();
+		memcpy(rdir_disk + start, blk, RDIR_SIZE - start < BLOCK_SIZE ? 
+			RDIR_SIZE - start : BLOCK_SIZE);
+	}
+	rdir_disk_stale = false;
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		entry_decode(rdir_disk + i * sizeof(struct DiskEntry), &rootdir[i]);
+
+	//trust the free space summary only if the last unmount was clean
+	free_counts_valid = false;
+	sb_dirty_on_disk = true;	//no clean summary to protect
+	sb_reclaim_on_disk = false;
+	sb_tables_dirty = false;
+	fat_free_hint = 1;
+	bool has_ext = superblock->has_ext;
+	if(has_ext && superblock->ext_clean &&
+		superblock->rdir_checksum == rdir_checksum())
+	{
+		num_free_data_blks = superblock->num_free_data_blks;
+		num_free_rdir_entries = superblock->num_free_rdir_entries;
+		fat_free_hint = superblock->first_free_fat_hint;
+		if(fat_free_hint == 0 || fat_free_hint > superblock->num_data_blks)
+			fat_free_hint = 1;
+		free_counts_valid = true;
+		sb_dirty_on_disk = false;
+	}
+
+	//a mapped file deleted or overwritten by a driver that does not know the
+	//layout leaves the data blks its map listed allocated, sweep them up
+	bool foreign_unmapped = has_ext && rdir_check_flags() > 0;
+
+	//shared blks must not be freed while another file still lists them
+	if(blk_table_load(&refcnt_table, superblock->ext_version >= 3 ? 
+		superblock->refcnt_first_blk : 0) == -1) return fs_mount_fail();
+	//hashes are only good for the content they were computed against, which
+	//nobody but us changed if the summary can be trusted
+	if(blk_table_load(&dedup_table, superblock->ext_version >= 4 ? 
+		superblock->dedup_first_blk : 0) == -1) return fs_mount_fail();
+	bool dedup_trusted = free_counts_valid && !foreign_unmapped &&
+		!superblock->ext_reclaim_pending;
+
+	discard_enabled = (flags & FS_MOUNT_DISCARD) != 0;
+	discard_len = 0;
+	pack_enabled = (flags & FS_MOUNT_PACK) != 0;
+	pack_cache_blk = 0;
+
+	//we went down with deleted chains not yet freed, find them again; a
+	//read-only mount allocates nothing, they may as well stay
+	reclaim_len = 0;
+	reclaim_stop = false;
+	if(!readonly && has_ext && 
+		(superblock->ext_reclaim_pending || foreign_unmapped))
+	{
+		sb_reclaim_on_disk = true;
+		if(reclaim_orphans() == -1) return fs_mount_fail();
+		free_counts_rescan();
+	}
+
+	//the first dedup mount starts hashing blks, which are shared through the
+	//reference counts; both tables are there before the first write
+	dedup_enabled = (flags & FS_MOUNT_DEDUP) != 0;
+	dedup_hits = 0;
+	if(dedup_enabled && (dedup_table.entries == NULL || 
+		refcnt_table.entries == NULL))
+	{
+		if(sb_mark_reclaim_pending() == -1) return fs_mount_fail();
+		if(refcnt_table.entries == NULL && refcnt_create() == -1)
+			return fs_mount_fail();
+		if(dedup_table.entries == NULL)
+		{
+			if(blk_table_create(&dedup_table) == -1) return fs_mount_fail();
+			superblock->dedup_first_blk = dedup_table.blk[0];
+		}
+	}
+	if(!readonly && dedup_table.entries != NULL && 
+		dedup_index_build(dedup_trusted) == -1) return fs_mount_fail();
+
+	if(flags & FS_MOUNT_RECLAIM)
+	{
+		//not fatal, the allocator and fs_umount free chains without it
+		reclaiming = pthread_create(&reclaimer, NULL, reclaim_worker, 
+			NULL) == 0;
+	}
+
+	//not fatal, fs_map_blocks gives blk runs without pointers if the image
+	//cannot be mapped
+	if(flags & FS_MOUNT_MMAP) block_disk_map();
+
+	if(flags & FS_MOUNT_PREFETCH)
+	{
+		//not fatal, blocks are still faulted in on demand without the thread
+		fat_prefetching = pthread_create(&fat_prefetcher, NULL, 
+			fat_prefetch, NULL) == 0;
+	}
+
+	//reset fd table, slots are allocated as files get opened
+	fdtable = NULL;
+	fdtable_size = 0;
+	fd_free_head = -1;
+	fd_open_max = open_max;
+	sparse_enabled = (flags & FS_MOUNT_SPARSE) != 0;
+
+	fsmounted = true;
+
+	return 0;
+}
+
+int fs_umount(void)
+{
+	//error check
+	if(!fsmounted || fd_open > 0) return -1;
+
+	//save disk and close, a read-only mount changed nothing to save
+	if(!readonly)
+	{
+		//free whatever deleted chains are still queued
+		reclaim_release();
+
+		//write back the FAT blocks we modified
+		if(fat_flush() == -1) return -1;
+
+		//write back root dir
+		if(rdir_write() == -1) return -1;
+
+		//metadata is on disk, now the summary can be marked clean
+		if(sb_write_clean() == -1) return -1;
+	}
+
+	//stop prefetching before the disk goes away
+	fat_release();
+	blk_table_release(&refcnt_table);
+	dedup_release();
+
+	if(block_disk_close() == -1) return -1;
+
+	free(superblock);
+	free(rootdir);
+	free(rdir_open_count);
+	free(rdir_pin_count);
+	free(rdir_map);
+	free(dir_slot);
+	free(fdtable);
+	fdtable = NULL;
+
+	fsmounted = false;
+
+	return 0;
+}
+
+static bool format_files_fit(const struct fs_format_opts *opts, 
+	size_t blk_size, size_t data_blk_count)
+{
+	//files to preallocate go in the root dir under distinct names, and all
+	//their blks fit in the image next to data blk 0
+	if(opts == NULL || opts->num_files == 0) return true;
+	if(opts->files == NULL || opts->num_files > FS_FILE_MAX_COUNT) return false;
+
+	size_t num_blks = 1;
+	for(size_t i = 0; i < opts->num_files; i++)
+	{
+		const struct fs_format_file *file = &opts->files[i];
+		if(!filename_valid(file->filename) || 
+			strchr(file->filename, '/') != NULL || 
+			file->size > FILE_SIZE_MAX) return false;
+		for(size_t j = 0; j < i; j++)
+		{
+			if(strcmp(opts->files[j].filename, file->filename) == 0) 
+				return false;
+		}
+		num_blks += (file->size + blk_size - 1) / blk_size;
+	}
+
+	return num_blks <= data_blk_count;
+}
+
+int fs_format(const char *diskname, size_t data_blk_count, 
+	const struct fs_format_opts *opts)
+{
+	//the disk is ours while mounted
+	if(diskname == NULL || fsmounted || data_blk_count < 1) return -1;
+
+	//the base format as long as it can hold the image, it only has blks of
+	//the default size
+	int flags = opts ? opts->flags : 0;
+	size_t blk_size = opts && opts->block_size ? opts->block_size : 
+		BLOCK_SIZE_DEFAULT;
+	fat32 = (flags & FS_FORMAT_FAT32) || data_blk_count > FAT16_DATA_BLKS_MAX
+		|| blk_size != BLOCK_SIZE_DEFAULT;
+	blk_index_size = fat32 ? sizeof(uint32_t) : sizeof(uint16_t);
+	size_t fat_bytes = data_blk_count * blk_index_size;
+	size_t num_blks_fat = (fat_bytes / blk_size) + 
+		((fat_bytes % blk_size) != 0);
+	size_t num_blks_rdir = (RDIR_SIZE + blk_size - 1) / blk_size;
+	//block counts are returned as int by the disk
+	if(data_blk_count > (INT_MAX - 1 - num_blks_fat - num_blks_rdir)) 
+		return -1;
+	if(!format_files_fit(opts, blk_size, data_blk_count)) return -1;
+
+	struct Superblock sb;
+	memset(&sb, 0, sizeof(struct Superblock));
+	sb.num_blks_vd = 1 + num_blks_fat + num_blks_rdir + data_blk_count;
+	sb.root_dir_blk_index = 1 + num_blks_fat;
+	sb.data_blk_start_index = sb.root_dir_blk_index + num_blks_rdir;
+	sb.num_data_blks = data_blk_count;
+	sb.num_blks_fat = num_blks_fat;
+	sb.block_size = blk_size;
+
+	//the image starts out as a hole, only blks that are not all zeros are
+	//written: the superblock and the first FAT blk, with data blk 0 taken
+	if(block_disk_create(diskname, sb.num_blks_vd, blk_size) == -1) return -1;
+	uint8_t buf[BLOCK_SIZE];
+	sb_encode(&sb, buf);
+	int ret = block_write(0, buf);
+	memset(buf, 0, BLOCK_SIZE);
+	blk_index_encode(buf, 0, FAT_EOC);
+
+	//preallocated files take consecutive runs of data blks from blk 1 on, so
+	//the FAT is filled in order one blk at a time; their data blks are left
+	//as holes
+	size_t num_files = opts ? opts->num_files : 0;
+	uint8_t rdir[RDIR_SIZE];
+	memset(rdir, 0, RDIR_SIZE);
+	uint32_t index = 1;
+	size_t fat_blk = 0;
+	for(size_t i = 0; i < num_files && ret == 0; i++)
+	{
+		const struct fs_format_file *file = &opts->files[i];
+		size_t num_blks = (file->size + blk_size - 1) / blk_size;
+		struct RootDirEntry entry;
+		memset(&entry, 0, sizeof(struct RootDirEntry));
+		strcpy((char*)entry.filename, file->filename);
+		entry.size_file_bytes = file->size;
+		entry.index_first_data_blk = num_blks ? index : FAT_EOC;
+		entry_encode(&entry, rdir + i * sizeof(struct DiskEntry));
+
+		for(size_t j = 0; j < num_blks && ret == 0; j++, index++)
+		{
+			if(index / FAT_ENTRIES_PER_BLK != fat_blk)
+			{
+				ret = block_write(1 + fat_blk, buf);
+				memset(buf, 0, BLOCK_SIZE);
+				fat_blk = index / FAT_ENTRIES_PER_BLK;
+			}
+			blk_index_encode(buf, index % FAT_ENTRIES_PER_BLK, 
+				j + 1 < num_blks ? index + 1 : FAT_EOC);
+		}
+	}
+	if(ret == 0) ret = block_write(1 + fat_blk, buf);
+
+	//the root dir is all zeros unless files were preallocated
+	for(size_t i = 0; i < num_blks_rdir && num_files > 0 && ret == 0; i++)
+	{
+		size_t start = i * BLOCK_SIZE;
+		size_t len = RDIR_SIZE - start < BLOCK_SIZE ? RDIR_SIZE - start : 
+			BLOCK_SIZE;
+		memset(buf, 0, BLOCK_SIZE);
+		memcpy(buf, rdir + start, len);
+		ret = block_write(sb.root_dir_blk_index + i, buf);
+	}
+	if(block_disk_close() == -1) ret = -1;
+
+	return ret;
+}
+
+//---start of grow helper functions
+static uint32_t grow_remap(const struct GrowMove *move, uint32_t data_blk)
+{
+	//new index of a data blk; holes, chain ends and free entries stay as they
+	//are, and so do indices past the old end, which nothing valid holds
+	if(data_blk == 0 || data_blk == FAT_EOC || 
+		data_blk >= move->num_data_blks) return data_blk;
+
+	return data_blk <= move->shift ? move->moved[data_blk] : 
+		data_blk - move->shift;
+}
+
+static size_t grow_blk(const struct GrowMove *move, uint32_t data_blk)
+{
+	//where a data blk is on disk once grown, moved ones are copied there first
+	return move->data_start + grow_remap(move, data_blk);
+}
+
+static size_t grow_jnl_blks(size_t jnl_len)
+{
+	//journaled blks and the index that says where they go
+	return jnl_len + (jnl_len + FAT_ENTRIES_PER_BLK - 1) / FAT_ENTRIES_PER_BLK;
+}
+
+static int grow_jnl_write(struct GrowMove *move, size_t blk, const void *buf)
+{
+	//a blk of the new layout that takes the place of one of the old layout
+	//goes past the end of the grown image first, the image gets longer as
+	//the journal does
+	if(move->jnl_len == move->jnl_cap)
+	{
+		size_t cap = move->jnl_cap > 0 ? move->jnl_cap * 2 : 64;
+		uint32_t *jnl_dst = realloc(move->jnl_dst, cap * sizeof(uint32_t));
+		if(jnl_dst == NULL) return -1;
+		move->jnl_dst = jnl_dst;
+		if(block_disk_grow(move->jnl_blk + grow_jnl_blks(cap)) == -1) 
+			return -1;
+		move->jnl_cap = cap;
+	}
+	if(block_write(move->jnl_blk + move->jnl_len, buf) == -1) return -1;
+	move->jnl_dst[move->jnl_len++] = blk;
+
+	return 0;
+}
+
+static int grow_replay(uint32_t jnl_blk, uint32_t jnl_len)
+{
+	//copy every journaled blk to its place in order, which ends with the
+	//superblock; a crash on the way replays them all again at mount
+	size_t per_blk = FAT_ENTRIES_PER_BLK;
+	if(jnl_len == 0 || 
+		jnl_blk + grow_jnl_blks(jnl_len) > (size_t)block_disk_count()) 
+		return -1;
+
+	uint8_t *buf = malloc(BLOCK_SIZE);
+	int ret = buf != NULL ? 0 : -1;
+	for(size_t i = 0; ret == 0 && i < jnl_len; i++)
+	{
+		if(i % per_blk == 0) 
+			ret = block_read(jnl_blk + jnl_len + i / per_blk, buf);
+		uint32_t blk = ret == 0 ? blk_index_decode(buf, i % per_blk) : 0;
+		if(ret == 0 && blk >= jnl_blk) ret = -1;
+		if(ret == 0) ret = block_copy(blk, jnl_blk + i, 1);
+	}
+	free(buf);
+
+	return ret;
+}
+
+static int grow_trim(void)
+{
+	//a grow rolled back or replayed leaves blks past the end of the image
+	//the superblock describes, drop them along with the record
+	if((size_t)block_disk_count() > superblock->num_blks_vd && 
+		block_disk_shrink(superblock->num_blks_vd) == -1) return -1;
+	superblock->grow_state = 0;
+	superblock->grow_num_data_blks = 0;
+	superblock->grow_jnl_blk = 0;
+	superblock->grow_jnl_len = 0;
+
+	return sb_write();
+}
+
+static int grow_recover(void)
+{
+	//a grow cut short before its journal was complete left the old layout
+	//as it was; one cut short after is replayed
+	if(readonly) return -1;
+	if(superblock->grow_state == GROW_COMMITTED)
+	{
+		//the journal starts where the grown image ends
+		size_t fat_bytes = (size_t)superblock->grow_num_data_blks * 
+			blk_index_size;
+		size_t num_blks_fat = (fat_bytes / BLOCK_SIZE) + 
+			((fat_bytes % BLOCK_SIZE) != 0);
+		if(superblock->grow_jnl_blk != 1 + num_blks_fat + RDIR_BLKS + 
+			superblock->grow_num_data_blks) return -1;
+		uint8_t buf[BLOCK_SIZE];
+		if(grow_replay(superblock->grow_jnl_blk, 
+			superblock->grow_jnl_len) == -1) return -1;
+		if(block_read(0, buf) == -1 || sb_decode(buf, superblock) == -1 ||
+			superblock->block_size != BLOCK_SIZE || 
+			superblock->grow_state != GROW_REPLAYED) return -1;
+	}
+
+	return grow_trim();
+}
+
+static int grow_move_blks(struct GrowMove *move)
+{
+	//the data blks the FAT and root dir grow over get indices past the old 
+	//last one, in order, and are copied there in runs; nothing else is 
+	//written past the old end, so the copies are done before anything
+	//overwrites the originals
+	uint32_t last = move->shift < move->num_data_blks ? move->shift : 
+		move->num_data_blks - 1;
+	uint32_t next = move->num_data_blks > move->shift ? 
+		move->num_data_blks - move->shift : 1;
+	for(uint32_t i = 1; i <= last; i++)
+	{
+		if(fat_get(i) != 0) move->moved[i] = next++;
+	}
+
+	uint32_t old_start = move->data_start - move->shift;
+	for(uint32_t i = 1; i <= last; )
+	{
+		uint32_t run = 0;
+		while(i + run <= last && move->moved[i + run] != 0) run++;
+		if(run > 0 && block_copy(move->data_start + move->moved[i], 
+			old_start + i, run) == -1) return -1;
+		i += run > 0 ? run : 1;
+	}
+
+	return 0;
+}
+
+static int grow_remap_entry(struct GrowMove *move, struct RootDirEntry *entry,
+	uint8_t flags)
+{
+	//renumber the blks an entry reaches and journal the map and directory
+	//blks that list some; the chain is followed in the FAT as it was, with
+	//the flags the entry's directory trusts
+	uint8_t *buf = malloc(BLOCK_SIZE);
+	struct DirHeader *header = malloc(sizeof(struct DirHeader));
+	struct DirBucket *bucket = malloc(sizeof(struct DirBucket));
+	int ret = buf != NULL && header != NULL && bucket != NULL ? 0 : -1;
+	bool header_valid = false;
+	size_t num_blks = entry->size_file_bytes / BLOCK_SIZE;
+	uint32_t index_cur_data_blk = entry->index_first_data_blk;
+	//stop at the end of the chain, or if it loops or leaves the disk
+	for(size_t lblk = 0; ret == 0 && index_cur_data_blk != FAT_EOC && 
+		index_cur_data_blk != 0 && index_cur_data_blk < move->num_data_blks &&
+		!move->done[index_cur_data_blk]; lblk++)
+	{
+		move->done[index_cur_data_blk] = 1;
+		size_t blk = grow_blk(move, index_cur_data_blk);
+		if(flags & FILE_MAPPED)
+		{
+			ret = block_read(blk, buf);
+			for(size_t i = 0; ret == 0 && i < MAP_ENTRIES_PER_BLK; i++)
+			{
+				blk_index_encode(buf, i, 
+					grow_remap(move, blk_index_decode(buf, i)));
+			}
+			if(ret == 0) ret = grow_jnl_write(move, blk, buf);
+		}
+		else if((flags & FILE_DIR) && (lblk == 0 || (!header_valid && 
+			lblk < dir_header_blks(header) && lblk < DIR_HEADER_BLKS_MAX)))
+		{
+			ret = block_read(blk, buf);
+			if(ret == 0) dir_header_decode(buf, lblk, header);
+			header_valid = ret == 0 && lblk + 1 == dir_header_blks(header) &&
+				dir_header_valid(header, num_blks);
+		}
+		else if((flags & FILE_DIR) && header_valid && lblk < num_blks)
+		{
+			ret = block_read(blk, buf);
+			if(ret == 0) dir_bucket_decode(buf, bucket);
+			for(size_t pos = 0; ret == 0 && pos < DIR_BUCKET_ENTRIES; pos++)
+			{
+				struct RootDirEntry *child = &bucket->entry[pos];
+				if(!dir_entry_live(header, lblk, child)) continue;
+				//as slot_load would load it
+				uint8_t child_flags = child->flags;
+				if(child_flags != 0 && ((child_flags & FILE_PACKED) ||
+					child->flags_tag != rdir_entry_tag(child))) child_flags = 0;
+				ret = grow_remap_entry(move, child, child_flags);
+			}
+			if(ret == 0) dir_bucket_encode(bucket, buf);
+			if(ret == 0) ret = grow_jnl_write(move, blk, buf);
+		}
+		index_cur_data_blk = fat_get(index_cur_data_blk);
+	}
+	free(buf);
+	free(header);
+	free(bucket);
+
+	//a tag keeps vouching for the flags it vouched for
+	entry->index_first_data_blk = grow_remap(move, entry->index_first_data_blk);
+	if(flags & FILE_PACKED) entry->tail_blk = grow_remap(move, entry->tail_blk);
+	if(flags != 0) entry->flags_tag = rdir_entry_tag(entry);
+
+	return ret;
+}
+
+static void grow_fat(const struct GrowMove *move, uint8_t *new_fat)
+{
+	//every FAT entry moves along with its data blk, and so does its value
+	blk_index_encode(new_fat, 0, FAT_EOC);
+	for(uint32_t i = 1; i < move->num_data_blks; i++)
+	{
+		uint32_t value = fat_get(i);
+		if(value != 0) 
+		{
+			blk_index_encode(new_fat, grow_remap(move, i), 
+				grow_remap(move, value));
+		}
+	}
+}
+
+static int grow_relocate(struct GrowMove *move, size_t num_blks_fat)
+{
+	//make room for the FAT to grow by shift blks: the data blks it grows over
+	//move past the end, and every index of a data blk goes down by shift;
+	//the FAT and root dir that go with it are only built in memory
+	move->fat = calloc(num_blks_fat, BLOCK_SIZE);
+	move->fat_loaded = malloc(num_blks_fat * sizeof(uint8_t));
+	move->fat_dirty = malloc(num_blks_fat * sizeof(uint8_t));
+	move->rootdir = malloc(FS_FILE_MAX_COUNT * sizeof(struct RootDirEntry));
+	move->moved = calloc(move->shift + 1, sizeof(uint32_t));
+	move->done = calloc(move->num_data_blks, sizeof(uint8_t));
+	int ret = move->fat != NULL && move->fat_loaded != NULL && 
+		move->fat_dirty != NULL && move->rootdir != NULL &&
+		move->moved != NULL && move->done != NULL ? 0 : -1;
+	if(ret == 0)
+	{
+		memcpy(move->rootdir, rootdir, 
+			FS_FILE_MAX_COUNT * sizeof(struct RootDirEntry));
+		ret = grow_move_blks(move);
+	}
+	for(int i = 0; ret == 0 && i < FS_FILE_MAX_COUNT; i++)
+	{
+		if(move->rootdir[i].filename[0] != '\0') 
+		{
+			ret = grow_remap_entry(move, &move->rootdir[i], 
+				move->rootdir[i].flags);
+		}
+	}
+	if(ret == 0) grow_fat(move, move->fat);
+
+	return ret;
+}
+
+static void grow_install(struct GrowMove *move, size_t num_blks_fat)
+{
+	//the FAT and root dir built for the new layout take over, they reach
+	//the disk through the journal
+	free(fat);
+	free(fat_blk_loaded);
+	free(fat_blk_dirty);
+	fat = move->fat;
+	fat_blk_loaded = move->fat_loaded;
+	fat_blk_dirty = move->fat_dirty;
+	move->fat = NULL;
+	move->fat_loaded = NULL;
+	move->fat_dirty = NULL;
+	memset(fat_blk_loaded, 1, num_blks_fat);
+	memset(fat_blk_dirty, 1, num_blks_fat);
+	memcpy(rootdir, move->rootdir, 
+		FS_FILE_MAX_COUNT * sizeof(struct RootDirEntry));
+}
+
+static void grow_move_free(struct GrowMove *move)
+{
+	free(move->moved);
+	free(move->done);
+	free(move->fat);
+	free(move->fat_loaded);
+	free(move->fat_dirty);
+	free(move->rootdir);
+	free(move->jnl_dst);
+}
+
+static int grow_table(const struct GrowMove *move, struct BlkTable *table)
+{
+	//entries follow their data blk, and the chain gets the blks the new data
+	//blks need at its end; the superblock has the new data blk count already
+	if(table->entries == NULL) return 0;
+
+	size_t num_blks = blk_table_blks_needed(table);
+	uint8_t *entries = calloc(num_blks, BLOCK_SIZE);
+	uint32_t *blk = malloc(num_blks * sizeof(uint32_t));
+	uint8_t *blk_dirty = malloc(num_blks * sizeof(uint8_t));
+	if(entries == NULL || blk == NULL || blk_dirty == NULL || 
+		allocate_data_blks(blk + table->num_blks, 
+		num_blks - table->num_blks) == -1)
+	{
+		free(entries);
+		free(blk);
+		free(blk_dirty);
+		return -1;
+	}
+
+	for(uint32_t i = 1; i < move->num_data_blks; i++)
+	{
+		uint32_t data_blk = grow_remap(move, i);
+		if(data_blk == 0) continue;	//not in use, and gone
+		memcpy(entries + data_blk * table->entry_size, 
+			(uint8_t*)table->entries + i * table->entry_size, 
+			table->entry_size);
+	}
+	for(size_t i = 0; i < table->num_blks; i++) 
+		blk[i] = grow_remap(move, table->blk[i]);
+	pthread_mutex_lock(&alloc_lock);
+	for(size_t i = table->num_blks; i < num_blks; i++) 
+		fat_set(blk[i - 1], blk[i]);
+	pthread_mutex_unlock(&alloc_lock);
+	memset(blk_dirty, 1, num_blks);
+
+	blk_table_release(table);
+	table->entries = entries;
+	table->blk = blk;
+	table->blk_dirty = blk_dirty;
+	table->num_blks = num_blks;
+
+	return 0;
+}
+
+static int grow_jnl_table(struct GrowMove *move, struct BlkTable *table)
+{
+	for(size_t i = 0; table->entries != NULL && i < table->num_blks; i++)
+	{
+		if(!table->blk_dirty[i]) continue;
+		if(grow_jnl_write(move, superblock->data_blk_start_index + 
+			table->blk[i], (uint8_t*)table->entries + i * BLOCK_SIZE) == -1)
+			return -1;
+		table->blk_dirty[i] = 0;
+	}
+
+	return 0;
+}
+
+static int grow_commit(struct GrowMove *move, struct Superblock *old_sb)
+{
+	//journal the metadata of the new layout, the superblock last, and the
+	//index after it; once the old superblock points to the journal, the grow
+	//is as good as done
+	uint8_t *buf = malloc(BLOCK_SIZE);
+	int ret = buf != NULL ? 0 : -1;
+	for(size_t i = 0; ret == 0 && i < superblock->num_blks_fat; i++)
+	{
+		if(!fat_blk_dirty[i]) continue;
+		ret = grow_jnl_write(move, 1 + i, fat + i * BLOCK_SIZE);
+		fat_blk_dirty[i] = 0;
+	}
+	if(ret == 0) ret = grow_jnl_table(move, &refcnt_table);
+	if(ret == 0) ret = grow_jnl_table(move, &dedup_table);
+	if(ret == 0 && move->shift > 0)
+	{
+		uint8_t rdir[RDIR_SIZE];
+		rdir_encode(rdir);
+		for(size_t i = 0; ret == 0 && i < RDIR_BLKS; i++)
+		{
+			size_t start = i * BLOCK_SIZE;
+			size_t len = RDIR_SIZE - start < BLOCK_SIZE ? RDIR_SIZE - start :
+				BLOCK_SIZE;
+			memset(buf, 0, BLOCK_SIZE);
+			memcpy(buf, rdir + start, len);
+			ret = grow_jnl_write(move, superblock->root_dir_blk_index + i, 
+				buf);
+		}
+		memcpy(rdir_disk, rdir, RDIR_SIZE);
+		rdir_disk_stale = false;
+	}
+	if(ret == 0)
+	{
+		superblock->grow_state = GROW_REPLAYED;
+		sb_encode(superblock, buf);
+		ret = grow_jnl_write(move, 0, buf);
+	}
+
+	size_t per_blk = FAT_ENTRIES_PER_BLK;
+	for(size_t i = 0; ret == 0 && i < move->jnl_len; i += per_blk)
+	{
+		memset(buf, 0, BLOCK_SIZE);
+		for(size_t j = i; j < move->jnl_len && j < i + per_blk; j++)
+			blk_index_encode(buf, j - i, move->jnl_dst[j]);
+		ret = block_write(move->jnl_blk + move->jnl_len + i / per_blk, buf);
+	}
+
+	if(ret == 0)
+	{
+		old_sb->grow_state = GROW_COMMITTED;
+		old_sb->grow_jnl_blk = move->jnl_blk;
+		old_sb->grow_jnl_len = move->jnl_len;
+		sb_encode(old_sb, buf);
+		ret = block_write(0, buf);
+	}
+	free(buf);
+
+	if(ret == 0) ret = grow_replay(move->jnl_blk, move->jnl_len);
+	if(ret == 0) ret = grow_trim();
+
+	return ret;
+}
+
+static int grow_abandon(void)
+{
+	//the image has the old layout, or a complete journal, which the next
+	//mount rolls back or replays; what is in memory is neither, so it goes
+	//without being written
+	reclaim_release();
+	fs_mount_fail();
+	free(dir_slot);
+	free(fdtable);
+	fdtable = NULL;
+	fsmounted = false;
+
+	return -1;
+}
+//---end of grow helper functions
+
+int fs_grow(size_t data_blk_count)
+{
+	//entries loaded past the root dir hold blk indices we may change
+	if(!fsmounted || readonly || fd_open > 0 || 
+		data_blk_count < superblock->num_data_blks) return -1;
+	for(int i = FS_FILE_MAX_COUNT; i < rdir_cap; i++)
+	{
+		if(dir_slot[i - FS_FILE_MAX_COUNT].dir_index != DIR_ROOT) return -1;
+	}
+	if(data_blk_count == superblock->num_data_blks) return 0;
+
+	//the FAT takes as many blks as the new count needs, within the limits
+	//of the format
+	size_t fat_bytes = data_blk_count * blk_index_size;
+	size_t num_blks_fat = (fat_bytes / BLOCK_SIZE) + 
+		((fat_bytes % BLOCK_SIZE) != 0);
+	if((!fat32 && data_blk_count > FAT16_DATA_BLKS_MAX) ||
+		data_blk_count > (INT_MAX - 1 - num_blks_fat - RDIR_BLKS)) return -1;
+
+	//settle first: deleted chains freed, the whole FAT in memory, the free
+	//counts known and the root dir on disk
+	pthread_mutex_lock(&alloc_lock);
+	reclaim_step(SIZE_MAX);
+	pthread_mutex_unlock(&alloc_lock);
+	fat_prefetch_end();
+	for(size_t i = 0; i < superblock->num_blks_fat; i++)
+	{
+		if(fat_load_blk(i) == -1) return -1;
+	}
+	pthread_mutex_lock(&alloc_lock);
+	if(!free_counts_valid) free_counts_rescan();
+	pthread_mutex_unlock(&alloc_lock);
+	if(rdir_write() == -1 || sb_mark_dirty() == -1) return -1;
+
+	//only data blks the FAT grows over move, the others keep their place on
+	//disk under a new index if it grows at all
+	size_t num_blks_vd = 1 + num_blks_fat + RDIR_BLKS + data_blk_count;
+	struct GrowMove move = { 
+		.shift = num_blks_fat - superblock->num_blks_fat,
+		.data_start = superblock->data_blk_start_index + num_blks_fat - 
+			superblock->num_blks_fat,
+		.num_data_blks = superblock->num_data_blks,
+		.jnl_blk = num_blks_vd,
+	};
+
+	//the old layout stays as it is until the journal of what the new one
+	//puts in its place is complete, anything else is written past its end
+	superblock->grow_state = GROW_STARTED;
+	superblock->grow_num_data_blks = data_blk_count;
+	int ret = sb_write();
+	struct Superblock old_sb = *superblock;
+	if(ret == 0) ret = block_disk_grow(num_blks_vd);
+	if(ret == 0 && move.shift > 0) ret = grow_relocate(&move, num_blks_fat);
+	if(ret == -1)
+	{
+		grow_move_free(&move);
+		grow_trim();
+		return -1;
+	}
+
+	//no blk changed hands, the new ones are all free
+	if(move.shift > 0) grow_install(&move, num_blks_fat);
+	superblock->num_blks_vd = num_blks_vd;
+	superblock->num_blks_fat = num_blks_fat;
+	superblock->root_dir_blk_index = 1 + num_blks_fat;
+	superblock->data_blk_start_index = move.data_start;
+	superblock->num_data_blks = data_blk_count;
+	num_free_data_blks += data_blk_count - move.num_data_blks;
+	if(move.shift > 0) fat_free_hint = 1;
+	pack_cache_blk = 0;
+	dir_cache_blk = 0;
+
+	//the tables get longer, and the superblock points to where they start now
+	ret = grow_table(&move, &refcnt_table);
+	if(ret == 0) ret = grow_table(&move, &dedup_table);
+	if(ret == 0 && refcnt_table.entries != NULL)
+		superblock->refcnt_first_blk = refcnt_table.blk[0];
+	if(ret == 0 && dedup_table.entries != NULL)
+		superblock->dedup_first_blk = dedup_table.blk[0];
+	if(ret == 0) ret = grow_commit(&move, &old_sb);
+	grow_move_free(&move);
+	if(ret == -1) return grow_abandon();
+
+	if(dedup_table.entries != NULL)
+	{
+		free(dedup_bucket);
+		free(dedup_next);
+		ret = dedup_index_build(true);
+	}
+
+	pthread_mutex_lock(&alloc_lock);
+	if(ret == 0) ret = fat_flush();
+	pthread_mutex_unlock(&alloc_lock);
+	if(ret == 0) ret = rdir_write();
+
+	return ret;
+}
+
+int fs_info(void)
+{
+	if(!fsmounted) return -1;
+
+	printf("FS Info:\n");
+	printf("total_blk_count=%i\n", superblock->num_blks_vd);
+	printf("fat_blk_count=%i\n", superblock->num_blks_fat);
+	printf("rdir_blk=%i\n", superblock->root_dir_blk_index);
+	printf("data_blk=%i\n", superblock->data_blk_start_index);
+	printf("data_blk_count=%i\n", superblock->num_data_blks);
+
+	//deleted files count as free space, finish freeing them first
+	//only scan after a dirty shutdown, a clean image carries the counts
+	pthread_mutex_lock(&alloc_lock);
+	reclaim_step(SIZE_MAX);
+	if(!free_counts_valid) free_counts_rescan();
+	int num_fat_free_entries = num_free_data_blks;
+	pthread_mutex_unlock(&alloc_lock);
+
+	printf("fat_free_ratio=%d/%d\n", num_fat_free_entries, 
+	superblock->num_data_blks);
+	printf("rdir_free_ratio=%d/%d\n", num_free_rdir_entries,
+		FS_FILE_MAX_COUNT);
+	if(BLOCK_SIZE != BLOCK_SIZE_DEFAULT) printf("blk_size=%zu\n", BLOCK_SIZE);
+	
+	return 0;
+}
+
+int fs_dedup_info(void)
+{
+	if(!fsmounted) return -1;
+
+	//blks of deleted files are not in use, free them before counting
+	pthread_mutex_lock(&alloc_lock);
+	reclaim_step(SIZE_MAX);
+	if(!free_counts_valid) free_counts_rescan();
+	//data blk 0 is never in use
+	int num_used_blks = superblock->num_data_blks - 1 - num_free_data_blks;
+	int num_shared_blks = 0;
+	int num_blk_refs = num_used_blks;
+	for(uint32_t i = 1; i < superblock->num_data_blks; i++)
+	{
+		if(refcnt_get(i) == 0) continue;
+		num_shared_blks++;
+		num_blk_refs += refcnt_get(i);
+	}
+	size_t num_hits = dedup_hits;
+	pthread_mutex_unlock(&alloc_lock);
+
+	printf("Dedup Info:\n");
+	printf("used_blk_count=%d\n", num_used_blks);
+	printf("shared_blk_count=%d\n", num_shared_blks);
+	printf("dedup_ratio=%d/%d\n", num_blk_refs, num_used_blks);
+	printf("dedup_write_saved=%zu\n", num_hits);
+
+	return 0;
+}
+
+//phase 2
+
+int fs_create(const char *filename)
+{
+	if(!fsmounted || readonly || filename == NULL) return -1;
+
+	char name[FS_FILENAME_LEN];
+	int dir_index;
+	if(!path_parent(filename, &dir_index, name)) return -1;
+
+	//filename must not exist already, a full directory fails in entry_add
+	int rdir_index = entry_get(dir_index, name);
+	int ret = -1;
+	if(rdir_index == -1)
+	{
+		struct RootDirEntry entry;
+		memset(&entry, 0, sizeof(struct RootDirEntry));
+		strcpy((char*)entry.filename, name);
+		entry.index_first_data_blk = FAT_EOC;
+		rdir_index = entry_add(dir_index, &entry);
+		ret = rdir_index == -1 ? -1 : 0;
+	}
+	entry_put(rdir_index);
+	entry_put(dir_index);
+	
+	return ret;
+}
+
+int fs_delete(const char *filename)
+{
+	if(!fsmounted || readonly || filename == NULL) return -1;
+
+	//find file in its directory
+	int i = path_lookup(filename);
+	//file not found
+	if(i == -1) return -1;
+
+	//check if the file is currently open, directories go with fs_rmdir
+	if(rdir_open_count[i] > 0 || (rootdir[i].flags & FILE_DIR) ||
+		sb_mark_reclaim_pending() == -1)
+	{
+		entry_put(i);
+		return -1;
+	}
+
+	//otherwise, clean file's contents in its directory and FAT
+	uint32_t index_first_data_blk = rootdir[i].index_first_data_blk;
+	bool mapped = rootdir[i].flags & FILE_MAPPED;
+	bool packed = rootdir[i].flags & FILE_PACKED;
+	uint32_t tail_blk = rootdir[i].tail_blk;
+
+	//clean file's contents in its directory and write it back
+	entry_remove(i);
+	int ret = rdir_write();
+	entry_put(i);
+	if(ret == -1) return -1;
+
+	//the chain is freed later by the reclaim worker or the allocator, so 
+	//deleting takes the same time whatever the size of the file
+	pthread_mutex_lock(&alloc_lock);
+	reclaim_push(index_first_data_blk, mapped);
+	if(packed) pack_blk_put(tail_blk);
+	pthread_mutex_unlock(&alloc_lock);
+
+	return 0;
+}
+
+int fs_mkdir(const char *dirname)
+{
+	if(!fsmounted || readonly || dirname == NULL) return -1;
+
+	char name[FS_FILENAME_LEN];
+	int dir_index;
+	if(!path_parent(dirname, &dir_index, name)) return -1;
+
+	//blks of a directory that never got its entry go to the orphan sweep
+	int rdir_index = entry_get(dir_index, name);
+	uint32_t first_blk;
+	size_t num_blks;
+	int ret = -1;
+	if(rdir_index == -1 && sb_mark_reclaim_pending() == 0 && 
+		dir_init(&first_blk, &num_blks) == 0)
+	{
+		struct RootDirEntry entry;
+		memset(&entry, 0, sizeof(struct RootDirEntry));
+		strcpy((char*)entry.filename, name);
+		entry.size_file_bytes = num_blks * BLOCK_SIZE;
+		entry.index_first_data_blk = first_blk;
+		entry.flags = FILE_DIR;
+		rdir_index = entry_add(dir_index, &entry);
+		ret = rdir_index == -1 ? -1 : 0;
+		if(ret == -1)
+		{
+			pthread_mutex_lock(&alloc_lock);
+			reclaim_push(first_blk, false);
+			pthread_mutex_unlock(&alloc_lock);
+		}
+	}
+	entry_put(rdir_index);
+	entry_put(dir_index);
+
+	return ret;
+}
+
+int fs_rmdir(const char *dirname)
+{
+	if(!fsmounted || readonly || dirname == NULL) return -1;
+
+	int rdir_index = path_lookup(dirname);
+	if(rdir_index == -1) return -1;
+	if(!(rootdir[rdir_index].flags & FILE_DIR) || !dir_empty(rdir_index) ||
+		sb_mark_reclaim_pending() == -1)
+	{
+		entry_put(rdir_index);
+		return -1;
+	}
+
+	//same as fs_delete, the header is not cached past here
+	uint32_t index_first_data_blk = rootdir[rdir_index].index_first_data_blk;
+	if(dir_cache_blk == index_first_data_blk) dir_cache_blk = 0;
+	entry_remove(rdir_index);
+	int ret = rdir_write();
+	entry_put(rdir_index);
+	if(ret == -1) return -1;
+
+	pthread_mutex_lock(&alloc_lock);
+	reclaim_push(index_first_data_blk, false);
+	pthread_mutex_unlock(&alloc_lock);
+
+	return 0;
+}
+
+int fs_ls(void)
+{
+	if(!fsmounted) return -1;
+
+	printf("FS Ls:\n");
+
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if(rootdir[i].filename[0] != '\0') ls_print(&rootdir[i]);
+	}
+
+	return 0;
+}
+
+int fs_lsdir(const char *dirname)
+{
+	if(!fsmounted || dirname == NULL) return -1;
+	if(strcmp(dirname, "") == 0 || strcmp(dirname, "/") == 0) return fs_ls();
+
+	int dir_index = path_lookup(dirname);
+	if(dir_index == -1) return -1;
+	struct DirHeader *header = dir_header(dir_index);
+	if(header == NULL)
+	{
+		entry_put(dir_index);
+		return -1;
+	}
+
+	printf("FS Ls:\n");
+
+	//bucket by bucket, loaded entries as they are in memory
+	struct DirHeader dir_header_copy = *header;
+	struct DirBucket dir_bucket;
+	for(size_t lblk = dir_header_blks(&dir_header_copy); 
+		lblk < rootdir[dir_index].size_file_bytes / BLOCK_SIZE; lblk++)
+	{
+		if(dir_bucket_read(dir_index, lblk, &dir_bucket) == -1) continue;
+		for(size_t pos = 0; pos < DIR_BUCKET_ENTRIES; pos++)
+		{
+			if(!dir_entry_live(&dir_header_copy, lblk, &dir_bucket.entry[pos]))
+				continue;
+			const struct RootDirEntry *entry = &dir_bucket.entry[pos];
+			for(int i = FS_FILE_MAX_COUNT; i < rdir_cap; i++)
+			{
+				struct DirSlot *slot = &dir_slot[i - FS_FILE_MAX_COUNT];
+				if(slot->dir_index == dir_index && slot->bucket == lblk &&
+					slot->pos == pos) entry = &rootdir[i];
+			}
+			ls_print(entry);
+		}
+	}
+	entry_put(dir_index);
+
+	return 0;
+}
+
+//---start of batch helper functions
+#define NAME_INDEX_SLOTS (FS_FILE_MAX_COUNT * 2)
+#define NAME_INDEX_EMPTY -1
+#define NAME_INDEX_DELETED -2
+
+struct NameIndex	//open addressing hash of root dir names, built per batch
+{
+	int16_t slot[NAME_INDEX_SLOTS];	//root dir index or NAME_INDEX_*
+};
+
+static size_t name_hash(const char *filename)
+{
+	//FNV-1a
+	uint32_t hash = 2166136261u;
+	for(; *filename != '\0'; filename++)
+	{
+		hash ^= (uint8_t)*filename;
+		hash *= 16777619u;
+	}
+
+	return hash % NAME_INDEX_SLOTS;
+}
+
+static int name_index_find(const struct NameIndex *index, const char *filename)
+{
+	//slot holding filename, -1 if it is not there
+	size_t i = name_hash(filename);
+	for(int probes = 0; probes < NAME_INDEX_SLOTS; probes++)
+	{
+		int16_t entry = index->slot[i];
+		if(entry == NAME_INDEX_EMPTY) break;
+		if(entry >= 0 && strcmp((char*)rootdir[entry].filename, filename) == 0)
+			return i;
+		i = (i + 1) % NAME_INDEX_SLOTS;
+	}
+
+	return -1;
+}
+
+static void name_index_insert(struct NameIndex *index, int rdir_index)
+{
+	//there are twice as many slots as root dir entries, a free one exists
+	size_t i = name_hash((char*)rootdir[rdir_index].filename);
+	while(index->slot[i] >= 0) i = (i + 1) % NAME_INDEX_SLOTS;
+	index->slot[i] = rdir_index;
+}
+
+static void name_index_build(struct NameIndex *index)
+{
+	//the single pass over the root dir a batch needs
+	for(int i = 0; i < NAME_INDEX_SLOTS; i++) index->slot[i] = NAME_INDEX_EMPTY;
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if(rootdir[i].filename[0] != '\0') name_index_insert(index, i);
+	}
+}
+
+static bool filename_valid(const char *filename)
+{
+	return filename != NULL && filename[0] != '\0' && 
+		strlen(filename) + 1 <= FS_FILENAME_LEN;
+}
+
+static const char *root_name(const char *path)
+{
+	//name of an entry of the root dir a path names, NULL if the path goes
+	//through other directories; those are left to the single file calls
+	if(path != NULL && path[0] == '/') path++;
+	if(path != NULL && strchr(path, '/') != NULL) return NULL;
+
+	return path;
+}
+//---end of batch helper functions
+
+int fs_create_batch(const char **filenames, size_t count, int *status)
+{
+	if(!fsmounted || readonly || filenames == NULL || status == NULL) return -1;
+
+	struct NameIndex index;
+	name_index_build(&index);
+
+	//root dir entries the batch fills, and the status of each, emptied again
+	//if the root dir cannot be written back
+	int added[FS_FILE_MAX_COUNT];
+	size_t added_at[FS_FILE_MAX_COUNT];
+	int num_created = 0, num_added = 0;
+	int free_index = 0;	//entries below this one are known to be taken
+	size_t i = 0;
+	for(; i < count; i++)
+	{
+		const char *filename = root_name(filenames[i]);
+		if(filename == NULL)
+		{
+			status[i] = fs_create(filenames[i]);
+			if(status[i] == 0) num_created++;
+			continue;
+		}
+
+		status[i] = -1;
+		//invalid or already existing name
+		if(!filename_valid(filename) || 
+			name_index_find(&index, filename) != -1) continue;
+
+		while(free_index < FS_FILE_MAX_COUNT && 
+			rootdir[free_index].filename[0] != '\0') free_index++;
+		//root directory already has 128 files
+		if(free_index == FS_FILE_MAX_COUNT) continue;
+
+		if(sb_mark_dirty() == -1) break;
+		strcpy((char*)rootdir[free_index].filename, filename);
+		rootdir[free_index].size_file_bytes = 0;
+		rootdir[free_index].index_first_data_blk = FAT_EOC;
+		rootdir[free_index].flags = 0;
+		if(free_counts_valid) num_free_rdir_entries--;
+		name_index_insert(&index, free_index);
+		added[num_added] = free_index;
+		added_at[num_added++] = i;
+
+		status[i] = 0;
+		num_created++;
+	}
+	//the disk could not be marked, the rest of the batch is not created
+	for(; i < count; i++) status[i] = -1;
+
+	//one root dir write for the whole batch
+	if(num_added > 0 && rdir_write() == -1)
+	{
+		for(int j = 0; j < num_added; j++)
+		{
+			entry_remove(added[j]);
+			status[added_at[j]] = -1;
+		}
+		num_created -= num_added;
+	}
+
+	return num_created;
+}
+
+int fs_delete_batch(const char **filenames, size_t count, int *status)
+{
+	if(!fsmounted || readonly || filenames == NULL || status == NULL) return -1;
+
+	struct NameIndex index;
+	name_index_build(&index);
+
+	//entries the batch clears, where they were and the status of each; their
+	//chains are queued once the root dir is written, and they are put back if
+	//it cannot be; a file can only be deleted once, so there are at most this
+	//many
+	struct RootDirEntry removed[FS_FILE_MAX_COUNT];
+	int removed_index[FS_FILE_MAX_COUNT];
+	size_t removed_at[FS_FILE_MAX_COUNT];
+	uint32_t tails[FS_FILE_MAX_COUNT];	//pack blks of the deleted tails
+	int num_deleted = 0, num_removed = 0, num_tails = 0;
+	size_t i = 0;
+	for(; i < count; i++)
+	{
+		const char *filename = root_name(filenames[i]);
+		if(filename == NULL)
+		{
+			status[i] = fs_delete(filenames[i]);
+			if(status[i] == 0) num_deleted++;
+			continue;
+		}
+
+		status[i] = -1;
+		if(!filename_valid(filename)) continue;
+
+		//file not found, currently open, or a directory
+		int slot = name_index_find(&index, filename);
+		if(slot == -1) continue;
+		int rdir_index = index.slot[slot];
+		if(rdir_open_count[rdir_index] > 0 || 
+			(rootdir[rdir_index].flags & FILE_DIR)) continue;
+
+		if(sb_mark_reclaim_pending() == -1) break;
+		removed[num_removed] = rootdir[rdir_index];
+		removed_index[num_removed] = rdir_index;
+		removed_at[num_removed++] = i;
+
+		//clean file's contents in root dir
+		entry_remove(rdir_index);
+		index.slot[slot] = NAME_INDEX_DELETED;
+
+		status[i] = 0;
+		num_deleted++;
+	}
+	//the disk could not be marked, the rest of the batch is not deleted
+	for(; i < count; i++) status[i] = -1;
+
+	if(num_removed == 0) return num_deleted;
+
+	//write back root dir
+	if(rdir_write() == -1)
+	{
+		for(int j = 0; j < num_removed; j++)
+		{
+			rootdir[removed_index[j]] = removed[j];
+			if(free_counts_valid) num_free_rdir_entries--;
+			status[removed_at[j]] = -1;
+		}
+
+		return num_deleted - num_removed;
+	}
+
+	//a pack blk is put once, however many of its tails go
+	for(int j = 0; j < num_removed; j++)
+	{
+		int k = 0;
+		while(k < num_tails && tails[k] != removed[j].tail_blk) k++;
+		if((removed[j].flags & FILE_PACKED) && k == num_tails)
+			tails[num_tails++] = removed[j].tail_blk;
+	}
+
+	//hand every chain to the reclaim queue at once, see fs_delete
+	pthread_mutex_lock(&alloc_lock);
+	for(int j = 0; j < num_removed; j++) 
+		reclaim_push(removed[j].index_first_data_blk, 
+			removed[j].flags & FILE_MAPPED);
+	for(int j = 0; j < num_tails; j++) pack_blk_put(tails[j]);
+	pthread_mutex_unlock(&alloc_lock);
+
+	return num_deleted;
+}
+
+int fs_stat_batch(const char **filenames, size_t count, int *sizes)
+{
+	if(!fsmounted || filenames == NULL || sizes == NULL) return -1;
+
+	struct NameIndex index;
+	name_index_build(&index);
+
+	int num_found = 0;
+	for(size_t i = 0; i < count; i++)
+	{
+		const char *filename = root_name(filenames[i]);
+		if(filename == NULL)
+		{
+			int rdir_index = path_lookup(filenames[i]);
+			sizes[i] = rdir_index == -1 ? -1 : 
+				(int)rootdir[rdir_index].size_file_bytes;
+			if(rdir_index != -1) num_found++;
+			entry_put(rdir_index);
+			continue;
+		}
+
+		int slot = filename_valid(filename) ? 
+			name_index_find(&index, filename) : -1;
+		if(slot == -1)
+		{
+			sizes[i] = -1;
+			continue;
+		}
+
+		sizes[i] = rootdir[index.slot[slot]].size_file_bytes;
+		num_found++;
+	}
+
+	return num_found;
+}
+
+//phase 3
+
+//---start of map helper functions
+static void map_free(struct FileMap *map)
+{
+	if(map == NULL) return;
+	free(map->data_blk);
+	free(map->map_blk);
+	free(map->dirty);
+	free(map->released);
+	free(map);
+}
+
+static void map_release(struct FileMap *map, uint32_t data_blk)
+{
+	//drop the map's ownership of a data blk it no longer lists, once the map
+	//on disk no longer lists it either; caller holds alloc_lock
+	if(map->num_released == map->cap_released)
+	{
+		size_t new_cap = map->cap_released ? map->cap_released * 2 : 16;
+		uint32_t *released = realloc(map->released, 
+			new_cap * sizeof(uint32_t));
+		if(released == NULL)
+		{
+			//no room to defer, let go of it right away instead
+			unref_data_blk(data_blk);
+			return;
+		}
+		map->released = released;
+		map->cap_released = new_cap;
+	}
+	map->released[map->num_released++] = data_blk;
+}
+
+static int map_reserve(struct FileMap *map, size_t num_map_blks)
+{
+	//make room for num_map_blks map blks, doubling like the fd table
+	if(num_map_blks <= map->cap_map_blks) return 0;
+	size_t new_cap = map->cap_map_blks * 2;
+	if(new_cap < num_map_blks) new_cap = num_map_blks;
+
+	uint32_t *data_blk = realloc(map->data_blk, 
+		new_cap * MAP_ENTRIES_PER_BLK * sizeof(uint32_t));
+	if(data_blk == NULL) return -1;
+	map->data_blk = data_blk;
+	uint32_t *map_blk = realloc(map->map_blk, new_cap * sizeof(uint32_t));
+	if(map_blk == NULL) return -1;
+	map->map_blk = map_blk;
+	uint8_t *dirty = realloc(map->dirty, new_cap);
+	if(dirty == NULL) return -1;
+	map->dirty = dirty;
+	map->cap_map_blks = new_cap;
+
+	return 0;
+}
+
+static int map_load(int rdir_index)
+{
+	//read the map of a mapped file, it stays in memory while the file is open
+	struct RootDirEntry *rootdirentry = &rootdir[rdir_index];
+	if(!(rootdirentry->flags & FILE_MAPPED) || rdir_map[rdir_index] != NULL)
+		return 0;
+
+	struct FileMap *map = calloc(1, sizeof(struct FileMap));
+	if(map == NULL) return -1;
+
+	uint32_t index_cur_map_blk = rootdirentry->index_first_data_blk;
+	uint8_t buf[BLOCK_SIZE];
+	while(index_cur_map_blk != FAT_EOC && index_cur_map_blk != 0)
+	{
+		//a chain longer than the disk has a loop in it
+		size_t n = map->num_map_blks;
+		if(n == superblock->num_data_blks || map_reserve(map, n + 1) == -1 ||
+			block_read(superblock->data_blk_start_index + index_cur_map_blk,
+			buf) == -1)
+		{
+			map_free(map);
+			return -1;
+		}
+		map_blk_decode(buf, map->data_blk + n * MAP_ENTRIES_PER_BLK);
+		map->map_blk[n] = index_cur_map_blk;
+		map->dirty[n] = 0;
+		map->num_map_blks++;
+		index_cur_map_blk = fat_get(index_cur_map_blk);
+	}
+	rdir_map[rdir_index] = map;
+
+	return 0;
+}
+
+static void map_unload(int rdir_index)
+{
+	//drop the map once nobody has the file open
+	if(rdir_open_count[rdir_index] > 0) return;
+	map_free(rdir_map[rdir_index]);
+	rdir_map[rdir_index] = NULL;
+}
+//---end of map helper functions
+
+//---start of fd helper functions
+static bool fd_is_open(int fd)
+{
+	return fsmounted && fd >= 0 && fd < fdtable_size && 
+		fdtable[fd].rdir_index != -1;
+}
+
+static int fd_alloc(void)
+{
+	if(fd_free_head == -1)
+	{
+		//out of slots, double the table without going over the limit
+		if(fdtable_size == fd_open_max) return -1;
+		int new_size = fdtable_size ? fdtable_size * 2 : 8;
+		if(new_size > fd_open_max) new_size = fd_open_max;
+		struct FD *new_table = realloc(fdtable, new_size * sizeof(struct FD));
+		if(new_table == NULL) return -1;
+		fdtable = new_table;
+		//chain the new slots in order so low fds are handed out first
+		for(int fd = new_size - 1; fd >= fdtable_size; fd--)
+		{
+			fdtable[fd].rdir_index = -1;
+			fdtable[fd].next_free = fd_free_head;
+			fd_free_head = fd;
+		}
+		fdtable_size = new_size;
+	}
+
+	int fd = fd_free_head;
+	fd_free_head = fdtable[fd].next_free;
+
+	return fd;
+}
+//---end of fd helper functions
+
+int fs_open(const char *filename)
+{
+	//validation
+	if(!fsmounted || filename == NULL || fd_open == fd_open_max) return -1;
+
+	//validate file is already created, the fd keeps the lookup's reference
+	int rdir_index = path_lookup(filename);
+	if(rdir_index == -1) return -1;
+	if((rootdir[rdir_index].flags & FILE_DIR) || map_load(rdir_index) == -1)
+	{
+		entry_put(rdir_index);
+		return -1;
+	}
+
+	//get an empty fd
+	int fd = fd_alloc();
+	if(fd == -1)
+	{
+		map_unload(rdir_index);
+		entry_put(rdir_index);
+		return -1;
+	}
+
+	fdtable[fd].rdir_index = rdir_index;
+	fdtable[fd].offset = 0;
+	fdtable[fd].hint.data_blk = 0;
+	fdtable[fd].pins = 0;
+	rdir_open_count[rdir_index]++;
+	fd_open++;
+	
+	return fd;
+}
+
+int fs_close(int fd)
+{
+	//validation
+	if(!fd_is_open(fd)) return -1;
+
+	//otherwise, safe to close fd and reset it for another file
+	int rdir_index = fdtable[fd].rdir_index;
+	//blks the fd still has pinned are let go with it
+	rdir_pin_count[rdir_index] -= fdtable[fd].pins;
+	rdir_open_count[rdir_index]--;
+	//not fatal, a tail that cannot be packed stays in its blk
+	if(rdir_open_count[rdir_index] == 0) tail_pack(rdir_index);
+	map_unload(rdir_index);
+	entry_put(rdir_index);
+	fdtable[fd].rdir_index = -1;
+	fdtable[fd].next_free = fd_free_head;
+	fd_free_head = fd;
+	fd_open--;
+
+	return 0;
+}
+
+int fs_stat(int fd)
+{
+	//validation
+	if(!fd_is_open(fd)) return -1;
+
+	//otherwise, return file size
+	return rootdir[fdtable[fd].rdir_index].size_file_bytes;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	//validation, a sparse mount may seek past the end of file
+	if(!fd_is_open(fd) || offset > (sparse_enabled ? FILE_SIZE_MAX : 
+		(size_t)fs_stat(fd))) return -1;
+
+	//set new offset
+	fdtable[fd].offset = offset;
+
+	return 0;
+}
+
+//phase 4
+
+//---start of helper functions
+uint32_t index_data_blk(uint32_t data_start_index , size_t file_offset)
+{
+	//index of data blk according to offset and the start index
+	//update data_start_index using fat entry pointers
+	//Example: we read 1st block if offset 4095 and 2nd block if offset 4096
+	int num_blk_skip = file_offset / BLOCK_SIZE;
+	while(num_blk_skip > 0 && data_start_index != FAT_EOC)
+	{
+		data_start_index = fat_get(data_start_index);
+		num_blk_skip--;
+	}
+
+	return data_start_index;
+}
+
+static uint32_t find_free_data_blk(void)
+{
+	//known full disk, no need to scan
+	if(free_counts_valid && num_free_data_blks == 0) return 0;
+
+	//nothing below the hint is free, so start looking there
+	for(uint32_t fat_index = fat_free_hint; fat_index < 
+		superblock->num_data_blks; fat_index++)
+	{
+		if(fat_get(fat_index) == 0) return fat_index;
+	}
+	fat_free_hint = superblock->num_data_blks;
+
+	return 0;
+}
+
+uint32_t allocate_new_data_blk(uint32_t prev_blk_index)
+{
+	//allocate the first avaliable fat entry and data block, and link it
+	//after prev_blk_index unless that is FAT_EOC
+	//note claiming fat entry 0 or data blk 0 is not allowed by disk format
+	pthread_mutex_lock(&alloc_lock);
+
+	uint32_t fat_index = find_free_data_blk();
+	//out of space, free deleted chains on demand until a blk shows up
+	while(fat_index == 0 && reclaim_len > 0)
+	{
+		reclaim_step(RECLAIM_BATCH);
+		fat_index = find_free_data_blk();
+	}
+
+	if(fat_index != 0 && sb_mark_dirty() == 0)
+	{
+		fat_set(fat_index, FAT_EOC);
+		if(prev_blk_index != FAT_EOC) fat_set(prev_blk_index, fat_index);
+		fat_free_hint = fat_index + 1;
+		if(free_counts_valid) num_free_data_blks--;
+	}
+	else
+	{
+		//else failed to allocate a new data blk
+		//note again claiming data blk 0 is illegal by disk format
+		//so this will be our error flag
+		fat_index = 0;
+	}
+
+	pthread_mutex_unlock(&alloc_lock);
+
+	return fat_index;
+}
+
+static bool find_free_data_blks(uint32_t *blks, size_t count)
+{
+	//the first run of count free blks in a row if there is one, else the
+	//first count free blks; caller holds alloc_lock
+	size_t run_len = 0;
+	for(uint32_t fat_index = fat_free_hint; fat_index < 
+		superblock->num_data_blks && run_len < count; fat_index++)
+	{
+		if(fat_get(fat_index) != 0)
+		{
+			run_len = 0;
+			continue;
+		}
+		if(run_len == 0) blks[0] = fat_index;
+		run_len++;
+	}
+	if(run_len == count)
+	{
+		for(size_t i = 1; i < count; i++) blks[i] = blks[0] + i;
+		return true;
+	}
+
+	size_t found = 0;
+	for(uint32_t fat_index = fat_free_hint; fat_index < 
+		superblock->num_data_blks && found < count; fat_index++)
+	{
+		if(fat_get(fat_index) == 0) blks[found++] = fat_index;
+	}
+
+	return found == count;
+}
+
+static int allocate_data_blks(uint32_t *blks, size_t count)
+{
+	//claim count data blks at once, in as few runs as we can find; they are
+	//not linked to anything, each one is its own chain end
+	//all or nothing, -1 if the disk is too full
+	if(count == 0) return 0;
+	pthread_mutex_lock(&alloc_lock);
+
+	bool found = (!free_counts_valid || num_free_data_blks >= count) &&
+		find_free_data_blks(blks, count);
+	//deleted chains count as free space, finish freeing them and retry
+	if(!found && reclaim_len > 0)
+	{
+		reclaim_step(SIZE_MAX);
+		found = find_free_data_blks(blks, count);
+	}
+
+	int ret = -1;
+	if(found && sb_mark_dirty() == 0)
+	{
+		for(size_t i = 0; i < count; i++) fat_set(blks[i], FAT_EOC);
+		if(blks[0] == fat_free_hint) fat_free_hint = blks[count - 1] + 1;
+		if(free_counts_valid) num_free_data_blks -= count;
+		ret = 0;
+	}
+
+	pthread_mutex_unlock(&alloc_lock);
+
+	return ret;
+}
+
+static int blk_table_create(struct BlkTable *table)
+{
+	//a new table with every entry 0, in a chain of blks claimed at once; the
+	//caller points the superblock to it, which is written once the chain is
+	size_t num_blks = blk_table_blks_needed(table);
+	table->entries = calloc(num_blks, BLOCK_SIZE);
+	table->blk = malloc(num_blks * sizeof(uint32_t));
+	table->blk_dirty = malloc(num_blks * sizeof(uint8_t));
+	if(table->entries == NULL || table->blk == NULL || 
+		table->blk_dirty == NULL || allocate_data_blks(table->blk, num_blks) == -1)
+	{
+		blk_table_release(table);
+		return -1;
+	}
+
+	pthread_mutex_lock(&alloc_lock);
+	for(size_t i = 1; i < num_blks; i++) 
+		fat_set(table->blk[i - 1], table->blk[i]);
+	pthread_mutex_unlock(&alloc_lock);
+	memset(table->blk_dirty, 1, num_blks);
+	table->num_blks = num_blks;
+	sb_tables_dirty = true;
+
+	return 0;
+}
+
+static int refcnt_create(void)
+{
+	//first shared blk on this image, every data blk has a single owner so far
+	if(blk_table_create(&refcnt_table) == -1) return -1;
+	superblock->refcnt_first_blk = refcnt_table.blk[0];
+
+	return 0;
+}
+
+static bool blk_is_zero(const void *buf)
+{
+	//OR the blk together a word at a time, a loop the compiler vectorizes;
+	//checking every 256 bytes lets blks of data bail out early
+	const uint8_t *byte = buf;
+	for(size_t i = 0; i < BLOCK_SIZE; i += 256)
+	{
+		uint64_t acc = 0;
+		for(size_t j = 0; j < 256; j += sizeof(uint64_t))
+		{
+			uint64_t word;
+			memcpy(&word, byte + i + j, sizeof(uint64_t));	//buf may be unaligned
+			acc |= word;
+		}
+		if(acc != 0) return false;
+	}
+
+	return true;
+}
+//---end of helper functions
+
+//---start of iovec helper functions
+struct iov_cursor	//position inside a caller's iovec array
+{
+	const struct iovec *iov;
+	int iovcnt;
+	int index;	//current iovec
+	size_t pos;	//bytes of the current iovec already consumed
+};
+
+static void iov_skip_empty(struct iov_cursor *cursor)
+{
+	while(cursor->index < cursor->iovcnt && 
+		cursor->pos == cursor->iov[cursor->index].iov_len)
+	{
+		cursor->index++;
+		cursor->pos = 0;
+	}
+}
+
+static void *iov_contig(struct iov_cursor *cursor, size_t len)
+{
+	//the next len bytes as one pointer if a single iovec holds them all, so
+	//that whole blocks can go straight between the disk and the caller
+	iov_skip_empty(cursor);
+	if(cursor->index == cursor->iovcnt || 
+		cursor->iov[cursor->index].iov_len - cursor->pos < len) return NULL;
+
+	void *ptr = (uint8_t*)cursor->iov[cursor->index].iov_base + cursor->pos;
+	cursor->pos += len;
+
+	return ptr;
+}
+
+static void iov_gather(struct iov_cursor *cursor, void *dst, size_t len)
+{
+	//copy the next len bytes of the iovecs into dst
+	while(len > 0)
+	{
+		iov_skip_empty(cursor);
+		size_t avail = cursor->iov[cursor->index].iov_len - cursor->pos;
+		size_t amount = avail < len ? avail : len;
+		memcpy(dst, (uint8_t*)cursor->iov[cursor->index].iov_base + 
+			cursor->pos, amount);
+		cursor->pos += amount;
+		dst = (uint8_t*)dst + amount;
+		len -= amount;
+	}
+}
+
+static void iov_scatter(struct iov_cursor *cursor, const void *src, size_t len)
+{
+	//copy len bytes from src into the next bytes of the iovecs
+	while(len > 0)
+	{
+		iov_skip_empty(cursor);
+		size_t avail = cursor->iov[cursor->index].iov_len - cursor->pos;
+		size_t amount = avail < len ? avail : len;
+		memcpy((uint8_t*)cursor->iov[cursor->index].iov_base + cursor->pos,
+			src, amount);
+		cursor->pos += amount;
+		src = (const uint8_t*)src + amount;
+		len -= amount;
+	}
+}
+
+static ssize_t iov_total(const struct iovec *iov, int iovcnt)
+{
+	//total length of the iovecs, -1 if they are malformed
+	if(iov == NULL || iovcnt < 0) return -1;
+
+	size_t total = 0;
+	for(int i = 0; i < iovcnt; i++)
+	{
+		if(iov[i].iov_base == NULL && iov[i].iov_len > 0) return -1;
+		total += iov[i].iov_len;
+	}
+	//results are returned as int
+	if(total > INT_MAX) return -1;
+
+	return total;
+}
+//---end of iovec helper functions
+
+//---start of block map helper functions
+static uint32_t map_get(const struct FileMap *map, size_t lblk)
+{
+	//data blk of logical blk lblk, MAP_HOLE if it has none
+	if(lblk >= map->num_map_blks * MAP_ENTRIES_PER_BLK) return MAP_HOLE;
+	uint32_t data_blk = map->data_blk[lblk];
+
+	return data_blk < superblock->num_data_blks ? data_blk : MAP_HOLE;
+}
+
+static int map_grow(struct RootDirEntry *rootdirentry, struct FileMap *map,
+	size_t num_map_blks)
+{
+	//append empty map blks to the map chain until there are num_map_blks
+	while(map->num_map_blks < num_map_blks)
+	{
+		size_t n = map->num_map_blks;
+		if(map_reserve(map, n + 1) == -1) return -1;
+		uint32_t prev_map_blk = n ? map->map_blk[n - 1] : FAT_EOC;
+		uint32_t new_map_blk = allocate_new_data_blk(prev_map_blk);
+		if(new_map_blk == 0) return -1;
+		if(prev_map_blk == FAT_EOC)
+			rootdirentry->index_first_data_blk = new_map_blk;
+
+		memset(map->data_blk + n * MAP_ENTRIES_PER_BLK, 0, 
+			MAP_ENTRIES_PER_BLK * sizeof(uint32_t));
+		map->map_blk[n] = new_map_blk;
+		map->dirty[n] = 1;
+		map->num_map_blks++;
+	}
+
+	return 0;
+}
+
+static int map_flush(struct FileMap *map)
+{
+	//write back the map blks we modified, then let go of the data blks they
+	//stopped listing; a crash in between leaves those to the orphan sweep
+	if(map->num_released > 0 && sb_mark_reclaim_pending() == -1) return -1;
+	uint8_t buf[BLOCK_SIZE];
+	for(size_t i = 0; i < map->num_map_blks; i++)
+	{
+		if(!map->dirty[i]) continue;
+		map_blk_encode(map->data_blk + i * MAP_ENTRIES_PER_BLK, buf);
+		if(block_write(superblock->data_blk_start_index + map->map_blk[i],
+			buf) == -1) return -1;
+		map->dirty[i] = 0;
+	}
+
+	pthread_mutex_lock(&alloc_lock);
+	for(size_t i = 0; i < map->num_released; i++)
+		unref_data_blk(map->released[i]);
+	discard_flush();
+	pthread_mutex_unlock(&alloc_lock);
+	map->num_released = 0;
+
+	return 0;
+}
+
+static int map_convert(int rdir_index)
+{
+	//switch a file from a plain FAT chain to the mapped layout, which is the
+	//only one that can have holes
+	struct RootDirEntry *rootdirentry = &rootdir[rdir_index];
+	size_t num_blks = 0;
+	chain_gen++;
+	for(uint32_t index_cur_data_blk = rootdirentry->index_first_data_blk;
+		index_cur_data_blk != FAT_EOC && index_cur_data_blk != 0 &&
+		num_blks < superblock->num_data_blks;
+		index_cur_data_blk = fat_get(index_cur_data_blk)) num_blks++;
+
+	struct FileMap *map = calloc(1, sizeof(struct FileMap));
+	if(map == NULL) return -1;
+
+	//get the map blks first, the file is left untouched if there is no room
+	struct RootDirEntry map_head = { .index_first_data_blk = FAT_EOC };
+	size_t num_map_blks = num_blks / MAP_ENTRIES_PER_BLK + 1;
+	if(map_grow(&map_head, map, num_map_blks) == -1)
+	{
+		pthread_mutex_lock(&alloc_lock);
+		reclaim_push(map_head.index_first_data_blk, false);
+		pthread_mutex_unlock(&alloc_lock);
+		map_free(map);
+		return -1;
+	}
+
+	//the chain's blks become the first entries of the map, unlinked
+	pthread_mutex_lock(&alloc_lock);
+	uint32_t index_cur_data_blk = rootdirentry->index_first_data_blk;
+	for(size_t lblk = 0; lblk < num_blks; lblk++)
+	{
+		uint32_t index_next_data_blk = fat_get(index_cur_data_blk);
+		fat_set(index_cur_data_blk, FAT_EOC);
+		map->data_blk[lblk] = index_cur_data_blk;
+		index_cur_data_blk = index_next_data_blk;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+
+	rootdirentry->index_first_data_blk = map_head.index_first_data_blk;
+	rootdirentry->flags |= FILE_MAPPED;
+	rdir_map[rdir_index] = map;
+
+	return 0;
+}
+//---end of block map helper functions
+
+//---start of block cursor helper functions
+struct BlkCursor	//walks the logical blks of a file, whatever its layout
+{
+	struct RootDirEntry *rootdirentry;
+	struct FileMap *map;	//NULL for a plain FAT chain
+	size_t lblk;	//logical blk the cursor is on
+	uint32_t data_blk;	//its data blk, 0 for a hole or past the end
+	uint32_t prev_data_blk;	//FAT chain only, data blk of lblk - 1
+};
+
+static void blk_cursor_init(struct BlkCursor *cursor, int rdir_index,
+	size_t lblk)
+{
+	cursor->rootdirentry = &rootdir[rdir_index];
+	cursor->map = rdir_map[rdir_index];
+	cursor->lblk = lblk;
+	if(cursor->map != NULL)
+	{
+		cursor->data_blk = map_get(cursor->map, lblk);
+		return;
+	}
+
+	//move to the correct blk, remembering the blk before it so the chain
+	//can be extended in the same pass
+	uint32_t prev_data_blk = FAT_EOC;
+	uint32_t data_blk = cursor->rootdirentry->index_first_data_blk;
+	for(; lblk > 0 && data_blk != FAT_EOC; lblk--)
+	{
+		prev_data_blk = data_blk;
+		data_blk = fat_get(data_blk);
+	}
+	cursor->prev_data_blk = prev_data_blk;
+	cursor->data_blk = data_blk == FAT_EOC ? 0 : data_blk;
+}
+
+static void blk_cursor_next(struct BlkCursor *cursor)
+{
+	cursor->lblk++;
+	if(cursor->map != NULL)
+	{
+		cursor->data_blk = map_get(cursor->map, cursor->lblk);
+		return;
+	}
+
+	//past the end of the chain stays past the end
+	if(cursor->data_blk == 0) return;
+	cursor->prev_data_blk = cursor->data_blk;
+	uint32_t next_data_blk = fat_get(cursor->data_blk);
+	cursor->data_blk = next_data_blk == FAT_EOC ? 0 : next_data_blk;
+}
+
+static void blk_cursor_resume(struct BlkCursor *cursor, int rdir_index,
+	size_t lblk, const struct ChainHint *hint)
+{
+	//walk a FAT chain on from where the last transfer through the fd was,
+	//unless the hint is past lblk or blks left a chain since it was taken
+	if(hint == NULL || hint->data_blk == 0 || hint->gen != chain_gen || 
+		hint->lblk > lblk || rdir_map[rdir_index] != NULL)
+	{
+		blk_cursor_init(cursor, rdir_index, lblk);
+		return;
+	}
+
+	cursor->rootdirentry = &rootdir[rdir_index];
+	cursor->map = NULL;
+	cursor->lblk = hint->lblk;
+	cursor->data_blk = hint->data_blk;
+	cursor->prev_data_blk = hint->prev_data_blk;
+	while(cursor->lblk < lblk) blk_cursor_next(cursor);
+}
+
+static void blk_cursor_hint(const struct BlkCursor *cursor, 
+	struct ChainHint *hint)
+{
+	//remember a blk the chain has, past its end the chain may still grow
+	if(hint == NULL || cursor->map != NULL || cursor->data_blk == 0) return;
+	hint->lblk = cursor->lblk;
+	hint->data_blk = cursor->data_blk;
+	hint->prev_data_blk = cursor->prev_data_blk;
+	hint->gen = chain_gen;
+}
+
+static size_t blk_cursor_run(struct BlkCursor *cursor, size_t tail_lblk, 
+	size_t left, size_t max_len, struct ChainHint *hint)
+{
+	//bytes from left on in the blks that follow the cursor's on disk, or in
+	//the holes that follow it, up to max_len; the cursor ends on the blk
+	//after them
+	uint32_t first_data_blk = cursor->data_blk;
+	bool tail = cursor->lblk == tail_lblk;
+	size_t len = BLOCK_SIZE - left < max_len ? BLOCK_SIZE - left : max_len;
+	size_t num_blks = 1;
+	blk_cursor_hint(cursor, hint);
+	blk_cursor_next(cursor);
+	while(!tail && len < max_len && cursor->lblk != tail_lblk &&
+		cursor->data_blk == (first_data_blk == 0 ? 0 : 
+		first_data_blk + num_blks))
+	{
+		len += BLOCK_SIZE < max_len - len ? BLOCK_SIZE : max_len - len;
+		num_blks++;
+		blk_cursor_hint(cursor, hint);
+		blk_cursor_next(cursor);
+	}
+	return len;
+}
+
+static uint32_t blk_cursor_alloc(struct BlkCursor *cursor)
+{
+	//give the cursor's logical blk a data blk, 0 if the disk is full
+	//note a FAT chain can only grow at its end
+	uint32_t data_blk;
+	struct FileMap *map = cursor->map;
+	if(map != NULL)
+	{
+		if(map_grow(cursor->rootdirentry, map,
+			cursor->lblk / MAP_ENTRIES_PER_BLK + 1) == -1) return 0;
+		//mapped data blks are not chained, each one is its own chain end
+		data_blk = allocate_new_data_blk(FAT_EOC);
+		if(data_blk == 0) return 0;
+		map->data_blk[cursor->lblk] = data_blk;
+		map->dirty[cursor->lblk / MAP_ENTRIES_PER_BLK] = 1;
+	}
+	else
+	{
+		data_blk = allocate_new_data_blk(cursor->prev_data_blk);
+		if(data_blk == 0) return 0;
+		if(cursor->prev_data_blk == FAT_EOC)	//empty file gets its first block
+			cursor->rootdirentry->index_first_data_blk = data_blk;
+	}
+	cursor->data_blk = data_blk;
+
+	return data_blk;
+}
+
+static void blk_cursor_punch(struct BlkCursor *cursor)
+{
+	//turn the cursor's logical blk of a mapped file into a hole
+	struct FileMap *map = cursor->map;
+	if(cursor->data_blk == 0) return;
+
+	pthread_mutex_lock(&alloc_lock);
+	map_release(map, cursor->data_blk);
+	pthread_mutex_unlock(&alloc_lock);
+	map->data_blk[cursor->lblk] = MAP_HOLE;
+	map->dirty[cursor->lblk / MAP_ENTRIES_PER_BLK] = 1;
+	cursor->data_blk = 0;
+}
+
+static int blk_cursor_unshare(struct BlkCursor *cursor, void *buf)
+{
+	//copy on write: the cursor's logical blk gets a data blk of its own
+	//instead of the one it shares with clones; the old content is read into
+	//buf first unless buf is NULL
+	struct FileMap *map = cursor->map;
+	uint32_t shared_blk = cursor->data_blk;
+	if(buf != NULL && block_read(superblock->data_blk_start_index + 
+		shared_blk, buf) == -1) return -1;
+
+	uint32_t data_blk = allocate_new_data_blk(FAT_EOC);
+	if(data_blk == 0) return -1;
+	pthread_mutex_lock(&alloc_lock);
+	map_release(map, shared_blk);
+	pthread_mutex_unlock(&alloc_lock);
+	map->data_blk[cursor->lblk] = data_blk;
+	map->dirty[cursor->lblk / MAP_ENTRIES_PER_BLK] = 1;
+	cursor->data_blk = data_blk;
+
+	return 0;
+}
+
+static int blk_cursor_zero_tail(struct BlkCursor *cursor, size_t left)
+{
+	//bytes from left to the end of the cursor's blk are past the end of file,
+	//they must read back as zeros once the file grows over them
+	uint8_t bounce_buffer[BLOCK_SIZE];
+	if(cursor->data_blk == 0) return 0;	//holes are zeros already
+	if(refcnt_get(cursor->data_blk) > 0)
+	{
+		if(blk_cursor_unshare(cursor, bounce_buffer) == -1) return -1;
+	}
+	else if(block_read(superblock->data_blk_start_index + cursor->data_blk,
+		bounce_buffer) == -1) return -1;
+	memset(bounce_buffer + left, 0, BLOCK_SIZE - left);
+	pthread_mutex_lock(&alloc_lock);
+	dedup_forget(cursor->data_blk);
+	pthread_mutex_unlock(&alloc_lock);
+
+	return block_write(superblock->data_blk_start_index + cursor->data_blk,
+		bounce_buffer);
+}
+
+static bool blk_cursor_dedup(struct BlkCursor *cursor, const void *src,
+	uint32_t hash)
+{
+	//point the cursor's logical blk of a mapped file to a blk that already
+	//holds src instead of writing it, false if there is none; candidates
+	//are read back and compared, the same hash is not enough
+	if(sb_mark_reclaim_pending() == -1) return false;
+	//a blk past the end of the map needs its map blk first
+	if(map_grow(cursor->rootdirentry, cursor->map,
+		cursor->lblk / MAP_ENTRIES_PER_BLK + 1) == -1) return false;
+
+	uint32_t *hashes = dedup_table.entries;
+	uint8_t bounce_buffer[BLOCK_SIZE];
+	pthread_mutex_lock(&alloc_lock);
+	uint32_t data_blk = dedup_bucket[hash & (dedup_num_buckets - 1)];
+	for(; data_blk != 0; data_blk = dedup_next[data_blk])
+	{
+		if(hashes[data_blk] != hash) continue;
+		if(data_blk != cursor->data_blk && refcnt_get(data_blk) == UINT16_MAX)
+			continue;	//cannot take one more owner
+		if(block_read(superblock->data_blk_start_index + data_blk, 
+			bounce_buffer) == 0 && memcmp(bounce_buffer, src, BLOCK_SIZE) == 0)
+			break;
+	}
+	if(data_blk == 0 || data_blk == cursor->data_blk)
+	{
+		//rewriting a blk with what it holds already is a match too
+		pthread_mutex_unlock(&alloc_lock);
+		return data_blk != 0;
+	}
+
+	refcnt_set(data_blk, refcnt_get(data_blk) + 1);
+	struct FileMap *map = cursor->map;
+	if(cursor->data_blk != 0) map_release(map, cursor->data_blk);
+	dedup_hits++;
+	pthread_mutex_unlock(&alloc_lock);
+
+	map->data_blk[cursor->lblk] = data_blk;
+	map->dirty[cursor->lblk / MAP_ENTRIES_PER_BLK] = 1;
+	cursor->data_blk = data_blk;
+
+	return true;
+}
+
+static int file_commit(int rdir_index)
+{
+	//write back the FAT blocks of new blks, then the map, then the FAT blocks
+	//of the blks the map let go of, then root dir
+	pthread_mutex_lock(&alloc_lock);
+	int ret = fat_flush();
+	pthread_mutex_unlock(&alloc_lock);
+	if(ret == -1) return -1;
+
+	if(rdir_map[rdir_index] != NULL)
+	{
+		if(map_flush(rdir_map[rdir_index]) == -1) return -1;
+		pthread_mutex_lock(&alloc_lock);
+		ret = fat_flush();
+		pthread_mutex_unlock(&alloc_lock);
+		if(ret == -1) return -1;
+	}
+
+	return rdir_write();
+}
+//---end of block cursor helper functions
+
+//---start of cluster helper functions
+static bool cluster_compressed(const struct FileMap *map, size_t cluster)
+{
+	//the last entry of a compressed cluster is always a marker
+	size_t lblk = (cluster + 1) * CLUSTER_BLKS - 1;
+
+	return lblk < map->num_map_blks * MAP_ENTRIES_PER_BLK &&
+		map->data_blk[lblk] == MAP_COMPRESSED;
+}
+
+static uint8_t *cluster_buf_alloc(void)
+{
+	//room for a cluster followed by a compressed one, too large for the stack
+	//with big blks
+	return malloc(CLUSTER_SIZE + CLUSTER_PACKED_SIZE);
+}
+
+static int cluster_read(const struct FileMap *map, size_t cluster, 
+	uint8_t *buf, size_t from, size_t len)
+{
+	//content of a cluster, holes as zeros, in a buf from cluster_buf_alloc;
+	//bytes from to from + len are needed, a cluster stored as is only has
+	//their blks read
+	size_t lblk = cluster * CLUSTER_BLKS;
+	if(!cluster_compressed(map, cluster))
+	{
+		for(size_t i = from / BLOCK_SIZE; i * BLOCK_SIZE < from + len; i++)
+		{
+			uint32_t data_blk = map_get(map, lblk + i);
+			if(data_blk == MAP_HOLE)
+				memset(buf + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+			else if(block_read(superblock->data_blk_start_index + data_blk,
+				buf + i * BLOCK_SIZE) == -1) return -1;
+		}
+		return 0;
+	}
+
+	//a compressed cluster starts with the length of the compressed data
+	uint8_t *packed = buf + CLUSTER_SIZE;
+	size_t num_blks = 0;
+	for(; map->data_blk[lblk + num_blks] != MAP_COMPRESSED; num_blks++)
+	{
+		uint32_t data_blk = map_get(map, lblk + num_blks);
+		if(data_blk == MAP_HOLE || block_read(superblock->data_blk_start_index
+			+ data_blk, packed + num_blks * BLOCK_SIZE) == -1) return -1;
+	}
+	if(num_blks == 0) return -1;
+	uint32_t packed_len;
+	memcpy(&packed_len, packed, sizeof(uint32_t));
+	if(packed_len > num_blks * BLOCK_SIZE - sizeof(uint32_t)) return -1;
+
+	return lz_decompress(buf, CLUSTER_SIZE, packed + sizeof(uint32_t), 
+		packed_len) == (ssize_t)CLUSTER_SIZE ? 0 : -1;
+}
+
+static int cluster_write(struct RootDirEntry *rootdirentry, struct FileMap *map,
+	size_t cluster, uint8_t *buf)
+{
+	//store the content of a cluster, in a buf from cluster_buf_alloc,
+	//compressed if that saves a blk; blks of zeros in a cluster stored as is
+	//are holes
+	size_t lblk = cluster * CLUSTER_BLKS;
+	if(map_grow(rootdirentry, map, lblk / MAP_ENTRIES_PER_BLK + 1) == -1)
+		return -1;
+
+	uint8_t *packed = (uint8_t*)buf + CLUSTER_SIZE;
+	size_t packed_len = lz_compress(packed + sizeof(uint32_t), 
+		CLUSTER_PACKED_SIZE - sizeof(uint32_t), buf, CLUSTER_SIZE);
+	bool compressed = packed_len != 0;
+	bool zero[CLUSTER_BLKS];
+	size_t num_blks = 0;
+	for(size_t i = 0; i < CLUSTER_BLKS; i++)
+	{
+		zero[i] = blk_is_zero(buf + i * BLOCK_SIZE);
+		num_blks += !zero[i];
+	}
+	if(num_blks == 0)
+	{
+		compressed = false;	//a cluster of zeros is all holes
+	}
+	else if(compressed)
+	{
+		uint32_t len = packed_len;
+		memcpy(packed, &len, sizeof(uint32_t));
+		packed_len += sizeof(uint32_t);
+		//ceiling function from geeks for geeks
+		size_t packed_blks = (packed_len / BLOCK_SIZE) +
+			((packed_len % BLOCK_SIZE) != 0);
+		//holes already spare the zero blks of a cluster stored as is
+		if(packed_blks < num_blks)
+		{
+			num_blks = packed_blks;
+			memset(packed + packed_len, 0, num_blks * BLOCK_SIZE - packed_len);
+		}
+		else
+		{
+			compressed = false;
+		}
+	}
+
+	//the cluster goes to fresh blks: until the map is written back, the
+	//blks it lists on disk keep what they held, compressed or not
+	uint32_t old_blks[CLUSTER_BLKS];
+	uint32_t new_blks[CLUSTER_BLKS];
+	size_t num_old = 0;
+	for(size_t i = 0; i < CLUSTER_BLKS; i++)
+	{
+		uint32_t data_blk = map_get(map, lblk + i);
+		if(data_blk != MAP_HOLE) old_blks[num_old++] = data_blk;
+	}
+	if(allocate_data_blks(new_blks, num_blks) == -1) return -1;
+
+	size_t next = 0;
+	for(size_t i = 0; i < CLUSTER_BLKS && next < num_blks; i++)
+	{
+		const uint8_t *src = compressed ? packed + i * BLOCK_SIZE :
+			buf + i * BLOCK_SIZE;
+		if(!compressed && zero[i]) continue;
+		if(block_write(superblock->data_blk_start_index + new_blks[next++], 
+			src) == -1)
+		{
+			//the blks we claimed hold nothing
+			pthread_mutex_lock(&alloc_lock);
+			for(size_t j = 0; j < num_blks; j++) 
+				release_data_blk(new_blks[j]);
+			discard_flush();
+			pthread_mutex_unlock(&alloc_lock);
+			return -1;
+		}
+	}
+
+	//switch the map over, the blks it no longer lists, its own ones too,
+	//are let go of once it is written back
+	next = 0;
+	for(size_t i = 0; i < CLUSTER_BLKS; i++)
+	{
+		if(compressed)
+			map->data_blk[lblk + i] = i < num_blks ? new_blks[i] : 
+				MAP_COMPRESSED;
+		else
+			map->data_blk[lblk + i] = zero[i] ? MAP_HOLE : new_blks[next++];
+	}
+	map->dirty[lblk / MAP_ENTRIES_PER_BLK] = 1;
+	pthread_mutex_lock(&alloc_lock);
+	for(size_t i = 0; i < num_old; i++) map_release(map, old_blks[i]);
+	pthread_mutex_unlock(&alloc_lock);
+
+	return 0;
+}
+
+static int cluster_trim(int rdir_index, size_t length)
+{
+	//store the cluster the end of file falls in again, without the bytes
+	//past length
+	struct FileMap *map = rdir_map[rdir_index];
+	size_t cluster = length / CLUSTER_SIZE;
+	uint8_t *cluster_buf = cluster_buf_alloc();
+	if(cluster_buf == NULL) return -1;
+	int ret = cluster_read(map, cluster, cluster_buf, 0, CLUSTER_SIZE);
+	if(ret == 0)
+	{
+		memset(cluster_buf + length % CLUSTER_SIZE, 0, 
+			CLUSTER_SIZE - length % CLUSTER_SIZE);
+		ret = cluster_write(&rootdir[rdir_index], map, cluster, cluster_buf);
+	}
+	free(cluster_buf);
+
+	return ret;
+}
+
+static int cluster_writev(int rdir_index, const struct iovec *iov, int iovcnt,
+	size_t offset, size_t count)
+{
+	//file_writev for compressed files, a cluster at a time; bytes past the
+	//end of file are kept as zeros in every cluster
+	struct RootDirEntry *rootdirentry = &rootdir[rdir_index];
+	if(!(rootdirentry->flags & FILE_MAPPED) && map_convert(rdir_index) == -1)
+		return 0;
+	struct FileMap *map = rdir_map[rdir_index];
+	struct iov_cursor cursor = { iov, iovcnt, 0, 0 };
+
+	size_t old_size = rootdirentry->size_file_bytes;
+	size_t bytes_wrote = 0;
+	uint8_t *cluster_buf = cluster_buf_alloc();
+	if(cluster_buf == NULL) return 0;
+	while(count > 0)
+	{
+		size_t cluster = (offset + bytes_wrote) / CLUSTER_SIZE;
+		size_t cluster_start = cluster * CLUSTER_SIZE;
+		size_t left = (offset + bytes_wrote) % CLUSTER_SIZE;
+		size_t amount = CLUSTER_SIZE - left < count ? CLUSTER_SIZE - left : count;
+
+		//a cluster written over entirely need not be read
+		if(amount < CLUSTER_SIZE)
+		{
+			if(cluster_read(map, cluster, cluster_buf, 0, CLUSTER_SIZE) == -1)
+				break;
+			if(old_size < cluster_start + CLUSTER_SIZE)
+			{
+				size_t keep = old_size > cluster_start ? 
+					old_size - cluster_start : 0;
+				memset(cluster_buf + keep, 0, CLUSTER_SIZE - keep);
+			}
+		}
+		iov_gather(&cursor, cluster_buf + left, amount);
+		if(cluster_write(rootdirentry, map, cluster, cluster_buf) == -1) break;
+
+		bytes_wrote += amount;
+		count -= amount;
+	}
+	free(cluster_buf);
+
+	if(offset + bytes_wrote > old_size) 
+		rootdirentry->size_file_bytes = offset + bytes_wrote;
+
+	//metadata is written back once for the whole call
+	if(file_commit(rdir_index) == -1) return -1;
+
+	return bytes_wrote;
+}
+
+static int cluster_readv(int rdir_index, const struct iovec *iov, int iovcnt,
+	size_t offset, size_t count)
+{
+	//file_readv for compressed files, count is within the file
+	struct FileMap *map = rdir_map[rdir_index];
+	struct iov_cursor cursor = { iov, iovcnt, 0, 0 };
+
+	size_t bytes_read = 0;
+	uint8_t *cluster_buf = cluster_buf_alloc();
+	if(cluster_buf == NULL) return -1;
+	while(bytes_read < count)
+	{
+		size_t cluster = (offset + bytes_read) / CLUSTER_SIZE;
+		size_t left = (offset + bytes_read) % CLUSTER_SIZE;
+		size_t amount = CLUSTER_SIZE - left < count - bytes_read ? 
+			CLUSTER_SIZE - left : count - bytes_read;
+
+		if(cluster_read(map, cluster, cluster_buf, left, amount) == -1) break;
+		iov_scatter(&cursor, cluster_buf + left, amount);
+		bytes_read += amount;
+	}
+	free(cluster_buf);
+
+	return bytes_read > 0 || count == 0 ? (int)bytes_read : -1;
+}
+//---end of cluster helper functions
+
+static int file_writev(int rdir_index, const struct iovec *iov, int iovcnt,
+	size_t offset, struct ChainHint *hint)
+{
+	//shared by fs_write, fs_pwrite and fs_writev; rdir_index is the file's
+	//entry in root dir for changing file size if necessary
+	struct RootDirEntry *rootdirentry = &rootdir[rdir_index];
+	ssize_t count = iov_total(iov, iovcnt);
+	if(readonly || count == -1 || offset > FILE_SIZE_MAX) return -1;
+	//blks handed out by fs_map_blocks must keep their content
+	if(rdir_pin_count[rdir_index] > 0) return -1;
+	//no room for more, just like a full disk
+	if((size_t)count > FILE_SIZE_MAX - offset) count = FILE_SIZE_MAX - offset;
+	if(count == 0) return 0; //user input want to write nothing
+	if(rootdirentry->flags & FILE_COMPRESSED)
+		return cluster_writev(rdir_index, iov, iovcnt, offset, count);
+
+	//a packed tail the write reaches goes back to a blk of its own first
+	if(offset + count > rootdirentry->size_file_bytes / BLOCK_SIZE * 
+		BLOCK_SIZE && tail_unpack(rdir_index) == -1) return -1;
+
+	struct iov_cursor cursor = { iov, iovcnt, 0, 0 };
+
+	//starting past the blk after the last one leaves whole blks of hole,
+	//which a plain FAT chain cannot have
+	size_t old_size = rootdirentry->size_file_bytes;
+	//ceiling function from geeks for geeks
+	size_t old_blks = (old_size / BLOCK_SIZE) + ((old_size % BLOCK_SIZE) != 0);
+	bool chain_changed = false;
+	if(!(rootdirentry->flags & FILE_MAPPED) && offset / BLOCK_SIZE > old_blks)
+	{
+		if(map_convert(rdir_index) == -1) return 0;
+		chain_changed = true;
+	}
+
+	//only mapped files share blks, so with dedup on a write of whole blks
+	//switches the file over; a failure just leaves its blks unshared
+	size_t first_full_blk = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if(dedup_enabled && !(rootdirentry->flags & FILE_MAPPED) &&
+		(first_full_blk + 1) * BLOCK_SIZE <= offset + count)
+	{
+		chain_changed = true;
+		map_convert(rdir_index);
+	}
+
+	//starting past the end of file, the rest of the last blk is a hole too
+	struct BlkCursor blk_cursor;
+	if(offset > old_size && old_size % BLOCK_SIZE != 0)
+	{
+		blk_cursor_init(&blk_cursor, rdir_index, old_size / BLOCK_SIZE);
+		if(blk_cursor_zero_tail(&blk_cursor, old_size % BLOCK_SIZE) == -1)
+			return -1;
+		if(blk_cursor.map != NULL) chain_changed = true;
+	}
+
+	//move to the correct blk based on file's offset
+	blk_cursor_resume(&blk_cursor, rdir_index, offset / BLOCK_SIZE, hint);
+
+	//special case left index for writing first block
+	size_t left = offset % BLOCK_SIZE;
+	size_t amount_to_write_in_blk;
+	size_t bytes_wrote = 0;
+	//bounce buffer with index 0 to 4095
+	uint8_t bounce_buffer[BLOCK_SIZE];
+	while(count > 0)
+	{
+		if(left + count > BLOCK_SIZE)
+		{
+			amount_to_write_in_blk = BLOCK_SIZE - left;
+		}
+		else	//special case for writing last blk or total one blk
+		{
+			//write blk from index left or 0 up to remaining count bytes
+			amount_to_write_in_blk = count;
+		}
+
+		//we overwrite an entire block straight from the caller's buffer, a
+		//block spread over several iovecs is gathered first
+		const void *src = NULL;
+		bool zero_blk = false;
+		if(amount_to_write_in_blk == BLOCK_SIZE)
+		{
+			src = iov_contig(&cursor, BLOCK_SIZE);
+			if(src == NULL)
+			{
+				iov_gather(&cursor, bounce_buffer, BLOCK_SIZE);
+				src = bounce_buffer;
+			}
+			zero_blk = blk_is_zero(src);
+		}
+
+		//with dedup on, whole blks of a mapped file are indexed by content
+		uint32_t hash = 0;
+		if(dedup_enabled && src != NULL && !zero_blk && blk_cursor.map != NULL)
+			hash = dedup_hash_blk(src);
+		uint32_t old_data_blk = blk_cursor.data_blk;
+
+		//a mapped file keeps a blk of zeros as a hole, nothing to write
+		if(zero_blk && blk_cursor.map != NULL)
+		{
+			if(blk_cursor.data_blk != 0) chain_changed = true;
+			blk_cursor_punch(&blk_cursor);
+		}
+		//nor does it write a blk whose content is on disk already
+		else if(hash != 0 && blk_cursor_dedup(&blk_cursor, src, hash))
+		{
+			if(blk_cursor.data_blk != old_data_blk) chain_changed = true;
+		}
+		else
+		{
+			//allocate blks as the write runs past the end of the chain or
+			//into a hole
+			bool new_blk = false;
+			bool old_read = false;
+			if(blk_cursor.data_blk == 0)
+			{
+				//even a failed allocation may have added map blks
+				chain_changed = true;
+				if(blk_cursor_alloc(&blk_cursor) == 0) break; //no more blocks
+				new_blk = true;
+			}
+			else if(refcnt_get(blk_cursor.data_blk) > 0)
+			{
+				//a blk shared with clones is copied before it is written
+				chain_changed = true;
+				old_read = src == NULL;
+				if(blk_cursor_unshare(&blk_cursor, 
+					old_read ? bounce_buffer : NULL) == -1) break;
+			}
+
+			size_t blk = superblock->data_blk_start_index + blk_cursor.data_blk;
+			if(src == NULL)
+			{
+				//for writing the first and last block, there are cases when
+				//we want to retain information that is already written to it
+				//because we dont want to overwrite the entire block. EX: file
+				//size 4096 and offset is at middle of file and we write 1
+				//byte. Only that 1 byte should change in the file's contents
+				//and nothing else.
+				//a blk we just allocated has nothing worth keeping
+				if(new_blk)
+					memset(bounce_buffer, 0, BLOCK_SIZE);
+				else if(!old_read && block_read(blk, bounce_buffer) == -1)
+					break;
+				iov_gather(&cursor, bounce_buffer + left, amount_to_write_in_blk);
+				src = bounce_buffer;
+			}
+
+			//the blk no longer holds what it was indexed under
+			pthread_mutex_lock(&alloc_lock);
+			dedup_forget(blk_cursor.data_blk);
+			pthread_mutex_unlock(&alloc_lock);
+
+			//punching a blk of zeros out of the image beats writing it
+			if(!(zero_blk && discard_enabled && block_discard(blk, 1) == 0) &&
+				block_write(blk, src) == -1) break;
+
+			if(hash != 0)
+			{
+				pthread_mutex_lock(&alloc_lock);
+				dedup_insert(blk_cursor.data_blk, hash);
+				pthread_mutex_unlock(&alloc_lock);
+			}
+		}
+
+		bytes_wrote += amount_to_write_in_blk;
+		count -= amount_to_write_in_blk;
+
+		//move to writing next blk
+		blk_cursor_hint(&blk_cursor, hint);
+		blk_cursor_next(&blk_cursor);
+
+		left = 0; //for subsequent blks other than first blk, start at index 0
+	}
+
+	//Example: file size 1 and offset currently at 0
+	//write 1 byte wont change size but write 2 byte will change size
+	//a write that stopped before offset leaves the size alone
+	bool size_changed = bytes_wrote > 0 &&
+		offset + bytes_wrote > rootdirentry->size_file_bytes;
+	if(size_changed) rootdirentry->size_file_bytes = offset + bytes_wrote;
+
+	//metadata is written back once for the whole call
+	if((chain_changed || size_changed) && file_commit(rdir_index) == -1)
+		return -1;
+
+	return bytes_wrote;
+}
+
+static int file_write(int rdir_index, const void *buf, size_t count,
+	size_t offset, struct ChainHint *hint)
+{
+	struct iovec iov = { (void*)buf, count };
+
+	return file_writev(rdir_index, &iov, 1, offset, hint);
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	//validation
+	if (!fd_is_open(fd) || buf == NULL) return -1;
+
+	pthread_rwlock_wrlock(&io_lock);
+	int bytes_wrote = file_write(fdtable[fd].rdir_index, buf, count,
+		fdtable[fd].offset, &fdtable[fd].hint);
+	pthread_rwlock_unlock(&io_lock);
+	if(bytes_wrote > 0) fdtable[fd].offset += bytes_wrote;
+
+	return bytes_wrote;
+}
+
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset)
+{
+	//validation
+	if (!fd_is_open(fd) || buf == NULL) return -1;
+
+	//same rule as fs_lseek for where writing may start, against the size
+	//no other write is changing; the fd's offset is left alone
+	pthread_rwlock_wrlock(&io_lock);
+	int bytes_wrote = -1;
+	if(offset <= (sparse_enabled ? FILE_SIZE_MAX : (size_t)fs_stat(fd)))
+	{
+		bytes_wrote = file_write(fdtable[fd].rdir_index, buf, count, offset, 
+			&fdtable[fd].hint);
+	}
+	pthread_rwlock_unlock(&io_lock);
+
+	return bytes_wrote;
+}
+
+
+static int file_readv(int rdir_index, const struct iovec *iov, int iovcnt,
+	size_t offset, struct ChainHint *hint)
+{
+	//shared by fs_read, fs_pread and fs_readv
+	ssize_t count = iov_total(iov, iovcnt);
+	if(count == -1) return -1;
+	if(count == 0) return 0; //user input want to read nothing
+
+	//prep
+	uint32_t file_size = rootdir[rdir_index].size_file_bytes;
+
+	if(file_size == 0) return 0; //nothing to read for a empty file
+
+	//Example: file size 1 then should only read index 0
+	//read nothing if offset is set beyond file's contents
+	//...user should be writing instead to extend the file
+	if(offset + 1 > file_size)	return 0;
+
+	//Example: file size 1 then should only read index 0
+	//reduce count to readable number of bytes left
+	//if count > readable number of bytes left
+	//file_size - offset is readable number of bytes left
+	if((size_t)count > file_size - offset) count = file_size - offset;
+	if((rootdir[rdir_index].flags & FILE_COMPRESSED) && 
+		rdir_map[rdir_index] != NULL)
+		return cluster_readv(rdir_index, iov, iovcnt, offset, count);
+
+	struct iov_cursor cursor = { iov, iovcnt, 0, 0 };
+	//the blk a packed tail would be in
+	size_t tail_lblk = (rootdir[rdir_index].flags & FILE_PACKED) ? 
+		file_size / BLOCK_SIZE : SIZE_MAX;
+
+	//otherwise, valid for reading so
+	//move to the correct blk based on file's offset
+	struct BlkCursor blk_cursor;
+	blk_cursor_resume(&blk_cursor, rdir_index, offset / BLOCK_SIZE, hint);
+	//special case left index for reading first block
+	size_t left = offset % BLOCK_SIZE;
+	size_t amount_to_read_in_blk;
+	size_t bytes_read = 0;
+	//bounce buffer with index 0 to 4095
+	uint8_t bounce_buffer[BLOCK_SIZE];
+	while(count > 0)	//while not done reading
+	{
+		if(left + count > BLOCK_SIZE)
+		{
+			amount_to_read_in_blk = BLOCK_SIZE - left;
+		}
+		else	//special case for reading last blk or total one blk
+		{
+			//read blk from index left or 0 up to remaining count bytes
+			amount_to_read_in_blk = count;
+		}
+
+		size_t blk = superblock->data_blk_start_index + blk_cursor.data_blk;
+		void *direct = NULL;
+		if(amount_to_read_in_blk == BLOCK_SIZE)
+			direct = iov_contig(&cursor, BLOCK_SIZE);
+		//otherwise for cases where we only want to read subset of the first
+		//block and last block, or a block spread over several iovecs
+		void *dst = direct != NULL ? direct : bounce_buffer;
+		int ret = 0;
+		if(blk_cursor.lblk == tail_lblk)
+			ret = tail_read(&rootdir[rdir_index], dst);
+		else if(blk_cursor.data_blk == 0)
+			memset(dst, 0, BLOCK_SIZE);	//holes read as zeros, no disk access
+		else
+			ret = block_read(blk, dst);
+		//stop at the first blk that cannot be read, what came before it is
+		//what was read
+		if(ret == -1) break;
+		if(direct == NULL)
+			iov_scatter(&cursor, bounce_buffer + left, amount_to_read_in_blk);
+
+		count -= amount_to_read_in_blk;
+		bytes_read += amount_to_read_in_blk;
+
+		//move to reading next blk
+		blk_cursor_hint(&blk_cursor, hint);
+		blk_cursor_next(&blk_cursor);
+
+		left = 0; //for subsequent blks other than first blk, start at index 0
+	}
+
+	return bytes_read > 0 ? (int)bytes_read : -1;
+}
+
+static int file_read(int rdir_index, void *buf, size_t count, size_t offset,
+	struct ChainHint *hint)
+{
+	struct iovec iov = { buf, count };
+
+	return file_readv(rdir_index, &iov, 1, offset, hint);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	//validation
+	if (!fd_is_open(fd) || buf == NULL) return -1;
+
+	pthread_rwlock_rdlock(&io_lock);
+	int bytes_read = file_read(fdtable[fd].rdir_index, buf, count,
+		fdtable[fd].offset, &fdtable[fd].hint);
+	pthread_rwlock_unlock(&io_lock);
+	if(bytes_read > 0) fdtable[fd].offset += bytes_read;
+
+	return bytes_read;
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	//validation
+	if (!fd_is_open(fd) || buf == NULL) return -1;
+
+	//the fd's offset and chain hint are left alone, so that threads can
+	//share the fd
+	pthread_rwlock_rdlock(&io_lock);
+	int bytes_read = file_read(fdtable[fd].rdir_index, buf, count, offset, 
+		NULL);
+	pthread_rwlock_unlock(&io_lock);
+
+	return bytes_read;
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	//validation
+	if (!fd_is_open(fd)) return -1;
+
+	pthread_rwlock_wrlock(&io_lock);
+	int bytes_wrote = file_writev(fdtable[fd].rdir_index, iov, iovcnt,
+		fdtable[fd].offset, &fdtable[fd].hint);
+	pthread_rwlock_unlock(&io_lock);
+	if(bytes_wrote > 0) fdtable[fd].offset += bytes_wrote;
+
+	return bytes_wrote;
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	//validation
+	if (!fd_is_open(fd)) return -1;
+
+	pthread_rwlock_rdlock(&io_lock);
+	int bytes_read = file_readv(fdtable[fd].rdir_index, iov, iovcnt,
+		fdtable[fd].offset, &fdtable[fd].hint);
+	pthread_rwlock_unlock(&io_lock);
+	if(bytes_read > 0) fdtable[fd].offset += bytes_read;
+
+	return bytes_read;
+}
+
+//---start of sendfile helper functions
+static size_t send_write(int out_fd, const uint8_t *buf, size_t len)
+{
+	//bytes of buf the host file took before it failed, if it did
+	size_t done = 0;
+	while(done < len)
+	{
+		ssize_t n = write(out_fd, buf + done, len - done);
+		if(n <= 0) break;
+		done += n;
+	}
+	return done;
+}
+
+static size_t send_copy(int rdir_index, uint32_t data_blk, bool tail, 
+	size_t left, size_t len, int out_fd, uint8_t *buf)
+{
+	//send a run the host cannot send itself through buf, up to a cluster of
+	//blks at a time; data_blk 0 is a run of holes
+	size_t done = 0;
+	while(done < len)
+	{
+		size_t lblk = (left + done) / BLOCK_SIZE;
+		size_t from = (left + done) % BLOCK_SIZE;
+		size_t amount = CLUSTER_SIZE - from < len - done ? 
+			CLUSTER_SIZE - from : len - done;
+		size_t num_blks = (from + amount + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+		if(tail)
+			tail_read(&rootdir[rdir_index], buf);
+		else if(data_blk == 0)
+			memset(buf, 0, num_blks * BLOCK_SIZE);
+		else if(block_read_run(superblock->data_blk_start_index + data_blk + 
+			lblk, buf, num_blks) == -1) break;
+
+		size_t sent = send_write(out_fd, buf + from, amount);
+		done += sent;
+		if(sent < amount) break;
+	}
+	return done;
+}
+
+static size_t send_clusters(int rdir_index, size_t offset, size_t count, 
+	int out_fd, uint8_t *buf)
+{
+	//compressed files can only be sent once decompressed, a cluster at a time
+	size_t done = 0;
+	while(done < count)
+	{
+		size_t amount = CLUSTER_SIZE - (offset + done) % CLUSTER_SIZE;
+		if(amount > count - done) amount = count - done;
+
+		int n = file_read(rdir_index, buf, amount, offset + done, NULL);
+		if(n <= 0) break;
+		size_t sent = send_write(out_fd, buf, n);
+		done += sent;
+		if(sent < (size_t)n) break;
+	}
+	return done;
+}
+//---end of sendfile helper functions
+
+int fs_sendfile(int fd, int out_fd, size_t count)
+{
+	//validation
+	if (!fd_is_open(fd)) return -1;
+
+	int rdir_index = fdtable[fd].rdir_index;
+	size_t offset = fdtable[fd].offset;
+	uint32_t file_size = rootdir[rdir_index].size_file_bytes;
+	if(count == 0 || offset >= file_size) return 0;
+	if(count > file_size - offset) count = file_size - offset;
+
+	size_t sent = 0;
+	uint8_t *bounce_buffer = malloc(CLUSTER_SIZE);
+	if(bounce_buffer == NULL) return -1;
+	if((rootdir[rdir_index].flags & FILE_COMPRESSED) && 
+		rdir_map[rdir_index] != NULL)
+	{
+		sent = send_clusters(rdir_index, offset, count, out_fd, bounce_buffer);
+		free(bounce_buffer);
+		fdtable[fd].offset += sent;
+		return sent > 0 ? (int)sent : -1;
+	}
+
+	//the blk a packed tail would be in
+	size_t tail_lblk = (rootdir[rdir_index].flags & FILE_PACKED) ? 
+		file_size / BLOCK_SIZE : SIZE_MAX;
+	struct ChainHint *hint = &fdtable[fd].hint;
+	struct BlkCursor blk_cursor;
+	blk_cursor_resume(&blk_cursor, rdir_index, offset / BLOCK_SIZE, hint);
+	size_t left = offset % BLOCK_SIZE;
+	bool direct = true;	//until the host says it cannot send to out_fd
+	while(sent < count)
+	{
+		//a whole run goes out in one call
+		uint32_t first_data_blk = blk_cursor.data_blk;
+		bool tail = blk_cursor.lblk == tail_lblk;
+		size_t len = blk_cursor_run(&blk_cursor, tail_lblk, left, 
+			count - sent, hint);
+
+		//data blks go from the disk to out_fd without a copy in between
+		ssize_t done = -1;
+		if(direct && !tail && first_data_blk != 0)
+		{
+			done = block_send(out_fd, superblock->data_blk_start_index + 
+				first_data_blk, left, len);
+			if(done == -1) direct = false;
+		}
+		if(done == -1)
+			done = send_copy(rdir_index, first_data_blk, tail, left, len, 
+				out_fd, bounce_buffer);
+
+		sent += done;
+		if((size_t)done < len) break;
+		left = 0;
+	}
+	free(bounce_buffer);
+
+	fdtable[fd].offset += sent;
+	return sent > 0 ? (int)sent : -1;
+}
+
+int fs_map_blocks(int fd, size_t offset, size_t count, 
+	struct fs_block_run *runs, int max_runs)
+{
+	//validation, compressed clusters are not stored the way they read
+	if(!fd_is_open(fd) || runs == NULL || max_runs <= 0) return -1;
+	int rdir_index = fdtable[fd].rdir_index;
+	if(((rootdir[rdir_index].flags & FILE_COMPRESSED) && 
+		rdir_map[rdir_index] != NULL) || 
+		rdir_pin_count[rdir_index] == UINT16_MAX) return -1;
+
+	uint32_t file_size = rootdir[rdir_index].size_file_bytes;
+	if(count == 0 || offset >= file_size) return 0;
+	if(count > file_size - offset) count = file_size - offset;
+
+	//the blk a packed tail would be in
+	size_t tail_lblk = (rootdir[rdir_index].flags & FILE_PACKED) ? 
+		file_size / BLOCK_SIZE : SIZE_MAX;
+	struct BlkCursor blk_cursor;
+	blk_cursor_resume(&blk_cursor, rdir_index, offset / BLOCK_SIZE, 
+		&fdtable[fd].hint);
+	size_t left = offset % BLOCK_SIZE;
+	size_t done = 0;
+	int num_runs = 0;
+	for(; done < count && num_runs < max_runs; num_runs++)
+	{
+		struct fs_block_run *run = &runs[num_runs];
+		run->offset = offset + done;
+		run->block = 0;	//a hole is on no blk
+		run->block_offset = 0;
+		if(blk_cursor.lblk == tail_lblk)
+		{
+			run->block = superblock->data_blk_start_index + 
+				rootdir[rdir_index].tail_blk;
+			run->block_offset = rootdir[rdir_index].tail_offset + left;
+		}
+		else if(blk_cursor.data_blk != 0)
+		{
+			run->block = superblock->data_blk_start_index + 
+				blk_cursor.data_blk;
+			run->block_offset = left;
+		}
+		//the fd's hint is only read, like fs_pread
+		run->length = blk_cursor_run(&blk_cursor, tail_lblk, left, 
+			count - done, NULL);
+		const uint8_t *addr = run->block != 0 ? block_addr(run->block) : NULL;
+		run->data = addr != NULL ? addr + run->block_offset : NULL;
+
+		done += run->length;
+		left = 0;
+	}
+
+	//nothing in the runs may move or change until they are released
+	fdtable[fd].pins++;
+	rdir_pin_count[rdir_index]++;
+
+	return num_runs;
+}
+
+int fs_release_blocks(int fd)
+{
+	//validation
+	if(!fd_is_open(fd) || fdtable[fd].pins == 0) return -1;
+
+	fdtable[fd].pins--;
+	rdir_pin_count[fdtable[fd].rdir_index]--;
+
+	return 0;
+}
+
+//---start of truncate helper functions
+static int file_extend(int rdir_index, size_t length)
+{
+	//grow the file to length bytes with a hole, no data blk is allocated
+	struct RootDirEntry *rootdirentry = &rootdir[rdir_index];
+	if(!sparse_enabled || length > FILE_SIZE_MAX) return -1;
+
+	size_t size = rootdirentry->size_file_bytes;
+	//ceiling function from geeks for geeks
+	size_t blocks_have = (size / BLOCK_SIZE) + ((size % BLOCK_SIZE) != 0);
+	size_t blocks_need = (length / BLOCK_SIZE) + ((length % BLOCK_SIZE) != 0);
+	if(!(rootdirentry->flags & FILE_MAPPED) && blocks_need > blocks_have)
+	{
+		if(map_convert(rdir_index) == -1) return -1;
+	}
+
+	//the rest of the last blk is part of the file now, compressed files
+	//keep it zeroed all along
+	if(size % BLOCK_SIZE != 0 && !(rootdirentry->flags & FILE_COMPRESSED))
+	{
+		struct BlkCursor blk_cursor;
+		blk_cursor_init(&blk_cursor, rdir_index, size / BLOCK_SIZE);
+		if(blk_cursor_zero_tail(&blk_cursor, size % BLOCK_SIZE) == -1)
+			return -1;
+	}
+
+	rootdirentry->size_file_bytes = length;
+
+	return file_commit(rdir_index);
+}
+
+static uint32_t map_shrink(int rdir_index, size_t blocks_keep)
+{
+	//drop the data blks of a mapped file past its first blocks_keep, freed
+	//by map_flush, and cut off the map blks nothing is left in; caller holds
+	//alloc_lock
+	//returns the first map blk cut off, FAT_EOC if none
+	struct RootDirEntry *rootdirentry = &rootdir[rdir_index];
+	struct FileMap *map = rdir_map[rdir_index];
+	for(size_t lblk = blocks_keep; lblk < map->num_map_blks *
+		MAP_ENTRIES_PER_BLK; lblk++)
+	{
+		if(map->data_blk[lblk] == MAP_HOLE) continue;
+		if(map->data_blk[lblk] < superblock->num_data_blks)
+			map_release(map, map->data_blk[lblk]);
+		map->data_blk[lblk] = MAP_HOLE;
+		map->dirty[lblk / MAP_ENTRIES_PER_BLK] = 1;
+	}
+
+	//ceiling function from geeks for geeks
+	size_t map_keep = (blocks_keep / MAP_ENTRIES_PER_BLK) +
+		((blocks_keep % MAP_ENTRIES_PER_BLK) != 0);
+	if(map_keep >= map->num_map_blks) return FAT_EOC;
+
+	uint32_t index_tail_map_blk = map->map_blk[map_keep];
+	if(map_keep == 0)
+		rootdirentry->index_first_data_blk = FAT_EOC;
+	else
+		fat_set(map->map_blk[map_keep - 1], FAT_EOC);
+	map->num_map_blks = map_keep;
+
+	return index_tail_map_blk;
+}
+
+static int file_cut(int rdir_index, size_t blocks_keep)
+{
+	//release the blks of a file past its first blocks_keep; the FAT and map
+	//are written back, root dir is left to the caller
+	struct RootDirEntry *rootdirentry = &rootdir[rdir_index];
+	pthread_mutex_lock(&alloc_lock);
+	uint32_t index_tail_data_blk;
+	if(rootdirentry->flags & FILE_MAPPED)
+	{
+		index_tail_data_blk = map_shrink(rdir_index, blocks_keep);
+	}
+	else if(blocks_keep == 0)
+	{
+		//nothing left, the file is empty again
+		index_tail_data_blk = rootdirentry->index_first_data_blk;
+		rootdirentry->index_first_data_blk = FAT_EOC;
+	}
+	else
+	{
+		//cut the chain after the last blk we keep
+		uint32_t index_last_data_blk = index_data_blk(
+			rootdirentry->index_first_data_blk, (blocks_keep - 1) * BLOCK_SIZE);
+		index_tail_data_blk = fat_get(index_last_data_blk);
+		if(index_tail_data_blk != FAT_EOC)
+			fat_set(index_last_data_blk, FAT_EOC);
+	}
+	pthread_mutex_unlock(&alloc_lock);
+
+	//the map must stop listing the freed data blks before the FAT says so
+	if(rdir_map[rdir_index] != NULL && map_flush(rdir_map[rdir_index]) == -1)
+		return -1;
+
+	//the whole tail is released as one chain, like a deleted file
+	pthread_mutex_lock(&alloc_lock);
+	reclaim_push(index_tail_data_blk, false);
+	int ret = fat_flush();
+	pthread_mutex_unlock(&alloc_lock);
+	if(ret == -1) return -1;
+
+	//an empty mapped file has no map blk left, it goes back to a plain chain
+	if(blocks_keep == 0 && (rootdirentry->flags & FILE_MAPPED))
+	{
+		rootdirentry->flags &= ~FILE_MAPPED;
+		map_free(rdir_map[rdir_index]);
+		rdir_map[rdir_index] = NULL;
+	}
+
+	return 0;
+}
+
+static int file_truncate(int rdir_index, size_t length)
+{
+	//shrink the file to length bytes, releasing the blks past the new end
+	struct RootDirEntry *rootdirentry = &rootdir[rdir_index];
+	if(length == rootdirentry->size_file_bytes) return 0;
+	if(readonly || rdir_pin_count[rdir_index] > 0) return -1;	//see file_writev
+	//the length of a packed tail follows the size, it cannot change in place
+	if(tail_unpack(rdir_index) == -1) return -1;
+	if(length > rootdirentry->size_file_bytes)
+		return file_extend(rdir_index, length);
+
+	//ceiling function from geeks for geeks
+	size_t blocks_keep = (length / BLOCK_SIZE) + ((length % BLOCK_SIZE) != 0);
+
+	//a crash before the tail is freed leaves it to the orphan sweep
+	if(sb_mark_reclaim_pending() == -1) return -1;
+
+	//a compressed file is cut between clusters, the cluster holding the new
+	//end of file is stored again first
+	bool compressed = (rootdirentry->flags & FILE_COMPRESSED) && 
+		rdir_map[rdir_index] != NULL;
+	if(compressed)
+	{
+		if(length % CLUSTER_SIZE != 0 && cluster_trim(rdir_index, length) == -1)
+			return -1;
+		blocks_keep = ((length / CLUSTER_SIZE) + 
+			((length % CLUSTER_SIZE) != 0)) * CLUSTER_BLKS;
+	}
+
+	//bytes past the new end of the last blk must read back as zeros if the
+	//file grows over them again
+	if(length % BLOCK_SIZE != 0 && !compressed)
+	{
+		struct BlkCursor blk_cursor;
+		blk_cursor_init(&blk_cursor, rdir_index, blocks_keep - 1);
+		if(blk_cursor_zero_tail(&blk_cursor, length % BLOCK_SIZE) == -1)
+			return -1;
+	}
+
+	if(file_cut(rdir_index, blocks_keep) == -1) return -1;
+	rootdirentry->size_file_bytes = length;
+
+	//write back root dir
+	return rdir_write();
+}
+//---end of truncate helper functions
+
+//---start of tail packing helper functions
+static int tail_store(struct RootDirEntry *rootdirentry, const void *buf,
+	size_t tail_len)
+{
+	//write the first tail_len bytes of buf to a pack blk and point the entry
+	//to them; the caller sets FILE_PACKED once the rest is in place
+	uint16_t tail_offset = 0;
+	pthread_mutex_lock(&pack_lock);
+	uint32_t pack_blk = pack_find(tail_len, &tail_offset);
+	pthread_mutex_unlock(&pack_lock);
+	bool fresh = pack_blk == 0;
+	if(fresh)
+	{
+		//no room left anywhere, start a new pack blk
+		pack_blk = allocate_new_data_blk(FAT_EOC);
+		if(pack_blk == 0) return -1;
+	}
+
+	//readers may have loaded another pack blk in between
+	pthread_mutex_lock(&pack_lock);
+	int ret = 0;
+	if(fresh)
+	{
+		memset(pack_cache, 0, BLOCK_SIZE);
+		pack_cache_blk = pack_blk;
+	}
+	else
+	{
+		ret = pack_load(pack_blk);
+	}
+	if(ret == 0)
+	{
+		memcpy(pack_cache + tail_offset, buf, tail_len);
+		rootdirentry->tail_blk = pack_blk;
+		rootdirentry->tail_offset = tail_offset;
+		ret = block_write(superblock->data_blk_start_index + pack_blk, 
+			pack_cache);
+		if(ret == -1) pack_cache_blk = 0;
+	}
+	pthread_mutex_unlock(&pack_lock);
+	if(ret == -1 && fresh)
+	{
+		pthread_mutex_lock(&alloc_lock);
+		pack_blk_put(pack_blk);
+		pthread_mutex_unlock(&alloc_lock);
+	}
+
+	return ret;
+}
+
+static int tail_pack(int rdir_index)
+{
+	//move the last partial blk of a file nobody has open to a pack blk; only
+	//root dir entries are scanned for the tails in a pack blk
+	struct RootDirEntry *rootdirentry = &rootdir[rdir_index];
+	size_t size = rootdirentry->size_file_bytes;
+	size_t tail_len = size % BLOCK_SIZE;
+	if(!pack_enabled || rdir_index >= FS_FILE_MAX_COUNT || tail_len == 0 || 
+		tail_len > PACK_TAIL_MAX ||
+		(rootdirentry->flags & (FILE_PACKED | FILE_COMPRESSED))) return 0;
+
+	struct BlkCursor blk_cursor;
+	blk_cursor_init(&blk_cursor, rdir_index, size / BLOCK_SIZE);
+	if(blk_cursor.data_blk == 0) return 0;	//a hole costs nothing already
+	uint8_t bounce_buffer[BLOCK_SIZE];
+	if(block_read(superblock->data_blk_start_index + blk_cursor.data_blk,
+		bounce_buffer) == -1) return -1;
+
+	//a crash before the old blk is freed leaves it to the orphan sweep
+	if(sb_mark_reclaim_pending() == -1) return -1;
+	if(tail_store(rootdirentry, bounce_buffer, tail_len) == -1) return -1;
+
+	//the packed tail is on disk before the blk it replaces is let go, reads
+	//skip that blk from then on
+	rootdirentry->flags |= FILE_PACKED;
+	if(rdir_write() == -1) return -1;
+	if(file_cut(rdir_index, size / BLOCK_SIZE) == -1) return -1;
+
+	return rdir_write();
+}
+
+static int tail_unpack(int rdir_index)
+{
+	//give a packed tail a data blk of its own again, before the file changes
+	struct RootDirEntry *rootdirentry = &rootdir[rdir_index];
+	if(!(rootdirentry->flags & FILE_PACKED)) return 0;
+	//a pinned tail stays where fs_map_blocks said it is
+	if(rdir_pin_count[rdir_index] > 0) return -1;
+
+	uint8_t bounce_buffer[BLOCK_SIZE];
+	if(tail_read(rootdirentry, bounce_buffer) == -1) return -1;
+
+	//the blk the tail left may still be there if tail_pack did not finish
+	struct BlkCursor blk_cursor;
+	blk_cursor_init(&blk_cursor, rdir_index, 
+		rootdirentry->size_file_bytes / BLOCK_SIZE);
+	if(blk_cursor.data_blk == 0)
+	{
+		if(blk_cursor_alloc(&blk_cursor) == 0) return -1;
 	}
-	
-	//move to the correct blk based on file's offset
-	uint16_t file_data_blk_idex = 
-		index_data_blk(rootdirentry->index_first_data_blk, offset);	
-	//not enough blocks allocated to write starting from offset
-	if(file_data_blk_idex == FAT_EOC) return 0;
-	//special case left index for writing first block
-	int left = offset % BLOCK_SIZE;
-	int amount_to_write_in_blk;
-	size_t bytes_wrote = 0;
-	//bounce buffer with index 0 to 4095
+	else if(refcnt_get(blk_cursor.data_blk) > 0)
+	{
+		if(blk_cursor_unshare(&blk_cursor, NULL) == -1) return -1;
+	}
+	pthread_mutex_lock(&alloc_lock);
+	dedup_forget(blk_cursor.data_blk);
+	pthread_mutex_unlock(&alloc_lock);
+	if(block_write(superblock->data_blk_start_index + blk_cursor.data_blk,
+		bounce_buffer) == -1) return -1;
+
+	//the pack blk is freed with its last tail, once root dir says so
+	if(sb_mark_reclaim_pending() == -1) return -1;
+	rootdirentry->flags &= ~FILE_PACKED;
+	if(file_commit(rdir_index) == -1) return -1;
+	pthread_mutex_lock(&alloc_lock);
+	pack_blk_put(rootdirentry->tail_blk);
+	pthread_mutex_unlock(&alloc_lock);
+
+	return 0;
+}
+
+static int tail_copy(const struct RootDirEntry *src, struct RootDirEntry *dst)
+{
+	//give dst a packed tail of its own with the content of src's
+	if(!(src->flags & FILE_PACKED)) return 0;
+
 	uint8_t bounce_buffer[BLOCK_SIZE];
-	while(file_data_blk_idex != FAT_EOC && count > 0)
+	if(tail_read(src, bounce_buffer) == -1) return -1;
+
+	return tail_store(dst, bounce_buffer, src->size_file_bytes % BLOCK_SIZE);
+}
+//---end of tail packing helper functions
+
+int fs_ftruncate(int fd, size_t length)
+{
+	//validation
+	if(!fd_is_open(fd)) return -1;
+
+	int rdir_index = fdtable[fd].rdir_index;
+	if(file_truncate(rdir_index, length) == -1) return -1;
+
+	//no fd may point past the end of the file, pull them back
+	for(int i = 0; i < fdtable_size && rdir_open_count[rdir_index] > 1; i++)
 	{
-		if(left + count > BLOCK_SIZE)
+		if(fdtable[i].rdir_index == rdir_index && fdtable[i].offset > length)
+			fdtable[i].offset = length;
+	}
+	if(fdtable[fd].offset > length) fdtable[fd].offset = length;
+
+	return 0;
+}
+
+int fs_truncate(const char *filename, size_t length)
+{
+	if(!fsmounted || filename == NULL) return -1;
+
+	//find file in its directory
+	int rdir_index = path_lookup(filename);
+	if(rdir_index == -1) return -1;
+
+	//the file need not be open, borrow its map for the call
+	int ret = -1;
+	if(!(rootdir[rdir_index].flags & FILE_DIR) && map_load(rdir_index) == 0)
+	{
+		ret = file_truncate(rdir_index, length);
+		//nobody has it open to pack the tail on close
+		if(ret == 0 && rdir_open_count[rdir_index] == 0) 
+			tail_pack(rdir_index);
+		map_unload(rdir_index);
+	}
+
+	//same as fs_ftruncate for the fds that have this file open
+	for(int i = 0; ret == 0 && i < fdtable_size && 
+		rdir_open_count[rdir_index] > 0; i++)
+	{
+		if(fdtable[i].rdir_index == rdir_index && fdtable[i].offset > length)
+			fdtable[i].offset = length;
+	}
+	entry_put(rdir_index);
+
+	return ret;
+}
+
+//---start of clone helper functions
+static int clone_map(int src_rdir_index, int dst_rdir_index)
+{
+	//give the destination a map of its own listing the source's data blks
+	struct FileMap *src_map = rdir_map[src_rdir_index];
+	size_t num_entries = src_map->num_map_blks * MAP_ENTRIES_PER_BLK;
+
+	//a blk with as many owners as a count can hold cannot take one more
+	for(size_t lblk = 0; lblk < num_entries; lblk++)
+	{
+		uint32_t data_blk = map_get(src_map, lblk);
+		if(data_blk != MAP_HOLE && refcnt_get(data_blk) == UINT16_MAX) 
+			return -1;
+	}
+
+	struct FileMap *dst_map = calloc(1, sizeof(struct FileMap));
+	if(dst_map == NULL) return -1;
+	struct RootDirEntry *dst = &rootdir[dst_rdir_index];
+	dst->index_first_data_blk = FAT_EOC;
+	if(map_grow(dst, dst_map, src_map->num_map_blks) == -1)
+	{
+		pthread_mutex_lock(&alloc_lock);
+		reclaim_push(dst->index_first_data_blk, false);
+		pthread_mutex_unlock(&alloc_lock);
+		map_free(dst_map);
+		return -1;
+	}
+
+	//every blk listed gains an owner, no data is copied
+	pthread_mutex_lock(&alloc_lock);
+	for(size_t lblk = 0; lblk < num_entries; lblk++)
+	{
+		uint32_t data_blk = map_get(src_map, lblk);
+		dst_map->data_blk[lblk] = data_blk;
+		if(data_blk != MAP_HOLE) 
+			refcnt_set(data_blk, refcnt_get(data_blk) + 1);
+		else if(src_map->data_blk[lblk] == MAP_COMPRESSED)
+			dst_map->data_blk[lblk] = MAP_COMPRESSED;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+
+	int ret = map_flush(dst_map);
+	map_free(dst_map);
+
+	return ret;
+}
+
+static int dst_create(int src_rdir_index, const char *dst_filename)
+{
+	//empty entry for the destination of a clone or a copy, loaded with a
+	//reference taken; -1 if the source is a directory or dst_filename exists
+	char name[FS_FILENAME_LEN];
+	int dir_index;
+	if((rootdir[src_rdir_index].flags & FILE_DIR) || 
+		!path_parent(dst_filename, &dir_index, name)) return -1;
+
+	int rdir_index = entry_get(dir_index, name);
+	int ret = -1;
+	if(rdir_index == -1)
+	{
+		struct RootDirEntry entry;
+		memset(&entry, 0, sizeof(struct RootDirEntry));
+		strcpy((char*)entry.filename, name);
+		entry.index_first_data_blk = FAT_EOC;
+		ret = entry_add(dir_index, &entry);
+	}
+	entry_put(rdir_index);
+	entry_put(dir_index);
+
+	return ret;
+}
+
+static void dst_discard(int dst_rdir_index)
+{
+	//take back the destination of a clone or a copy that failed
+	entry_remove(dst_rdir_index);
+	rdir_write();
+	entry_put(dst_rdir_index);
+}
+//---end of clone helper functions
+
+int fs_clone(const char *src_filename, const char *dst_filename)
+{
+	if(!fsmounted || readonly || src_filename == NULL || dst_filename == NULL) return -1;
+
+	//the source must exist and the destination must not
+	int src_rdir_index = path_lookup(src_filename);
+	if(src_rdir_index == -1) return -1;
+	int dst_rdir_index = dst_create(src_rdir_index, dst_filename);
+	if(dst_rdir_index == -1)
+	{
+		entry_put(src_rdir_index);
+		return -1;
+	}
+
+	//a crash halfway through leaves the reference counts to the orphan sweep
+	int ret = sb_mark_reclaim_pending();
+
+	struct RootDirEntry *src = &rootdir[src_rdir_index];
+	struct RootDirEntry *dst = &rootdir[dst_rdir_index];
+	//blks can only be shared between mapped files, the source is switched
+	//over if it is a plain chain
+	if(ret == 0) ret = map_load(src_rdir_index);
+	//tails are only packed in the root dir, elsewhere the source's tail
+	//gets a blk of its own first and is shared like the others
+	if(ret == 0 && dst_rdir_index >= FS_FILE_MAX_COUNT) 
+		ret = tail_unpack(src_rdir_index);
+	bool has_blks = src->index_first_data_blk != FAT_EOC;
+	if(ret == 0 && has_blks && refcnt_table.entries == NULL) 
+		ret = refcnt_create();
+	//a packed tail is not in the map, it is copied
+	if(ret == 0) ret = tail_copy(src, dst);
+	bool tail_copied = ret == 0 && (src->flags & FILE_PACKED);
+	if(ret == 0 && has_blks && !(src->flags & FILE_MAPPED))
+		ret = map_convert(src_rdir_index);
+	if(ret == 0 && has_blks)
+		ret = clone_map(src_rdir_index, dst_rdir_index);
+	if(ret == 0)
+	{
+		if(!has_blks) dst->index_first_data_blk = FAT_EOC;
+		dst->size_file_bytes = src->size_file_bytes;
+		dst->flags = src->flags;
+	}
+
+	//commit whatever got done: the table, then the pointer to it, then the
+	//maps and root dir
+	pthread_mutex_lock(&alloc_lock);
+	if(fat_flush() == -1) ret = -1;
+	pthread_mutex_unlock(&alloc_lock);
+	if(rdir_map[src_rdir_index] != NULL && 
+		map_flush(rdir_map[src_rdir_index]) == -1) ret = -1;
+	if(rdir_write() == -1) ret = -1;
+	map_unload(src_rdir_index);
+
+	//a copied tail nobody points to goes back
+	if(ret == -1)
+	{
+		uint32_t tail_blk = dst->tail_blk;
+		dst_discard(dst_rdir_index);
+		if(tail_copied)
 		{
-			amount_to_write_in_blk = BLOCK_SIZE - left;
+			pthread_mutex_lock(&alloc_lock);
+			pack_blk_put(tail_blk);
+			pthread_mutex_unlock(&alloc_lock);
 		}
-		else	//special case for writing last blk or total one blk
+	}
+	else
+	{
+		entry_put(dst_rdir_index);
+	}
+	entry_put(src_rdir_index);
+
+	return ret;
+}
+
+//---start of copy helper functions
+static int copy_data(const uint32_t *src_blks, const uint32_t *dst_blks,
+	size_t num_blks)
+{
+	//copy the data blks over, one block layer transfer per stretch of blks
+	//that is contiguous on both sides
+	size_t i = 0;
+	while(i < num_blks)
+	{
+		size_t run_len = 1;
+		while(i + run_len < num_blks &&
+			src_blks[i + run_len] == src_blks[i] + run_len &&
+			dst_blks[i + run_len] == dst_blks[i] + run_len) run_len++;
+		if(block_copy(superblock->data_blk_start_index + dst_blks[i],
+			superblock->data_blk_start_index + src_blks[i], run_len) == -1)
+			return -1;
+		i += run_len;
+	}
+
+	return 0;
+}
+
+static int copy_layout(int src_rdir_index, int dst_rdir_index, 
+	const uint32_t *dst_blks, size_t num_data_blks)
+{
+	//hook the copied data blks into the destination, the same way the
+	//source holds its own: a FAT chain, or a map with the same holes
+	struct RootDirEntry *dst = &rootdir[dst_rdir_index];
+	dst->index_first_data_blk = FAT_EOC;
+
+	struct FileMap *src_map = rdir_map[src_rdir_index];
+	if(src_map == NULL)
+	{
+		pthread_mutex_lock(&alloc_lock);
+		for(size_t i = 1; i < num_data_blks; i++) 
+			fat_set(dst_blks[i - 1], dst_blks[i]);
+		pthread_mutex_unlock(&alloc_lock);
+		if(num_data_blks > 0) dst->index_first_data_blk = dst_blks[0];
+		return 0;
+	}
+
+	struct FileMap *dst_map = calloc(1, sizeof(struct FileMap));
+	if(dst_map == NULL) return -1;
+	int ret = map_grow(dst, dst_map, src_map->num_map_blks);
+	if(ret == 0)
+	{
+		size_t i = 0;
+		for(size_t lblk = 0; 
+			lblk < src_map->num_map_blks * MAP_ENTRIES_PER_BLK; lblk++)
 		{
-			//write blk from index left or 0 up to remaining count bytes
-			amount_to_write_in_blk = count;
+			if(map_get(src_map, lblk) != MAP_HOLE)
+				dst_map->data_blk[lblk] = dst_blks[i++];
+			else if(src_map->data_blk[lblk] == MAP_COMPRESSED)
+				dst_map->data_blk[lblk] = MAP_COMPRESSED;
 		}
+		ret = map_flush(dst_map);
+	}
+	if(ret == -1)
+	{
+		//drop the map blks, the caller gives back the data blks
+		pthread_mutex_lock(&alloc_lock);
+		reclaim_push(dst->index_first_data_blk, false);
+		pthread_mutex_unlock(&alloc_lock);
+		dst->index_first_data_blk = FAT_EOC;
+	}
+	map_free(dst_map);
+
+	return ret;
+}
+//---end of copy helper functions
+
+int fs_copy(const char *src_filename, const char *dst_filename)
+{
+	if(!fsmounted || readonly || src_filename == NULL || dst_filename == NULL) return -1;
+
+	//every name is looked up once, here
+	int src_rdir_index = path_lookup(src_filename);
+	if(src_rdir_index == -1) return -1;
+	int dst_rdir_index = dst_create(src_rdir_index, dst_filename);
+	if(dst_rdir_index == -1)
+	{
+		entry_put(src_rdir_index);
+		return -1;
+	}
+	int ret = map_load(src_rdir_index);
+	//tails are only packed in the root dir, see fs_clone
+	if(ret == 0 && dst_rdir_index >= FS_FILE_MAX_COUNT) 
+		ret = tail_unpack(src_rdir_index);
+
+	//list the source's data blks in order, holes left out
+	struct RootDirEntry *src = &rootdir[src_rdir_index];
+	size_t num_blks = (src->size_file_bytes / BLOCK_SIZE) + 
+		((src->size_file_bytes % BLOCK_SIZE) != 0);
+	uint32_t *src_blks = malloc((num_blks + 1) * sizeof(uint32_t));
+	uint32_t *dst_blks = malloc((num_blks + 1) * sizeof(uint32_t));
+	size_t num_data_blks = 0;
+	struct BlkCursor blk_cursor;
+	blk_cursor_init(&blk_cursor, src_rdir_index, 0);
+	for(size_t lblk = 0; ret == 0 && src_blks != NULL && lblk < num_blks; 
+		lblk++)
+	{
+		if(blk_cursor.data_blk != 0) 
+			src_blks[num_data_blks++] = blk_cursor.data_blk;
+		blk_cursor_next(&blk_cursor);
+	}
+
+	//a packed tail goes to a pack blk of the destination's own
+	struct RootDirEntry *dst = &rootdir[dst_rdir_index];
+	bool tail_copied = ret == 0 && tail_copy(src, dst) == 0;
 
-		if(amount_to_write_in_blk < BLOCK_SIZE)
+	//the whole destination is claimed up front, in contiguous runs where
+	//the disk allows, then the data goes over in large transfers
+	ret = -1;
+	if(tail_copied && src_blks != NULL && dst_blks != NULL && 
+		allocate_data_blks(dst_blks, num_data_blks) == 0)
+	{
+		ret = copy_data(src_blks, dst_blks, num_data_blks);
+		if(ret == 0) ret = copy_layout(src_rdir_index, dst_rdir_index, dst_blks,
+			num_data_blks);
+		if(ret == -1)
 		{
-			//for writing the first and last block, there are cases when we 
-			//want to retain information that is already written to it because 
-			//we dont want to overwrite the entire block. EX: file size 4096 
-			//and offset is at middle of file and we write 1 byte. Only that 1 
-			//byte should change in the file's contents and nothing else.
-			block_read(superblock->data_blk_start_index + file_data_blk_idex
-			, (void*)bounce_buffer);
-			memcpy(bounce_buffer + left, buf, amount_to_write_in_blk);
-			block_write(superblock->data_blk_start_index + file_data_blk_idex
-			, (void*)bounce_buffer);
+			//give the blks back, nothing points to them
+			pthread_mutex_lock(&alloc_lock);
+			for(size_t i = 0; i < num_data_blks; i++) 
+				release_data_blk(dst_blks[i]);
+			discard_flush();
+			pthread_mutex_unlock(&alloc_lock);
 		}
-		else 
+	}
+	free(src_blks);
+	free(dst_blks);
+	map_unload(src_rdir_index);
+	if(ret == -1)
+	{
+		uint32_t tail_blk = dst->tail_blk;
+		dst_discard(dst_rdir_index);
+		if(tail_copied && (src->flags & FILE_PACKED))
 		{
-			//otherwise, we overwrite the entire block for blocks that are 
-			//neither the first block or the last block
-			block_write(superblock->data_blk_start_index + file_data_blk_idex
-			, (void*)buf);
+			pthread_mutex_lock(&alloc_lock);
+			pack_blk_put(tail_blk);
+			pthread_mutex_unlock(&alloc_lock);
 		}
+		entry_put(src_rdir_index);
+		return -1;
+	}
 
-		//move start position in input buffer for next blk write
-		buf += amount_to_write_in_blk;	
-		bytes_wrote += amount_to_write_in_blk;
-		count -= amount_to_write_in_blk;
-		
-		//move to writing next blk
-		file_data_blk_idex = fat[file_data_blk_idex].value;
+	dst->size_file_bytes = src->size_file_bytes;
+	dst->flags = src->flags & (FILE_MAPPED | FILE_COMPRESSED | FILE_PACKED);
 
-		left = 0; //for subsequent blks other than first blk, start at index 0
+	//the FAT and root dir are written back once for the whole copy
+	pthread_mutex_lock(&alloc_lock);
+	ret = fat_flush();
+	pthread_mutex_unlock(&alloc_lock);
+	if(ret == 0) ret = rdir_write();
+	entry_put(dst_rdir_index);
+	entry_put(src_rdir_index);
+
+	return ret;
+}
+
+int fs_compress(const char *filename)
+{
+	if(!fsmounted || readonly || filename == NULL) return -1;
+
+	int rdir_index = path_lookup(filename);
+	if(rdir_index == -1) return -1;
+	struct RootDirEntry *rootdirentry = &rootdir[rdir_index];
+	if(rootdirentry->flags & (FILE_COMPRESSED | FILE_DIR) || 
+		rdir_pin_count[rdir_index] > 0)
+	{
+		//compressing a pinned file would move its data
+		int ret = (rootdirentry->flags & FILE_COMPRESSED) ? 0 : -1;
+		entry_put(rdir_index);
+		return ret;
 	}
 
-	//Example: file size 1 and offset currently at 0
-	//write 1 byte wont change size but write 2 byte will change size
-	if(offset + bytes_wrote > rootdirentry->size_file_bytes)
+	//clusters live in a map, a plain chain is switched over first
+	int ret = map_load(rdir_index);
+	//clusters hold every blk of the file, a packed tail included
+	if(ret == 0) ret = tail_unpack(rdir_index);
+	if(ret == 0 && !(rootdirentry->flags & FILE_MAPPED)) 
+		ret = map_convert(rdir_index);
+	if(ret == -1)
 	{
-		rootdirentry->size_file_bytes = offset + bytes_wrote;
+		map_unload(rdir_index);
+		entry_put(rdir_index);
+		return -1;
+	}
 
-		//write back FAT, which starts at block index 1 in disk
-		for(size_t i = 1, j = 0; i < superblock->root_dir_blk_index; i++, j++)
-		{
-			if(block_write(i, (void*)fat + j * BLOCK_SIZE) == -1) return -1;
-		}
+	//from here on every cluster must keep zeros past the end of file, the
+	//one the end falls in is the only one that may not
+	size_t size = rootdirentry->size_file_bytes;
+	if(size % CLUSTER_SIZE != 0) ret = cluster_trim(rdir_index, size);
+	if(ret == 0) rootdirentry->flags |= FILE_COMPRESSED;
 
-		//write back root dir
-		if(block_write(superblock->root_dir_blk_index, rootdir) == -1) return -1;
+	//the rest is compressed a cluster at a time, a full disk leaves the
+	//clusters after it stored as they are
+	struct FileMap *map = rdir_map[rdir_index];
+	uint8_t *cluster_buf = ret == 0 ? cluster_buf_alloc() : NULL;
+	if(cluster_buf == NULL) ret = -1;
+	for(size_t cluster = 0; ret == 0 && cluster < size / CLUSTER_SIZE; 
+		cluster++)
+	{
+		//clusters that are all holes stay that way
+		bool has_blks = false;
+		for(size_t i = 0; i < CLUSTER_BLKS; i++)
+			has_blks |= map_get(map, cluster * CLUSTER_BLKS + i) != MAP_HOLE;
+		if(!has_blks || cluster_compressed(map, cluster)) continue;
+
+		if(cluster_read(map, cluster, cluster_buf, 0, CLUSTER_SIZE) == -1 ||
+			cluster_write(rootdirentry, map, cluster, cluster_buf) == -1)
+			ret = -1;
 	}
+	free(cluster_buf);
 
-	fdtable[fd].offset += bytes_wrote;
-	return bytes_wrote;
+	if(file_commit(rdir_index) == -1) ret = -1;
+	map_unload(rdir_index);
+	entry_put(rdir_index);
+
+	return ret;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+//---start of bulk transfer helper functions
+#define BULK_THREADS 4	//workers moving the data of an import or export
+#define BULK_RUN_SIZE (1 << 20)	//most bytes a worker moves at once
+
+struct BulkRun	//consecutive data blks of a file and where their data is
 {
-	//validation
-	if (!fsmounted || fd < 0 || fd >= FS_OPEN_MAX_COUNT || 
-		fdtable[fd].filename[0] == '\0' || buf == NULL) return -1;
+	uint32_t data_blk;
+	size_t num_blks;
+	uint8_t *buf;
+	size_t len;	//bytes of buf, the last blk may only be partly there
+	size_t file;	//index in the caller's array
+};
 
-	if(count == 0) return 0; //user input want to read nothing
+struct BulkQueue	//runs shared out to the workers
+{
+	struct BulkRun *runs;
+	size_t num_runs;
+	size_t cap_runs;
+	size_t next;	//first run nobody took yet
+	bool write;
+	bool *failed;	//per file, set by the worker a run of it failed in
+	pthread_mutex_t lock;
+};
 
-	//prep
-	uint32_t file_size = fs_stat(fd);
+static int bulk_add(struct BulkQueue *queue, size_t file, uint32_t data_blk,
+	uint8_t *buf, size_t len)
+{
+	//one more blk of a file, appended to its last run when it follows it
+	struct BulkRun *last = queue->num_runs > 0 ? 
+		&queue->runs[queue->num_runs - 1] : NULL;
+	if(last != NULL && last->file == file && 
+		last->data_blk + last->num_blks == data_blk &&
+		last->buf + last->len == buf && last->len % BLOCK_SIZE == 0 &&
+		last->len + len <= BULK_RUN_SIZE)
+	{
+		last->num_blks++;
+		last->len += len;
+		return 0;
+	}
 
-	if(file_size == 0) return 0; //nothing to read for a empty file
+	if(queue->num_runs == queue->cap_runs)
+	{
+		size_t new_cap = queue->cap_runs ? queue->cap_runs * 2 : 64;
+		struct BulkRun *runs = realloc(queue->runs, 
+			new_cap * sizeof(struct BulkRun));
+		if(runs == NULL) return -1;
+		queue->runs = runs;
+		queue->cap_runs = new_cap;
+	}
+	queue->runs[queue->num_runs++] = (struct BulkRun){ data_blk, 1, buf, len, 
+		file };
 
-	size_t offset = fdtable[fd].offset;
+	return 0;
+}
 
-	//Example: file size 1 then should only read index 0
-	//read nothing if offset is set beyond file's contents
-	//...user should be writing instead to extend the file
-	if(offset + 1 > file_size)	return 0;
+static int bulk_run_io(const struct BulkRun *run, bool write)
+{
+	//the whole blks go straight between buf and the disk, a partial last
+	//one through a bounce buffer, padded with zeros when written
+	size_t blk = superblock->data_blk_start_index + run->data_blk;
+	size_t full_blks = run->len / BLOCK_SIZE;
+	size_t rest = run->len % BLOCK_SIZE;
+	if(full_blks > 0 && (write ? 
+		block_write_run(blk, run->buf, full_blks) : 
+		block_read_run(blk, run->buf, full_blks)) == -1) return -1;
+	if(rest == 0) return 0;
 
-	//Example: file size 1 then should only read index 0
-	//reduce count to readable number of bytes left
-	//if count > readable number of bytes left
-	//file_size - offset is readable number of bytes left
-	if(count > file_size - offset) count = file_size - offset;
+	uint8_t bounce_buffer[BLOCK_SIZE];
+	uint8_t *part = run->buf + full_blks * BLOCK_SIZE;
+	if(write)
+	{
+		memcpy(bounce_buffer, part, rest);
+		memset(bounce_buffer + rest, 0, BLOCK_SIZE - rest);
+		return block_write(blk + full_blks, bounce_buffer);
+	}
+	if(block_read(blk + full_blks, bounce_buffer) == -1) return -1;
+	memcpy(part, bounce_buffer, rest);
 
-	//otherwise, valid for reading so
-	//get index of first data block in data array according to offset
-	uint16_t data_start_index = 0;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	return 0;
+}
+
+static void *bulk_worker(void *arg)
+{
+	struct BulkQueue *queue = arg;
+
+	//host pages of the caller's buffers fault in here too, so reading or
+	//writing the host files is spread over the workers as well
+	pthread_mutex_lock(&queue->lock);
+	while(queue->next < queue->num_runs)
+	{
+		struct BulkRun *run = &queue->runs[queue->next++];
+		pthread_mutex_unlock(&queue->lock);
+		int ret = bulk_run_io(run, queue->write);
+		pthread_mutex_lock(&queue->lock);
+		if(ret == -1) queue->failed[run->file] = true;
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return NULL;
+}
+
+static void bulk_run_all(struct BulkQueue *queue)
+{
+	//the foreground is the first worker, failing to start others only
+	//makes it slower
+	pthread_t workers[BULK_THREADS - 1];
+	size_t num_workers = 0;
+	pthread_mutex_init(&queue->lock, NULL);
+	while(num_workers < BULK_THREADS - 1 && 
+		num_workers + 1 < queue->num_runs &&
+		pthread_create(&workers[num_workers], NULL, bulk_worker, queue) == 0)
+		num_workers++;
+	bulk_worker(queue);
+	for(size_t i = 0; i < num_workers; i++) pthread_join(workers[i], NULL);
+	pthread_mutex_destroy(&queue->lock);
+}
+
+static void bulk_release_blks(const uint32_t *blks, size_t count)
+{
+	//give back data blks nothing points to yet
+	pthread_mutex_lock(&alloc_lock);
+	for(size_t i = 0; i < count; i++) release_data_blk(blks[i]);
+	discard_flush();
+	pthread_mutex_unlock(&alloc_lock);
+}
+//---end of bulk transfer helper functions
+
+int fs_import(const struct fs_import_file *files, size_t count, int *status)
+{
+	if(!fsmounted || readonly || files == NULL || status == NULL) return -1;
+
+	//every entry is created in one go
+	const char **filenames = malloc((count + 1) * sizeof(char*));
+	int *rdir_index = malloc((count + 1) * sizeof(int));
+	size_t *first_blk = malloc((count + 1) * sizeof(size_t));
+	struct BulkQueue queue = { .write = true };
+	queue.failed = calloc(count + 1, sizeof(bool));
+	if(filenames == NULL || rdir_index == NULL || first_blk == NULL || 
+		queue.failed == NULL)
+	{
+		free(filenames);
+		free(rdir_index);
+		free(first_blk);
+		free(queue.failed);
+		return -1;
+	}
+	for(size_t i = 0; i < count; i++) 
+	{
+		//too large a file is not even created
+		filenames[i] = files[i].size <= FILE_SIZE_MAX && 
+			(files[i].buf != NULL || files[i].size == 0) ? 
+			files[i].filename : NULL;
+	}
+	fs_create_batch(filenames, count, status);
+
+	//then the blks of all files are claimed at once, in a single run if the
+	//disk has one, each file in a run of its own if not
+	size_t num_blks = 0;
+	for(size_t i = 0; i < count; i++)
 	{
-		if(strcmp((char*)rootdir[i].filename, fdtable[fd].filename) == 0)
+		rdir_index[i] = status[i] == 0 ? path_lookup(filenames[i]) : -1;
+		if(rdir_index[i] == -1) status[i] = -1;
+		first_blk[i] = num_blks;
+		if(status[i] == 0) 
+			num_blks += (files[i].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	}
+	first_blk[count] = num_blks;
+	uint32_t *blks = malloc((num_blks + 1) * sizeof(uint32_t));
+	bool all_found = blks != NULL && allocate_data_blks(blks, num_blks) == 0;
+	for(size_t i = 0; !all_found && i < count; i++)
+	{
+		//a file the disk has no room for is taken back out right away
+		if(status[i] == 0 && (blks == NULL || allocate_data_blks(
+			blks + first_blk[i], first_blk[i + 1] - first_blk[i]) == -1))
 		{
-			data_start_index = rootdir[i].index_first_data_blk;
-			break;
+			status[i] = -1;
+			dst_discard(rdir_index[i]);
 		}
 	}
-	//move to the correct blk based on file's offset
-	uint16_t file_data_blk_idex = index_data_blk(data_start_index, offset);	
-	//special case left index for reading first block
-	int left = offset % BLOCK_SIZE;
-	int amount_to_read_in_blk;
-	size_t bytes_read = count;
-	//bounce buffer with index 0 to 4095
-	uint8_t bounce_buffer[BLOCK_SIZE];
-	while(count > 0)	//while not done reading
+
+	//the workers write the data before anything points to it
+	for(size_t i = 0; i < count; i++)
 	{
-		if(left + count > BLOCK_SIZE)
+		if(status[i] != 0 || queue.failed[i]) continue;
+		for(size_t j = first_blk[i]; j < first_blk[i + 1]; j++)
 		{
-			amount_to_read_in_blk = BLOCK_SIZE - left;
+			size_t pos = (j - first_blk[i]) * BLOCK_SIZE;
+			size_t len = files[i].size - pos < BLOCK_SIZE ? 
+				files[i].size - pos : BLOCK_SIZE;
+			if(bulk_add(&queue, i, blks[j], (uint8_t*)files[i].buf + pos, 
+				len) == -1) queue.failed[i] = true;
 		}
-		else	//special case for reading last blk or total one blk
+	}
+	bulk_run_all(&queue);
+
+	//the chains and the entries go to disk once, for all the files
+	int num_imported = 0;
+	for(size_t i = 0; i < count; i++)
+	{
+		if(status[i] != 0) continue;
+		size_t n = first_blk[i + 1] - first_blk[i];
+		if(queue.failed[i])
 		{
-			//read blk from index left or 0 up to remaining count bytes
-			amount_to_read_in_blk = count;
+			bulk_release_blks(blks + first_blk[i], n);
+			continue;
 		}
+		pthread_mutex_lock(&alloc_lock);
+		for(size_t j = 1; j < n; j++)
+			fat_set(blks[first_blk[i] + j - 1], blks[first_blk[i] + j]);
+		pthread_mutex_unlock(&alloc_lock);
+		struct RootDirEntry *rootdirentry = &rootdir[rdir_index[i]];
+		rootdirentry->index_first_data_blk = n > 0 ? blks[first_blk[i]] : 
+			FAT_EOC;
+		rootdirentry->size_file_bytes = files[i].size;
+		num_imported++;
+	}
+	pthread_mutex_lock(&alloc_lock);
+	int ret = fat_flush();
+	pthread_mutex_unlock(&alloc_lock);
+	if(ret == 0) ret = rdir_write();
 
-		if(amount_to_read_in_blk < BLOCK_SIZE)
+	//files whose data did not make it are taken back out
+	for(size_t i = 0; i < count; i++)
+	{
+		if(status[i] != 0) continue;
+		if(queue.failed[i] || ret == -1)
 		{
-			//for cases where we only want to read subset of the first block
-			//and last block
-			block_read(superblock->data_blk_start_index + file_data_blk_idex
-			, (void*)bounce_buffer);
-			memcpy(buf, bounce_buffer + left, amount_to_read_in_blk);
+			status[i] = -1;
+			dst_discard(rdir_index[i]);
 		}
-		else
+		else entry_put(rdir_index[i]);
+	}
+
+	free(blks);
+	free(queue.runs);
+	free(queue.failed);
+	free(first_blk);
+	free(rdir_index);
+	free(filenames);
+
+	return ret == -1 ? -1 : num_imported;
+}
+
+int fs_export(const struct fs_export_file *files, size_t count, int *status)
+{
+	if(!fsmounted || files == NULL || status == NULL) return -1;
+
+	//the entries and maps of all files are looked up in the foreground
+	int *rdir_index = malloc((count + 1) * sizeof(int));
+	struct BulkQueue queue = { .write = false };
+	queue.failed = calloc(count + 1, sizeof(bool));
+	if(rdir_index == NULL || queue.failed == NULL)
+	{
+		free(rdir_index);
+		free(queue.failed);
+		return -1;
+	}
+	uint8_t bounce_buffer[BLOCK_SIZE];
+	for(size_t i = 0; i < count; i++)
+	{
+		status[i] = -1;
+		rdir_index[i] = path_lookup(files[i].filename);
+		if(rdir_index[i] == -1) continue;
+		struct RootDirEntry *rootdirentry = &rootdir[rdir_index[i]];
+		if((rootdirentry->flags & FILE_DIR) || 
+			(files[i].buf == NULL && files[i].size > 0) ||
+			map_load(rdir_index[i]) == -1) continue;
+
+		size_t len = rootdirentry->size_file_bytes < files[i].size ? 
+			rootdirentry->size_file_bytes : files[i].size;
+		status[i] = len;
+		//clusters are decompressed one after the other
+		if(rootdirentry->flags & FILE_COMPRESSED)
 		{
-			//otherwise, we read the entire block for blocks that are 
-			//neither the first block or the last block
-			block_read(superblock->data_blk_start_index + file_data_blk_idex
-			, (void*)buf);
+			if(file_read(rdir_index[i], files[i].buf, len, 0, NULL) != 
+				(int)len)
+				status[i] = -1;
+			continue;
 		}
 
-		//move start position in input buffer for next blk read
-		buf += amount_to_read_in_blk;	
-		count -= amount_to_read_in_blk;
-		
-		//move to reading next blk
-		file_data_blk_idex = fat[file_data_blk_idex].value;
+		//tails and holes are filled in here, the rest by the workers
+		size_t tail_lblk = (rootdirentry->flags & FILE_PACKED) ? 
+			rootdirentry->size_file_bytes / BLOCK_SIZE : SIZE_MAX;
+		struct BlkCursor blk_cursor;
+		blk_cursor_init(&blk_cursor, rdir_index[i], 0);
+		for(size_t pos = 0; pos < len; pos += BLOCK_SIZE)
+		{
+			uint8_t *buf = (uint8_t*)files[i].buf + pos;
+			size_t blk_len = len - pos < BLOCK_SIZE ? len - pos : BLOCK_SIZE;
+			if(blk_cursor.lblk == tail_lblk)
+			{
+				if(tail_read(rootdirentry, bounce_buffer) == -1)
+					queue.failed[i] = true;
+				memcpy(buf, bounce_buffer, blk_len);
+			}
+			else if(blk_cursor.data_blk == 0) 
+				memset(buf, 0, blk_len);
+			else if(bulk_add(&queue, i, blk_cursor.data_blk, buf, 
+				blk_len) == -1) 
+				queue.failed[i] = true;
+			blk_cursor_next(&blk_cursor);
+		}
+	}
+	bulk_run_all(&queue);
 
-		left = 0; //for subsequent blks other than first blk, start at index 0
+	int num_exported = 0;
+	for(size_t i = 0; i < count; i++)
+	{
+		if(rdir_index[i] == -1) continue;
+		if(queue.failed[i]) status[i] = -1;
+		if(status[i] != -1) num_exported++;
+		map_unload(rdir_index[i]);
+		entry_put(rdir_index[i]);
 	}
 
-	fdtable[fd].offset += bytes_read;
-	return bytes_read;
+	free(queue.runs);
+	free(queue.failed);
+	free(rdir_index);
+
+	return num_exported;
 }
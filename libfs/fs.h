@@ -2,6 +2,7 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -9,42 +10,273 @@
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/** Default maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Mount flags (see struct fs_mount_opts) */
+/* Read FAT blocks on first use instead of all at mount time */
+#define FS_MOUNT_LAZY		0x1
+/* Lazy mount, plus a background thread reading the remaining FAT blocks */
+#define FS_MOUNT_PREFETCH	0x2
+/* Free the blocks of deleted files from a background thread */
+#define FS_MOUNT_RECLAIM	0x4
+/* Allow file offsets past the end of file, leaving holes in sparse files */
+#define FS_MOUNT_SPARSE		0x8
+/* Give the storage of freed and all-zero blocks back to the host */
+#define FS_MOUNT_DISCARD	0x10
+/* Share data blocks with identical content instead of writing them again */
+#define FS_MOUNT_DEDUP		0x20
+/* Pack small files and the tails of larger ones together in shared blocks */
+#define FS_MOUNT_PACK		0x40
+/* Map the disk image in memory, so that fs_map_blocks() can point into it */
+#define FS_MOUNT_MMAP		0x80
+/* Open the disk image read-only, shared with other read-only mounts */
+#define FS_MOUNT_RDONLY		0x100
+
+/**
+ * struct fs_mount_opts - Mount options
+ * @flags: Bitwise OR of %FS_MOUNT_* flags
+ * @open_max: Maximum number of open files, 0 for %FS_OPEN_MAX_COUNT
+ */
+struct fs_mount_opts {
+	int flags;
+	int open_max;
+};
+
+/** Format flags (see struct fs_format_opts) */
+/* Use the 32-bit FAT format even if the image fits in the 16-bit one */
+#define FS_FORMAT_FAT32		0x1
+
+/**
+ * struct fs_format_file - File created along with a file system
+ * @filename: Name of the file in the root directory
+ * @size: Size of the file in bytes
+ */
+struct fs_format_file {
+	const char *filename;
+	size_t size;
+};
+
+/**
+ * struct fs_format_opts - Format options
+ * @flags: Bitwise OR of %FS_FORMAT_* flags
+ * @block_size: Size of a block in bytes, a power of 2 between 512 and 65536, or
+ * 0 for 4096
+ * @files: Files to preallocate, or NULL for none
+ * @num_files: Number of entries in @files
+ */
+struct fs_format_opts {
+	int flags;
+	size_t block_size;
+	const struct fs_format_file *files;
+	size_t num_files;
+};
+
+/**
+ * struct fs_import_file - File written by fs_import()
+ * @filename: Name of the new file
+ * @buf: Content of the file
+ * @size: Size of @buf in bytes
+ */
+struct fs_import_file {
+	const char *filename;
+	const void *buf;
+	size_t size;
+};
+
+/**
+ * struct fs_export_file - File read by fs_export()
+ * @filename: Name of the file
+ * @buf: Buffer receiving the content of the file
+ * @size: Size of @buf in bytes
+ */
+struct fs_export_file {
+	const char *filename;
+	void *buf;
+	size_t size;
+};
+
+/**
+ * struct fs_block_run - Part of a file stored in one place, see fs_map_blocks()
+ * @offset: File offset of the first byte of the run
+ * @length: Size of the run in bytes
+ * @block: Index in the virtual disk of the block holding the first byte, the
+ * others follow it; 0 for a hole, which reads as zeros
+ * @block_offset: Offset of the first byte in @block
+ * @data: The @length bytes of the run in the mapped disk image, or NULL for a
+ * hole or if the image is not mapped
+ */
+struct fs_block_run {
+	size_t offset;
+	size_t length;
+	size_t block;
+	size_t block_offset;
+	const void *data;
+};
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
  *
  * Open the virtual disk file @diskname and mount the file system that it
  * contains. A file system needs to be mounted before files can be read from it
- * with fs_read() or written to it with fs_write().
+ * with fs_read() or written to it with fs_write(). A call to fs_grow() that a
+ * crash cut short is first rolled back or finished (see fs_grow()).
  *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_ext - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults used by fs_mount()
+ *
+ * Same as fs_mount(), but lets the caller tune how the file system is brought
+ * up. With %FS_MOUNT_LAZY, only the superblock, the root directory and the
+ * first FAT block are read before returning; every other FAT block is read the
+ * first time a FAT chain or the block allocator touches it. %FS_MOUNT_PREFETCH
+ * additionally starts a background thread that reads the FAT blocks nobody
+ * asked for yet. %FS_MOUNT_RECLAIM starts a background thread that frees the
+ * data blocks of deleted files (see fs_delete()). %FS_MOUNT_SPARSE lets
+ * fs_lseek(), fs_pwrite() and fs_ftruncate() go past the end of a file (see
+ * fs_lseek()). %FS_MOUNT_DISCARD punches the data blocks freed by fs_delete()
+ * and fs_ftruncate() out of the virtual disk file, as well as the all-zero
+ * blocks written by fs_write(), so that the host only stores real data.
+ * %FS_MOUNT_DEDUP looks up every whole block written by fs_write() in an index
+ * of block contents kept on disk; a block already stored is shared instead of
+ * written, and copied again the first time one of its owners modifies it, as
+ * with fs_clone(). Files written in whole blocks switch to the layout that can
+ * share blocks, which costs them one block of metadata per 8 MiB.
+ * %FS_MOUNT_PACK stores the last block of a file, when it is at most half full,
+ * in a block shared with the tails of other files once the file is closed for
+ * the last time; a file of a few bytes then takes no data block of its own and
+ * is read with a single block read, or none if its neighbor was just read. The
+ * tail gets a block of its own again the first time the file is written to or
+ * truncated. Files packed this way can be read under any mount flags.
+ * %FS_MOUNT_MMAP maps the virtual disk file in memory: blocks are read from
+ * the mapping, and fs_map_blocks() can point into it.
+ *
+ * %FS_MOUNT_RDONLY opens the virtual disk file read-only. Every call that would
+ * change the file system fails, and nothing is ever written to the virtual
+ * disk file, not even by fs_umount(); the flags that only matter to writes are
+ * ignored. Any number of processes can mount the same virtual disk file
+ * read-only at once, with %FS_MOUNT_MMAP sharing a single copy of it in
+ * memory, while a read-write mount has it to itself. A virtual disk file left
+ * in the middle of fs_grow() cannot be mounted read-only until a read-write
+ * mount has rolled it back or finished it.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if it is
+ * mounted by another process in a way that conflicts with this mount, or if no
+ * valid file system can be located. 0 otherwise.
+ */
+int fs_mount_ext(const char *diskname, const struct fs_mount_opts *opts);
+
 /**
  * fs_umount - Unmount file system
  *
  * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
+ * disk file. Only the FAT blocks that were modified since they were last
+ * written are written back, and nothing at all if the file system was not
+ * changed or was mounted with %FS_MOUNT_RDONLY.
  *
  * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
  * closed, or if there are still open file descriptors. 0 otherwise.
  */
 int fs_umount(void);
 
+/**
+ * fs_format - Create an empty file system
+ * @diskname: Name of the virtual disk file
+ * @data_blk_count: Number of data blocks
+ * @opts: Format options, or NULL for the defaults
+ *
+ * Create virtual disk file @diskname, replacing any file of that name, with an
+ * empty file system of @data_blk_count data blocks. Images of up to 65500 data
+ * blocks use the base format, with 16-bit FAT entries, unless %FS_FORMAT_FAT32
+ * is given; larger images use the 32-bit format, in which the FAT entries and
+ * every block index stored on disk take 32 bits. fs_mount() tells the formats
+ * apart by their signature and offers the same functions on both. Drivers that
+ * only know the base format turn a 32-bit image down instead of misreading it.
+ * Files keep the same size limit in both formats. The virtual disk file is
+ * sparse: only the superblock and the first FAT block are written.
+ *
+ * The base format has blocks of 4096 bytes. Other block sizes, given by
+ * @opts->block_size, use the 32-bit format, which records the block size in
+ * its superblock. Small blocks waste less space on small files, and pack more
+ * of them per packed block (see %FS_MOUNT_PACK); the root directory then takes
+ * several blocks, and directories hold fewer entries per block. Large blocks
+ * make a file's FAT chain or block map shorter, so that large files take fewer
+ * FAT lookups and block transfers, at the cost of more slack in their last
+ * block.
+ *
+ * The @opts->num_files files of @opts->files are created in the root directory,
+ * in that order, each with its data blocks allocated in one contiguous run that
+ * reads back as zeros. Only the FAT blocks that cover these runs and the root
+ * directory are written in addition, so the virtual disk file stays sparse.
+ *
+ * Return: -1 if @diskname is invalid or cannot be created, if it is mounted
+ * in another process, if a file system is currently mounted, if
+ * @data_blk_count is 0 or too large, if the block size is invalid, or if a
+ * file to preallocate has an invalid or duplicate name or does not fit. 0
+ * otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blk_count,
+	      const struct fs_format_opts *opts);
+
+/**
+ * fs_grow - Grow the mounted file system
+ * @data_blk_count: New number of data blocks
+ *
+ * Extend the virtual disk file of the currently mounted file system so that it
+ * has @data_blk_count data blocks, all of them free. As long as the FAT has
+ * room for the new entries in its last block, nothing but the superblock is
+ * written. Otherwise the FAT takes the place of the root directory and of the
+ * first data blocks, which move to the end of the image; every block index
+ * stored on disk then changes, so the FAT, the root directory, the block maps
+ * and directories that list blocks are written again, but the data blocks that
+ * stay in place are not.
+ *
+ * The old layout is left as it is until everything that takes its place is in
+ * a journal past the end of the grown image, and the superblock records how
+ * far the grow went. After a crash, fs_mount() rolls a grow back if the journal
+ * was not complete, and finishes it otherwise. If an error stops the grow
+ * before the FAT is rebuilt, the file system stays mounted as it was; after
+ * that point, it is unmounted without writing anything, and the next
+ * fs_mount() rolls the grow back or finishes it.
+ *
+ * Return: -1 if no file system is currently mounted, if files are open, if
+ * @data_blk_count is less than the current number of data blocks or too large
+ * for the format, or if the virtual disk file cannot be grown. 0 otherwise.
+ */
+int fs_grow(size_t data_blk_count);
+
 /**
  * fs_info - Display information about file system
  *
- * Display some information about the currently mounted file system.
+ * Display some information about the currently mounted file system. The free
+ * block and free root directory entry counts come from the summary saved in
+ * the superblock at the last clean unmount; they are only recomputed by
+ * scanning the FAT if the file system was not cleanly unmounted.
  *
  * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
  */
 int fs_info(void);
 
+/**
+ * fs_dedup_info - Display block sharing statistics
+ *
+ * Display how many data blocks are in use, how many of them are shared by
+ * several files, through %FS_MOUNT_DEDUP or fs_clone(), and the resulting
+ * deduplication ratio: the blocks the files would use without sharing, over the
+ * blocks in use. The number of block writes saved by %FS_MOUNT_DEDUP since the
+ * file system was mounted is displayed too.
+ *
+ * Return: -1 if no FS is currently mounted. 0 otherwise.
+ */
+int fs_dedup_info(void);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
@@ -54,6 +286,12 @@ int fs_info(void);
  * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
  * character).
  *
+ * @filename may also be a path to a file in a directory created with
+ * fs_mkdir(), such as "dir/sub/file", with an optional leading '/'. Each
+ * component of the path is limited to %FS_FILENAME_LEN characters (including
+ * the NULL character) instead of the whole string. Every file function taking
+ * a file name accepts such a path.
+ *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
  * file named @filename already exists, or if string @filename is too long, or
  * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
@@ -65,14 +303,99 @@ int fs_create(const char *filename);
  * @filename: File name
  *
  * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * system. Only the root directory entry is removed before returning; the data
+ * blocks of the file are freed later, either by the background thread started
+ * with %FS_MOUNT_RECLAIM or as soon as the block allocator runs out of free
+ * blocks, and in any case before fs_umount() or fs_info() returns.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
+ * there is no file named @filename to delete, or if file @filename is
+ * currently open, or if @filename is a directory. 0 otherwise.
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_mkdir - Create a directory
+ * @dirname: Directory name
+ *
+ * Create a new and empty directory named @dirname, in the root directory or in
+ * another directory if @dirname is a path (see fs_create()). A directory is
+ * stored as a file whose first block is a hash table of its names, so that
+ * looking up a name reads the table and one other block whatever the number of
+ * entries. The other blocks hold the entries, and are split as they fill up. A
+ * directory holds up to 1024 blocks of 127 entries, fewer if names are not
+ * spread evenly. With blocks smaller than 4096 bytes the table takes several
+ * blocks, enough for a directory to hold as many as 60000 entries. Directories
+ * only show up as files to drivers that do not know about them.
+ *
+ * Return: -1 if no FS is currently mounted, or if @dirname is invalid, or if
+ * an entry named @dirname already exists, or if the disk or the directory
+ * @dirname would be in is full. 0 otherwise.
+ */
+int fs_mkdir(const char *dirname);
+
+/**
+ * fs_rmdir - Delete a directory
+ * @dirname: Directory name
+ *
+ * Delete the empty directory named @dirname. Its blocks are freed the same way
+ * as the blocks of a file deleted with fs_delete().
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no directory named
+ * @dirname, or if it is not empty. 0 otherwise.
+ */
+int fs_rmdir(const char *dirname);
+
+/**
+ * fs_create_batch - Create several new files
+ * @filenames: Array of @count file names
+ * @count: Number of files to create
+ * @status: Array of @count entries filled with the result of each creation
+ *
+ * Create every file of @filenames as fs_create() would, but with a single pass
+ * over the root directory and a single write of it for the whole batch.
+ * @status[i] is set to 0 if @filenames[i] was created, or to -1 if it could
+ * not be, for any of the reasons fs_create() would fail. If the root directory
+ * cannot be written back, none of the files the batch added to it are created.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filenames or @status is
+ * NULL. Otherwise, return the number of files created.
+ */
+int fs_create_batch(const char **filenames, size_t count, int *status);
+
+/**
+ * fs_delete_batch - Delete several files
+ * @filenames: Array of @count file names
+ * @count: Number of files to delete
+ * @status: Array of @count entries filled with the result of each deletion
+ *
+ * Delete every file of @filenames as fs_delete() would, but with a single pass
+ * over the root directory. The FAT and root directory blocks modified by the
+ * batch are each written once, after all files are deleted. @status[i] is set
+ * to 0 if @filenames[i] was deleted, or to -1 if it could not be, for any of
+ * the reasons fs_delete() would fail. If the root directory cannot be written
+ * back, none of the files the batch removed from it are deleted.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filenames or @status is
+ * NULL. Otherwise, return the number of files deleted.
+ */
+int fs_delete_batch(const char **filenames, size_t count, int *status);
+
+/**
+ * fs_stat_batch - Get the size of several files
+ * @filenames: Array of @count file names
+ * @count: Number of files to look up
+ * @sizes: Array of @count entries filled with the size of each file
+ *
+ * Look up every file of @filenames with a single pass over the root directory,
+ * without opening them. @sizes[i] is set to the size of @filenames[i], or to -1
+ * if there is no such file.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filenames or @sizes is NULL.
+ * Otherwise, return the number of files found.
+ */
+int fs_stat_batch(const char **filenames, size_t count, int *sizes);
+
 /**
  * fs_ls - List files on file system
  *
@@ -82,6 +405,19 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_lsdir - List files in a directory
+ * @dirname: Directory name
+ *
+ * List information about the files and directories located in directory
+ * @dirname, in no particular order. An empty @dirname or "/" lists the root
+ * directory like fs_ls().
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no directory named
+ * @dirname. 0 otherwise.
+ */
+int fs_lsdir(const char *dirname);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -92,12 +428,12 @@ int fs_ls(void);
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
  * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * simultaneously, unless another limit was given at mount time with
+ * fs_mount_ext().
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * there is no file named @filename to open, or if there are already
- * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
- * descriptor.
+ * there is no file named @filename to open, or if the maximum number of files
+ * are already open. Otherwise, return the file descriptor.
  */
 int fs_open(const char *filename);
 
@@ -133,9 +469,17 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * If the file system was mounted with %FS_MOUNT_SPARSE, @offset may be larger
+ * than the current file size. A write at such an offset leaves a hole between
+ * the old end of the file and @offset: the hole reads back as zeros and takes
+ * no data blocks on disk. Files with holes record their blocks in map blocks
+ * instead of a plain FAT chain; files without holes keep the original layout.
+ * In a file with holes, whole blocks of zeros written later become holes too.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
+ * than the current file size and the file system was not mounted with
+ * %FS_MOUNT_SPARSE. 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
@@ -156,8 +500,9 @@ int fs_lseek(int fd, size_t offset);
  * smaller than @count (it can even be 0 if there is no more space on disk).
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
- * return the number of bytes actually written.
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * the file is pinned by fs_map_blocks(). Otherwise return the number of bytes
+ * actually written.
  */
 int fs_write(int fd, void *buf, size_t count);
 
@@ -173,13 +518,296 @@ int fs_write(int fd, void *buf, size_t count);
  *
  * The number of bytes read can be smaller than @count if there are less than
  * @count bytes until the end of the file (it can even be 0 if the file offset
- * is at the end of the file). The file offset of the file descriptor is
- * implicitly incremented by the number of bytes that were actually read.
+ * is at the end of the file), or if a block of the file cannot be read, in
+ * which case reading stops before it. The file offset of the file descriptor
+ * is implicitly incremented by the number of bytes that were actually read.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * the first block to read cannot be read. Otherwise return the number of bytes
+ * actually read.
+ */
+int fs_read(int fd, void *buf, size_t count);
+
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to start writing at
+ *
+ * Same as fs_write(), except that the data is written at @offset instead of
+ * at the file offset of @fd, which is left unchanged. Several threads can call
+ * fs_pwrite() and fs_pread() at the same time, on the same file descriptor or
+ * not: writes, including fs_write() and fs_writev(), take turns, while reads
+ * go on together between them. Other calls must not run at the same time as
+ * any of these.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * @offset is larger than the current file size and the file system was not
+ * mounted with %FS_MOUNT_SPARSE. Otherwise return the number of bytes
+ * actually written.
+ */
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to start reading at
+ *
+ * Same as fs_read(), except that the data is read from @offset instead of
+ * from the file offset of @fd, which is left unchanged. Since no descriptor
+ * state is shared, several threads can call fs_pread() on the same file
+ * descriptor at the same time, and with fs_pwrite() (see fs_pwrite()).
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
  * return the number of bytes actually read.
  */
-int fs_read(int fd, void *buf, size_t count);
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to write in the file, in order
+ * @iovcnt: Number of entries in @iov
+ *
+ * Same as fs_write(), but the data is gathered from the @iovcnt buffers
+ * described by @iov as if they were one contiguous buffer. The whole vector is
+ * written in a single pass over the file's FAT chain, and the file system
+ * metadata is written back at most once.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov is NULL, or if
+ * one of its buffers is NULL with a non-zero length. Otherwise return the
+ * number of bytes actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to be filled with data, in order
+ * @iovcnt: Number of entries in @iov
+ *
+ * Same as fs_read(), but the data is scattered into the @iovcnt buffers
+ * described by @iov as if they were one contiguous buffer, in a single pass
+ * over the file's FAT chain.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov is NULL, or if
+ * one of its buffers is NULL with a non-zero length. Otherwise return the
+ * number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_sendfile - Send the content of a file to a host file
+ * @fd: File descriptor
+ * @out_fd: Host file descriptor to send the data to
+ * @count: Number of bytes of data to be sent
+ *
+ * Same as fs_read(), but the data is written to host file descriptor @out_fd
+ * instead of being copied in a buffer. Runs of data blocks that follow each
+ * other in the virtual disk are sent by the host kernel straight from the disk
+ * image, without going through user space; holes, packed tails, compressed
+ * clusters and whatever the host cannot send that way go through a buffer of
+ * at most one cluster. Memory use does not depend on @count.
+ *
+ * The file offset of the file descriptor is incremented by the number of bytes
+ * that were actually sent, so that a failed call can be followed by fs_read()
+ * from where it stopped.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if nothing could be sent
+ * to @out_fd. Otherwise return the number of bytes actually sent, 0 at the end
+ * of the file.
+ */
+int fs_sendfile(int fd, int out_fd, size_t count);
+
+/**
+ * fs_map_blocks - Find where the content of a file is stored
+ * @fd: File descriptor
+ * @offset: File offset of the first byte to find
+ * @count: Number of bytes to find
+ * @runs: Array receiving the runs, in file order
+ * @max_runs: Number of entries in @runs
+ *
+ * Describe where the @count bytes of the file referenced by file descriptor
+ * @fd starting at @offset are stored in the virtual disk, as runs of bytes
+ * that follow each other in the disk image, so that they can be used in place
+ * instead of being copied by fs_read(). If the file system was mounted with
+ * %FS_MOUNT_MMAP, every run that is not a hole also points to its bytes in the
+ * mapped disk image. The file offset of @fd is left unchanged.
+ *
+ * Fewer bytes than @count are described if the file ends before, or if @runs
+ * fills up first; the next call can then start at the end of the last run.
+ *
+ * Every call that returns runs pins the file until a matching call to
+ * fs_release_blocks() on @fd, or until @fd is closed: the file can then not be
+ * written to, truncated or compressed, and the data of the runs can be used
+ * safely. Pointers to it must not be used once the pin is released.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @runs is NULL or
+ * @max_runs is not positive, or if the file is compressed, as its data is not
+ * stored the way it reads. Otherwise return the number of runs, 0 if there is
+ * nothing to describe, in which case nothing is pinned.
+ */
+int fs_map_blocks(int fd, size_t offset, size_t count,
+		  struct fs_block_run *runs, int max_runs);
+
+/**
+ * fs_release_blocks - Release blocks found by fs_map_blocks()
+ * @fd: File descriptor
+ *
+ * Drop the pin taken by one call to fs_map_blocks() on file descriptor @fd.
+ * The file can be changed again once none is left.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if it has no pin left. 0
+ * otherwise.
+ */
+int fs_release_blocks(int fd);
+
+/**
+ * fs_ftruncate - Change the size of a file
+ * @fd: File descriptor
+ * @length: New size of the file in bytes
+ *
+ * Cut the file referenced by file descriptor @fd down to @length bytes. The
+ * data blocks past the new end of the file are released as one chain, and
+ * only the root directory and the FAT blocks actually touched are written
+ * back. The file offset of any file descriptor open on this file that lies
+ * past the new end is moved to the new end.
+ *
+ * If the file system was mounted with %FS_MOUNT_SPARSE, @length may also be
+ * larger than the current file size; the file is then extended with a hole
+ * (see fs_lseek()) and no data block is allocated.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @length is larger than
+ * the current file size and the file system was not mounted with
+ * %FS_MOUNT_SPARSE, or if the file is pinned by fs_map_blocks(). 0 otherwise.
+ */
+int fs_ftruncate(int fd, size_t length);
+
+/**
+ * fs_truncate - Change the size of a file by name
+ * @filename: File name
+ * @length: New size of the file in bytes
+ *
+ * Same as fs_ftruncate(), for the file named @filename, which does not need to
+ * be open.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
+ * there is no file named @filename, or if @length is larger than the current
+ * file size and the file system was not mounted with %FS_MOUNT_SPARSE. 0
+ * otherwise.
+ */
+int fs_truncate(const char *filename, size_t length);
+
+/**
+ * fs_clone - Clone a file
+ * @src_filename: Name of the file to clone
+ * @dst_filename: Name of the new file
+ *
+ * Create a new file named @dst_filename with the same content as the file named
+ * @src_filename, without copying any data: both files share the same data
+ * blocks, and a block is only copied when one of the files writes to it
+ * (copy-on-write). The number of files sharing each data block is kept in a
+ * reference count table stored on disk, which is created by the first clone.
+ * Files that share blocks use the same layout as files with holes (see
+ * fs_lseek()).
+ *
+ * Return: -1 if no FS is currently mounted, or if @src_filename or
+ * @dst_filename is invalid, or if there is no file named @src_filename, or if
+ * a file named @dst_filename already exists, or if the root directory is full,
+ * or if there is not enough space on disk for the new file's block map. 0
+ * otherwise.
+ */
+int fs_clone(const char *src_filename, const char *dst_filename);
+
+/**
+ * fs_copy - Copy a file
+ * @src_filename: Name of the file to copy
+ * @dst_filename: Name of the new file
+ *
+ * Create a new file named @dst_filename holding a copy of the content of the
+ * file named @src_filename. Unlike fs_clone(), the new file gets data blocks of
+ * its own. They are all allocated before any data is copied, in contiguous runs
+ * where the disk allows it. The data is then copied within the virtual disk by
+ * the block layer, one transfer per run, and the FAT and root directory are
+ * written back once at the end. Holes in the source stay holes in the copy.
+ *
+ * Return: -1 if no FS is currently mounted, or if @src_filename or
+ * @dst_filename is invalid, or if there is no file named @src_filename, or if
+ * a file named @dst_filename already exists, or if the root directory is full,
+ * or if there is not enough space on disk for the copy. 0 otherwise.
+ */
+int fs_copy(const char *src_filename, const char *dst_filename);
+
+/**
+ * fs_compress - Store a file compressed
+ * @filename: File name
+ *
+ * Switch the file named @filename to compressed storage. Its content is divided
+ * into clusters of 8 blocks, and each cluster is compressed and stored in as
+ * few blocks as it takes, or stored as is if compressing it would not save a
+ * block. Data already in the file is compressed right away. From then on,
+ * fs_write() and fs_read() compress and decompress whole clusters
+ * transparently. A write smaller than a cluster reads and compresses the whole
+ * cluster again. The file stays compressed until it is deleted, and its clones
+ * and copies are compressed as well.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
+ * there is no file named @filename, or if the file is pinned by
+ * fs_map_blocks(), or if there is not enough space on disk to store the file
+ * compressed, in which case only part of it may be. 0 otherwise.
+ */
+int fs_compress(const char *filename);
+
+/**
+ * fs_import - Create several files with their content
+ * @files: Array of @count files to create
+ * @count: Number of files to create
+ * @status: Array of @count entries filled with the result of each import
+ *
+ * Create every file of @files as fs_create() would and write its content. The
+ * data blocks of all files are allocated first, in a single contiguous run if
+ * the disk has one. The data is then written by several threads, in large
+ * transfers, and the FAT and root directory are written back once at the end.
+ * The pages of @files[i].buf are first touched by these threads, so a buffer
+ * mapped from a host file is read in parallel as well. Files are stored as
+ * plain FAT chains, whatever the mount flags. @status[i] is set to 0 if
+ * @files[i] was imported, or to -1 if it could not be, for any of the reasons
+ * fs_create() would fail, or if there is not enough space on disk for it.
+ *
+ * Return: -1 if no FS is currently mounted, or if @files or @status is NULL, or
+ * if writing back the FAT or root directory fails. Otherwise, return the number
+ * of files imported.
+ */
+int fs_import(const struct fs_import_file *files, size_t count, int *status);
+
+/**
+ * fs_export - Read the content of several files
+ * @files: Array of @count files to read
+ * @count: Number of files to read
+ * @status: Array of @count entries filled with the result of each export
+ *
+ * Read the beginning of every file of @files into @files[i].buf, up to
+ * @files[i].size bytes, without opening the files. The blocks of all files are
+ * looked up first, then read by several threads, in large transfers, straight
+ * into the buffers. @status[i] is set to the number of bytes read from
+ * @files[i], or to -1 if there is no such file, or if it is a directory, or if
+ * reading it fails.
+ *
+ * Return: -1 if no FS is currently mounted, or if @files or @status is NULL.
+ * Otherwise, return the number of files read.
+ */
+int fs_export(const struct fs_export_file *files, size_t count, int *status);
 
 #endif /* _FS_H */
@@ -0,0 +1,242 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/*
+ * Every sequence starts with a token byte: the high nibble is the length of the
+ * literal run that follows, the low nibble the length of the match after it
+ * minus LZ_MIN_MATCH. A nibble of 15 means the length goes on in extra bytes,
+ * each adding up to 255. The match is given by a 2 byte little endian offset
+ * back from the current output position. The last sequence only has literals.
+ */
+
+/* Shortest match worth encoding */
+#define LZ_MIN_MATCH 4
+
+/* Nibble value saying more length bytes follow */
+#define LZ_LEN_MORE 15
+
+/* Size of the hash table of recent positions, as a power of 2 */
+#define LZ_HASH_BITS 12
+
+/* Misses in a row after which the compressor starts skipping ahead faster */
+#define LZ_SKIP_SHIFT 5
+
+/* Unit of the copies done by the decompressor */
+#define LZ_WORD 8
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));	/* p may be unaligned */
+	return v;
+}
+
+static size_t lz_hash(uint32_t seq)
+{
+	return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static size_t lz_match_len(const uint8_t *p, const uint8_t *m,
+			   const uint8_t *end)
+{
+	const uint8_t *start = p;
+
+	/* Compare a word at a time, the first differing byte ends the match */
+	while (end - p >= (ptrdiff_t)sizeof(uint64_t)) {
+		uint64_t a, b;
+
+		memcpy(&a, p, sizeof(a));
+		memcpy(&b, m, sizeof(b));
+		if (a != b)
+			return p - start + __builtin_ctzll(a ^ b) / 8;
+		p += sizeof(uint64_t);
+		m += sizeof(uint64_t);
+	}
+	while (p < end && *p == *m) {
+		p++;
+		m++;
+	}
+
+	return p - start;
+}
+
+static uint8_t *lz_put_len(uint8_t *op, const uint8_t *oend, size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op >= oend)
+			return NULL;
+		*op++ = 255;
+	}
+	if (op >= oend)
+		return NULL;
+	*op++ = len;
+
+	return op;
+}
+
+static uint8_t *lz_emit(uint8_t *op, const uint8_t *oend, const uint8_t *lit,
+			size_t lit_len, size_t offset, size_t match_len)
+{
+	uint8_t *token;
+
+	/* Literal run */
+	if (op >= oend)
+		return NULL;
+	token = op++;
+	*token = (lit_len < LZ_LEN_MORE ? lit_len : LZ_LEN_MORE) << 4;
+	if (lit_len >= LZ_LEN_MORE) {
+		op = lz_put_len(op, oend, lit_len - LZ_LEN_MORE);
+		if (!op)
+			return NULL;
+	}
+	if ((size_t)(oend - op) < lit_len)
+		return NULL;
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	/* The last sequence stops after its literals */
+	if (!match_len)
+		return op;
+
+	if (oend - op < 2)
+		return NULL;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	match_len -= LZ_MIN_MATCH;
+	*token |= match_len < LZ_LEN_MORE ? match_len : LZ_LEN_MORE;
+	if (match_len >= LZ_LEN_MORE)
+		op = lz_put_len(op, oend, match_len - LZ_LEN_MORE);
+
+	return op;
+}
+
+size_t lz_compress(void *dst, size_t dst_cap, const void *src, size_t src_len)
+{
+	const uint8_t *base = src;
+	const uint8_t *end = base + src_len;
+	const uint8_t *ip = base;
+	const uint8_t *anchor = base;
+	uint8_t *op = dst;
+	const uint8_t *oend = op + dst_cap;
+	uint32_t table[1 << LZ_HASH_BITS];
+	size_t misses = 0;
+
+	memset(table, 0, sizeof(table));
+	while (end - ip >= LZ_MIN_MATCH) {
+		size_t pos = ip - base;
+		uint32_t seq = lz_read32(ip);
+		size_t h = lz_hash(seq);
+		size_t cand = table[h];
+		size_t len;
+
+		table[h] = pos;
+		if (cand >= pos || pos - cand > LZ_WINDOW ||
+		    lz_read32(base + cand) != seq) {
+			/* Data that does not compress is skipped faster and faster */
+			misses++;
+			ip += 1 + (misses >> LZ_SKIP_SHIFT);
+			continue;
+		}
+		misses = 0;
+
+		len = LZ_MIN_MATCH + lz_match_len(ip + LZ_MIN_MATCH,
+						  base + cand + LZ_MIN_MATCH, end);
+		op = lz_emit(op, oend, anchor, ip - anchor, pos - cand, len);
+		if (!op)
+			return 0;
+		ip += len;
+		anchor = ip;
+	}
+
+	op = lz_emit(op, oend, anchor, end - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - (uint8_t *)dst;
+}
+
+static int lz_wild_copy(uint8_t *dst, const uint8_t *src, size_t len,
+			size_t src_room, size_t dst_room)
+{
+	/*
+	 * Copy a word at a time, possibly past len, if both buffers have room for
+	 * it; src must be at least a word behind dst if they overlap
+	 */
+	if (src_room < len + LZ_WORD || dst_room < len + LZ_WORD)
+		return -1;
+	for (size_t i = 0; i < len; i += LZ_WORD)
+		memcpy(dst + i, src + i, LZ_WORD);
+
+	return 0;
+}
+
+static int lz_get_len(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+ssize_t lz_decompress(void *dst, size_t dst_cap, const void *src,
+		      size_t src_len)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = ip + src_len;
+	uint8_t *op = dst;
+	uint8_t *oend = op + dst_cap;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t lit_len = token >> 4;
+		size_t match_len = token & LZ_LEN_MORE;
+		size_t offset;
+		const uint8_t *m;
+
+		if (lit_len == LZ_LEN_MORE && lz_get_len(&ip, iend, &lit_len))
+			return -1;
+		if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op))
+			return -1;
+		if (lz_wild_copy(op, ip, lit_len, iend - ip, oend - op))
+			memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		/* Literals that end the input end the last sequence */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (match_len == LZ_LEN_MORE &&
+		    lz_get_len(&ip, iend, &match_len))
+			return -1;
+		match_len += LZ_MIN_MATCH;
+		if (!offset || offset > (size_t)(op - (uint8_t *)dst) ||
+		    match_len > (size_t)(oend - op))
+			return -1;
+
+		/* A match may overlap the bytes it produces, repeating them */
+		m = op - offset;
+		if (offset >= LZ_WORD &&
+		    !lz_wild_copy(op, m, match_len, SIZE_MAX, oend - op)) {
+			op += match_len;
+		} else {
+			while (match_len--)
+				*op++ = *m++;
+		}
+	}
+
+	return op - (uint8_t *)dst;
+}
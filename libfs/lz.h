@@ -0,0 +1,45 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h> /* for size_t definition */
+#include <sys/types.h> /* for ssize_t definition */
+
+/** Largest distance a match can reach back, in bytes */
+#define LZ_WINDOW 65535
+
+/**
+ * lz_compress - Compress a buffer
+ * @dst: Buffer receiving the compressed data
+ * @dst_cap: Size of @dst in bytes
+ * @src: Data to compress
+ * @src_len: Size of @src in bytes
+ *
+ * Compress @src_len bytes from @src into @dst with a byte oriented LZ77 codec:
+ * a sequence of literal runs, each followed by a copy of earlier output found
+ * through a hash of the next four bytes. Compression is greedy and single pass,
+ * tuned for speed over ratio. Only data within %LZ_WINDOW bytes of the current
+ * position can be referenced.
+ *
+ * Return: Size of the compressed data in bytes, or 0 if it does not fit in
+ * @dst_cap bytes, in which case the content of @dst is undefined.
+ */
+size_t lz_compress(void *dst, size_t dst_cap, const void *src, size_t src_len);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @dst: Buffer receiving the decompressed data
+ * @dst_cap: Size of @dst in bytes
+ * @src: Data produced by lz_compress()
+ * @src_len: Size of @src in bytes
+ *
+ * Decompress @src_len bytes from @src into @dst. Every length and offset read
+ * from @src is checked, so damaged input cannot make it read or write out of
+ * bounds.
+ *
+ * Return: -1 if @src is not valid compressed data, or if it decompresses to
+ * more than @dst_cap bytes. Size of the decompressed data in bytes otherwise.
+ */
+ssize_t lz_decompress(void *dst, size_t dst_cap, const void *src,
+		      size_t src_len);
+
+#endif /* _LZ_H */